@@ -0,0 +1,520 @@
+/*
+ * Benchmark driver for minibsdiff.
+ *
+ * Diffs and applies the bundled firmware images and a few synthetic inputs,
+ * with each match engine and index stride, and reports throughput per
+ * phase, peak RSS, patch size and compression ratio as JSON, and how each
+ * variant trades patch size for speed and memory. With --baseline, the
+ * results are compared against an earlier run and regressions make the
+ * driver exit non-zero.
+ *
+ * Usage:
+ *
+ *   $ ./minibsdiff-bench [--out <file>] [--baseline <file>]
+ *                        [--threshold <percent>] [--repeat <n>]
+ *                        [--synthetic-mb <n>] [--data-dir <dir>]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bsdiff.h"
+#include "bspatch.h"
+
+/* ------------------------------------------------------------------------- */
+/* -- Results -------------------------------------------------------------- */
+
+#define BENCH_NAME_MAX 64
+
+typedef struct {
+  char name[BENCH_NAME_MAX];
+  int ok;                  /* round trip reproduced the new file */
+  off_t oldsize, newsize;
+  off_t patchsize;
+  double ratio;            /* newsize / patchsize */
+  double diff_time;        /* whole bsdiff() call */
+  double sort_mbps;        /* old bytes sorted per second */
+  double scan_mbps;        /* new bytes scanned per second */
+  double compress_mbps;    /* decompressed block bytes compressed per second */
+  double decompress_mbps;  /* decompressed block bytes produced per second */
+  double apply_mbps;       /* new bytes produced per second */
+  long peak_rss_kb;
+} bench_result;
+
+static double
+mbps(double bytes, double secs)
+{
+  if (secs <= 0) return 0;
+  return bytes / (1024.0 * 1024.0) / secs;
+}
+
+/* Keep the fastest of several runs; sizes don't change between them */
+static void
+keep_best(bench_result* best, const bench_result* r, int first)
+{
+  if (first) { *best = *r; return; }
+#define BEST(f) if (r->f > best->f) best->f = r->f
+  BEST(sort_mbps); BEST(scan_mbps); BEST(compress_mbps);
+  BEST(decompress_mbps); BEST(apply_mbps);
+#undef BEST
+  if (r->diff_time < best->diff_time) best->diff_time = r->diff_time;
+  best->ok = best->ok && r->ok;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Running a single case ------------------------------------------------ */
+
+static void
+run_once(const char* name, u_char* old, off_t oldsz, u_char* new, off_t newsz,
+         const bsdiff_options* opts, bench_result* r)
+{
+  bsdiff_stats ds;
+  bspatch_stats ps;
+  bspatch_workspace ws;
+  u_char *patch, *out, *wsp;
+  off_t patchsz, wssz;
+  double t0, compress;
+  int res;
+
+  memset(r, 0, sizeof(*r));
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->oldsize = oldsz;
+  r->newsize = newsz;
+
+  patchsz = bsdiff_patchsize_max(oldsz, newsz);
+  if ((patch = malloc(patchsz+1)) == NULL) return;
+
+  t0 = minibsdiff_clock();
+  res = bsdiff_with_options(old, oldsz, new, newsz, patch, patchsz, opts,
+                            &ds);
+  r->diff_time = minibsdiff_clock() - t0;
+  if (res <= 0) { free(patch); return; }
+  patchsz = res;
+
+  wssz = bspatch_workspace_size(patch, patchsz, &ws);
+  out = malloc(newsz+1);
+  wsp = malloc(wssz+1);
+  if (wssz < 0 || out == NULL || wsp == NULL) {
+    free(patch); free(out); free(wsp);
+    return;
+  }
+  bspatch_workspace_attach(&ws, wsp);
+  res = bspatch_with_workspace(old, oldsz, out, newsz, patch, patchsz,
+                               &ws, &ps);
+
+  r->ok = (res == 0) && (memcmp(out, new, newsz) == 0);
+  r->patchsize = patchsz;
+  r->ratio = patchsz ? (double)newsz / (double)patchsz : 0;
+  compress = ds.ctrl_compress_time + ds.diff_compress_time +
+             ds.extra_compress_time;
+  r->sort_mbps = mbps(oldsz, ds.sort_time);
+  r->scan_mbps = mbps(newsz, ds.scan_time);
+  r->compress_mbps = mbps(ds.ctrllen + ds.dblen + ds.eblen, compress);
+  r->decompress_mbps = mbps(ds.ctrllen + ds.dblen + ds.eblen,
+                            ps.decompress_time);
+  r->apply_mbps = mbps(newsz, ps.apply_time);
+
+  free(patch);
+  free(out);
+  free(wsp);
+}
+
+/* Run a case in a child process, so that its peak RSS is its own */
+static int
+run_case(const char* name, u_char* old, off_t oldsz, u_char* new, off_t newsz,
+         const bsdiff_options* opts, int repeat, bench_result* best)
+{
+  bench_result r;
+  struct rusage ru;
+  int fds[2], status, i;
+  pid_t pid;
+
+  if (pipe(fds) != 0) return -1;
+  if ((pid = fork()) < 0) return -1;
+
+  if (pid == 0) {
+    close(fds[0]);
+    for (i = 0; i < repeat; i++) {
+      run_once(name, old, oldsz, new, newsz, opts, &r);
+      keep_best(best, &r, i == 0);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    best->peak_rss_kb = ru.ru_maxrss;
+    if (write(fds[1], best, sizeof(*best)) != (ssize_t)sizeof(*best))
+      _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  i = (read(fds[0], best, sizeof(*best)) == (ssize_t)sizeof(*best));
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  return (i && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Inputs --------------------------------------------------------------- */
+
+static off_t
+read_input(const char* dir, const char* f, u_char** buf)
+{
+  char path[1024];
+  FILE* fp;
+  long sz;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, f);
+  if ((fp = fopen(path, "rb")) == NULL) return -1;
+  if (fseek(fp, 0, SEEK_END) != 0 || (sz = ftell(fp)) < 0 ||
+      fseek(fp, 0, SEEK_SET) != 0 || (*buf = malloc(sz+1)) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  if (fread(*buf, 1, sz, fp) != (size_t)sz) {
+    free(*buf);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  return sz;
+}
+
+static uint32_t
+xorshift(uint32_t* s)
+{
+  *s ^= *s << 13; *s ^= *s >> 17; *s ^= *s << 5;
+  return *s;
+}
+
+/* A deterministic firmware-like image: runs of pseudo-random "code"
+   interleaved with tables of little-endian pointers and 0xFF padding */
+static void
+synth_image(u_char* buf, off_t size, uint32_t seed)
+{
+  uint32_t s = seed, v;
+  off_t i, n;
+
+  for (i = 0; i < size; ) {
+    n = 256 + (xorshift(&s) % 4096);
+    if (n > size - i) n = size - i;
+    switch (xorshift(&s) % 8) {
+    case 0: /* pointer table */
+      for (v = 0x08010000u + (xorshift(&s) & 0xffff); n >= 4 && i+4 <= size;
+           n -= 4, i += 4, v += 4 * (1 + xorshift(&s) % 8)) {
+        buf[i] = v; buf[i+1] = v >> 8; buf[i+2] = v >> 16; buf[i+3] = v >> 24;
+      }
+      break;
+    case 1: /* erased flash */
+      memset(buf + i, 0xFF, n);
+      i += n;
+      break;
+    default: /* code with a small alphabet, which compresses like code */
+      for (; n > 0; n--, i++) buf[i] = (u_char)(xorshift(&s) % 64) * 3;
+      break;
+    }
+  }
+}
+
+/* Derive a "new release" from 'old': insert a block near the start so that
+   everything after it shifts, and rewrite scattered bytes */
+static off_t
+synth_release(const u_char* old, off_t oldsz, u_char* new, uint32_t seed)
+{
+  uint32_t s = seed;
+  off_t ins = oldsz / 64, at = oldsz / 16, i, newsz;
+
+  memcpy(new, old, at);
+  for (i = 0; i < ins; i++) new[at+i] = (u_char)xorshift(&s);
+  memcpy(new + at + ins, old + at, oldsz - at);
+  newsz = oldsz + ins;
+
+  for (i = 0; i < newsz / 4096; i++)
+    new[xorshift(&s) % newsz] ^= (u_char)(1 + xorshift(&s) % 255);
+
+  return newsz;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- JSON output and baseline comparison ---------------------------------- */
+
+static void
+write_json(FILE* fp, const bench_result* r, int n)
+{
+  int i;
+
+  fprintf(fp, "{\n  \"version\": 1,\n  \"cases\": [\n");
+  for (i = 0; i < n; i++) {
+    fprintf(fp, "    {\"name\": \"%s\", \"ok\": %d, \"oldsize\": %lld, "
+            "\"newsize\": %lld, \"patchsize\": %lld, \"ratio\": %.3f, "
+            "\"diff_time\": %.6f, \"sort_mbps\": %.3f, \"scan_mbps\": %.3f, "
+            "\"compress_mbps\": %.3f, \"decompress_mbps\": %.3f, "
+            "\"apply_mbps\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+            r[i].name, r[i].ok, (long long)r[i].oldsize,
+            (long long)r[i].newsize, (long long)r[i].patchsize, r[i].ratio,
+            r[i].diff_time, r[i].sort_mbps, r[i].scan_mbps,
+            r[i].compress_mbps, r[i].decompress_mbps, r[i].apply_mbps,
+            r[i].peak_rss_kb, (i == n-1) ? "" : ",");
+  }
+  fprintf(fp, "  ]\n}\n");
+}
+
+/* Find "key": <number> in a line written by write_json */
+static int
+json_number(const char* line, const char* key, double* v)
+{
+  char pat[BENCH_NAME_MAX+4];
+  const char* p;
+
+  snprintf(pat, sizeof(pat), "\"%s\":", key);
+  if ((p = strstr(line, pat)) == NULL) return 0;
+  return sscanf(p + strlen(pat), "%lf", v) == 1;
+}
+
+static int
+json_name(const char* line, char* name)
+{
+  const char* p = strstr(line, "\"name\": \"");
+  const char* e;
+
+  if (p == NULL) return 0;
+  p += 9;
+  if ((e = strchr(p, '"')) == NULL || e - p >= BENCH_NAME_MAX) return 0;
+  memcpy(name, p, e - p);
+  name[e - p] = '\0';
+  return 1;
+}
+
+/* Compare one metric; 'higher' is true if bigger numbers are better */
+static int
+regressed(const char* name, const char* key, double base, double now,
+          int higher, double threshold)
+{
+  double change;
+
+  if (base <= 0) return 0;
+  change = (now - base) / base * 100.0;
+  if (higher) change = -change;
+  if (change <= threshold) return 0;
+
+  printf("REGRESSION %s %s: %.3f -> %.3f (%.1f%% worse)\n",
+         name, key, base, now, change);
+  return 1;
+}
+
+static int
+compare_baseline(const char* f, const bench_result* r, int n,
+                 double threshold)
+{
+  static const char* faster[] = { "sort_mbps", "scan_mbps", "compress_mbps",
+                                  "decompress_mbps", "apply_mbps" };
+  char line[4096], name[BENCH_NAME_MAX];
+  double base, now;
+  FILE* fp;
+  int i, k, bad = 0;
+
+  if ((fp = fopen(f, "r")) == NULL) {
+    fprintf(stderr, "ERROR: Couldn't open baseline %s\n", f);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (!json_name(line, name)) continue;
+    for (i = 0; i < n && strcmp(r[i].name, name) != 0; i++);
+    if (i == n) continue;
+
+    /* Patch size is deterministic, so any growth is a regression */
+    if (json_number(line, "patchsize", &base))
+      bad += regressed(name, "patchsize", base, (double)r[i].patchsize, 0,
+                       0.0);
+    if (json_number(line, "peak_rss_kb", &base))
+      bad += regressed(name, "peak_rss_kb", base, (double)r[i].peak_rss_kb,
+                       0, threshold);
+    for (k = 0; k < (int)(sizeof(faster)/sizeof(faster[0])); k++) {
+      if (!json_number(line, faster[k], &base)) continue;
+      now = (k == 0) ? r[i].sort_mbps : (k == 1) ? r[i].scan_mbps :
+            (k == 2) ? r[i].compress_mbps : (k == 3) ? r[i].decompress_mbps :
+            r[i].apply_mbps;
+      bad += regressed(name, faster[k], base, now, 1, threshold);
+    }
+  }
+
+  fclose(fp);
+  return bad;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Driver --------------------------------------------------------------- */
+
+#define BENCH_MAX_CASES 32
+
+/* How each case is diffed; all but the first get their suffix appended to
+   the case name */
+static const struct {
+  const char* suffix;
+  int engine;
+  int stride;
+} variants[] = {
+  { "",      BSDIFF_ENGINE_SUFFIX, 0 },
+  { "/hash", BSDIFF_ENGINE_HASH,   0 },
+  { "/k4",   BSDIFF_ENGINE_SUFFIX, 4 },
+  { "/k8",   BSDIFF_ENGINE_SUFFIX, 8 },
+  { "/k16",  BSDIFF_ENGINE_SUFFIX, 16 },
+};
+
+#define BENCH_VARIANTS ((int)(sizeof(variants)/sizeof(variants[0])))
+
+static void
+run_variants(const char* name, u_char* old, off_t oldsz, u_char* new,
+             off_t newsz, int repeat, bench_result* results, int* n,
+             int* failed)
+{
+  bsdiff_options opts;
+  char variant_name[BENCH_NAME_MAX];
+  int v;
+
+  for (v = 0; v < BENCH_VARIANTS; v++) {
+    memset(&opts, 0, sizeof(opts));
+    opts.engine = variants[v].engine;
+    opts.stride = variants[v].stride;
+    snprintf(variant_name, sizeof(variant_name), "%s%s", name,
+             variants[v].suffix);
+    if (*n < BENCH_MAX_CASES &&
+        run_case(variant_name, old, oldsz, new, newsz, &opts, repeat,
+                 &results[*n]) == 0)
+      (*n)++;
+    else
+      (*failed)++;
+  }
+}
+
+/* Patch size, diff time and peak RSS of each variant next to the default
+   of its case */
+static void
+print_tradeoff(const bench_result* r, int n)
+{
+  char name[BENCH_NAME_MAX];
+  const char* slash;
+  int i, k;
+
+  for (i = 0; i < n; i++) {
+    if ((slash = strchr(r[i].name, '/')) == NULL) continue;
+    snprintf(name, sizeof(name), "%.*s", (int)(slash - r[i].name), r[i].name);
+    for (k = 0; k < n && strcmp(r[k].name, name) != 0; k++);
+    if (k == n || r[k].patchsize <= 0 || r[i].diff_time <= 0 ||
+        r[k].peak_rss_kb <= 0)
+      continue;
+    printf("%-16s %-5s patch %+.1f%%, diff %.2fx as fast, rss %+.1f%%\n",
+           name, slash + 1,
+           ((double)r[i].patchsize - (double)r[k].patchsize) * 100.0 /
+           (double)r[k].patchsize, r[k].diff_time / r[i].diff_time,
+           ((double)r[i].peak_rss_kb - (double)r[k].peak_rss_kb) * 100.0 /
+           (double)r[k].peak_rss_kb);
+  }
+}
+
+static void
+usage(const char* progname)
+{
+  printf("usage: %s [--out <file>] [--baseline <file>] "
+         "[--threshold <percent>]\n"
+         "          [--repeat <n>] [--synthetic-mb <n>] [--data-dir <dir>]\n",
+         progname);
+  exit(EXIT_FAILURE);
+}
+
+int
+main(int ac, char* av[])
+{
+  static const char* images[][2] = {
+    { "316.bin", "318.bin" },
+    { "318.bin", "319.bin" },
+    { "316.bin", "319.bin" },
+  };
+  bench_result results[BENCH_MAX_CASES];
+  const char *out = "bench.json", *baseline = NULL, *dir = ".";
+  double threshold = 10.0;
+  int repeat = 3, synth_mb = 16, n = 0, i, failed = 0, bad;
+  u_char *old, *new;
+  off_t oldsz, newsz;
+  char name[BENCH_NAME_MAX];
+  FILE* fp;
+
+  for (i = 1; i < ac; i++) {
+    if (i+1 >= ac) usage(av[0]);
+    if (strcmp(av[i], "--out") == 0) out = av[++i];
+    else if (strcmp(av[i], "--baseline") == 0) baseline = av[++i];
+    else if (strcmp(av[i], "--threshold") == 0) threshold = atof(av[++i]);
+    else if (strcmp(av[i], "--repeat") == 0) repeat = atoi(av[++i]);
+    else if (strcmp(av[i], "--synthetic-mb") == 0) synth_mb = atoi(av[++i]);
+    else if (strcmp(av[i], "--data-dir") == 0) dir = av[++i];
+    else usage(av[0]);
+  }
+  if (repeat < 1 || synth_mb < 0) usage(av[0]);
+
+  /* Bundled firmware images */
+  for (i = 0; i < (int)(sizeof(images)/sizeof(images[0])); i++) {
+    if ((oldsz = read_input(dir, images[i][0], &old)) < 0) continue;
+    if ((newsz = read_input(dir, images[i][1], &new)) < 0) {
+      free(old);
+      continue;
+    }
+    snprintf(name, sizeof(name), "%.*s-%.*s", 3, images[i][0],
+             3, images[i][1]);
+    run_variants(name, old, oldsz, new, newsz, repeat, results, &n, &failed);
+    free(old);
+    free(new);
+  }
+
+  /* Synthetic large inputs */
+  if (synth_mb > 0) {
+    oldsz = (off_t)synth_mb * 1024 * 1024;
+    old = malloc(oldsz);
+    new = malloc(oldsz + oldsz / 64);
+    if (old == NULL || new == NULL) {
+      fprintf(stderr, "ERROR: Couldn't allocate synthetic inputs\n");
+      return EXIT_FAILURE;
+    }
+    synth_image(old, oldsz, 0x2545F491u);
+    newsz = synth_release(old, oldsz, new, 0x9E3779B9u);
+    snprintf(name, sizeof(name), "synthetic-%dM", synth_mb);
+    run_variants(name, old, oldsz, new, newsz, 1, results, &n, &failed);
+    free(old);
+    free(new);
+  }
+
+  for (i = 0; i < n; i++) {
+    printf("%-16s %s patch=%lld ratio=%.1f diff=%.3fs sort=%.1fMB/s "
+           "scan=%.1fMB/s compress=%.1fMB/s decompress=%.1fMB/s "
+           "apply=%.1fMB/s rss=%ldKB\n",
+           results[i].name, results[i].ok ? "ok  " : "FAIL",
+           (long long)results[i].patchsize, results[i].ratio,
+           results[i].diff_time,
+           results[i].sort_mbps, results[i].scan_mbps,
+           results[i].compress_mbps, results[i].decompress_mbps,
+           results[i].apply_mbps, results[i].peak_rss_kb);
+    if (!results[i].ok) failed++;
+  }
+  print_tradeoff(results, n);
+
+  if ((fp = fopen(out, "w")) == NULL) {
+    fprintf(stderr, "ERROR: Couldn't open %s for writing\n", out);
+    return EXIT_FAILURE;
+  }
+  write_json(fp, results, n);
+  fclose(fp);
+  printf("Wrote %s\n", out);
+
+  if (baseline != NULL) {
+    bad = compare_baseline(baseline, results, n, threshold);
+    if (bad < 0) return EXIT_FAILURE;
+    printf("%d regression(s) against %s\n", bad, baseline);
+    if (bad > 0) failed++;
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -29,30 +29,60 @@
 __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06 01:59:05 cperciva Exp $");
 #endif
 
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "bsdiff.h"
+#include "bsfilter.h"
 #include "lz4.h" 
 #include "lz4hc.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
 
 /* Header is
-   0  8       BSDIFF_CONFIG_MAGIC (see minibsdiff-config.h)
+   0  8       BSDIFF_CONFIG_MAGIC_EXT (see minibsdiff-config.h)
    8  8       length of LZ4 compressed ctrl block
    16 8       length of LZ4 compressed diff block
-   24 8       length of new file */
+   24 8       length of new file
+   32 8       length of header
+   40 8       length of decompressed ctrl block
+   48 8       length of decompressed diff block
+   56 8       length of decompressed extra block
+   Patches made with a filter, word-wise diffs or ctrl ops start with
+   BSDIFF_CONFIG_MAGIC_FLAGS and go on
+   64 8       feature flags (see minibsdiff-config.h)
+   72 8       offset of the old file in its image, seen by the filter
+   80 8       offset of the new file in its image
+   88 8       length of old file, which the patcher filters a copy of
+   With BSDIFF_EXTRA_DICT the header goes on
+   96 8       offset of the extra block's dictionary in the old file
+   104 8      length of the dictionary, at most 64KB */
 /* File is
-   0  32      Header
-   32 ??      LZ4 compressed ctrl block
+   0  64-112  Header
+   ?? ??      LZ4 compressed ctrl block
    ?? ??      LZ4 compressed diff block
    ?? ??      LZ4 compressed extra block */
+/* With BSDIFF_WORD_DIFF the first number of each ctrl triple is twice the
+   length of the add run, plus 1 if the run is word-wise. With
+   BSDIFF_OP_FILL a triple (-1,n,b) writes n bytes of value b, and with
+   BSDIFF_OP_COPY a triple (-2,n,d) copies n bytes from d bytes back in the
+   new file, one at a time where they overlap. Neither moves the old file
+   position. */
+/* With BSDIFF_SPARSE_DIFF the diff of each add run is a sequence of
+   (zeros, literals) pairs of LEB128 numbers, each followed by its literal
+   diff bytes, which together cover the run. Word-wise runs only skip
+   whole aligned words. */
 
-int max_ctrllen = 0;
-int max_eblen = 0;
+#define BSDIFF_HEADER_SIZE 64
+#define BSDIFF_FLAGS_HEADER_SIZE 96
+#define BSDIFF_DICT_HEADER_SIZE 112
 
 static void
 split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
@@ -155,26 +185,100 @@ qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
   for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/* Strided index: sort the suffixes at offsets 0,k,2k.. and the empty one
+   with a multikey quicksort, on at most BSDIFF_STRIDE_DEPTH bytes */
+static int
+suffix_key(const u_char *old,off_t oldsize,off_t i)
+{
+  return (i<oldsize) ? old[i] : -1;
+}
+
+static int
+suffix_cmp(const u_char *old,off_t oldsize,off_t a,off_t b,off_t d)
+{
+  int x,y;
+
+  for(;d<BSDIFF_STRIDE_DEPTH;d++) {
+    x=suffix_key(old,oldsize,a+d);
+    y=suffix_key(old,oldsize,b+d);
+    if(x!=y) return x-y;
+    if(x<0) break;
+  };
+  return 0;
+}
+
+static void
+mkqsort(off_t *a,off_t n,off_t d,const u_char *old,off_t oldsize)
+{
+  off_t lt,gt,i,t,k;
+  int v,c;
+
+  while((n>1) && (d<BSDIFF_STRIDE_DEPTH)) {
+    if(n<16) {
+      for(i=1;i<n;i++)
+        for(k=i;(k>0) && (suffix_cmp(old,oldsize,a[k-1],a[k],d)>0);k--) {
+          t=a[k];a[k]=a[k-1];a[k-1]=t;
+        };
+      return;
+    };
+
+    /* Partition into <, = and > the pivot's byte at depth d */
+    v=suffix_key(old,oldsize,a[n/2]+d);
+    lt=0;gt=n;
+    for(i=0;i<gt;) {
+      c=suffix_key(old,oldsize,a[i]+d);
+      if(c<v) { t=a[i];a[i]=a[lt];a[lt]=t; lt++; i++; }
+      else if(c>v) { gt--; t=a[i];a[i]=a[gt];a[gt]=t; }
+      else i++;
+    };
+    mkqsort(a,lt,d,old,oldsize);
+    mkqsort(a+gt,n-gt,d,old,oldsize);
+
+    /* The equal part goes on one byte deeper, unless it ended there */
+    if(v<0) return;
+    a+=lt;n=gt-lt;d++;
+  };
+}
+
+static off_t *
+stride_sort(const u_char *old,off_t oldsize,off_t k,off_t *n)
+{
+  off_t *I;
+  off_t i;
+
+  *n=(oldsize+k-1)/k+1;
+  if((I=malloc(*n*sizeof(off_t)))==NULL) return NULL;
+  for(i=0;i<*n-1;i++) I[i]=i*k;
+  I[*n-1]=oldsize;
+  mkqsort(I,*n,0,old,oldsize);
+  return I;
+}
+
 static off_t
-matchlen(u_char *oldp,off_t oldsize,u_char *newp,off_t newsize)
+matchlen(u_char *oldp,off_t oldsize,u_char *newp,off_t newsize,
+         bsdiff_stats *st)
 {
   off_t i;
 
   for(i=0;(i<oldsize)&&(i<newsize);i++)
     if(oldp[i]!=newp[i]) break;
 
+  st->bytes_compared+=i;
   return i;
 }
 
 static off_t
 search(off_t *I,u_char *oldp,off_t oldsize,
-       u_char *newp,off_t newsize,off_t st,off_t en,off_t *pos)
+       u_char *newp,off_t newsize,off_t st,off_t en,off_t *pos,
+       bsdiff_stats *stats)
 {
   off_t x,y;
 
+  stats->search_probes++;
+
   if(en-st<2) {
-    x=matchlen(oldp+I[st],oldsize-I[st],newp,newsize);
-    y=matchlen(oldp+I[en],oldsize-I[en],newp,newsize);
+    x=matchlen(oldp+I[st],oldsize-I[st],newp,newsize,stats);
+    y=matchlen(oldp+I[en],oldsize-I[en],newp,newsize,stats);
 
     if(x>y) {
       *pos=I[st];
@@ -187,10 +291,68 @@ search(off_t *I,u_char *oldp,off_t oldsize,
 
   x=st+(en-st)/2;
   if(memcmp(oldp+I[x],newp,MIN(oldsize-I[x],newsize))<0) {
-    return search(I,oldp,oldsize,newp,newsize,x,en,pos);
+    return search(I,oldp,oldsize,newp,newsize,x,en,pos,stats);
   } else {
-    return search(I,oldp,oldsize,newp,newsize,st,x,pos);
+    return search(I,oldp,oldsize,newp,newsize,st,x,pos,stats);
+  };
+}
+
+/* The hash engine: the first offset of each hash of a BSDIFF_HASH_BLOCK
+   byte block of the old file, at block-aligned offsets. The new file is
+   hashed at every offset, rolling the hash along as the scan advances. */
+#define HASH_MUL 0x01000193u
+
+typedef struct {
+  off_t at;             /* offset 'h' is the hash of, or -2 */
+  uint32_t h;
+} hash_cursor;
+
+static uint32_t
+block_hash(const u_char *p)
+{
+  uint32_t h;
+  int i;
+
+  for(h=0,i=0;i<BSDIFF_HASH_BLOCK;i++) h=h*HASH_MUL+p[i];
+  return h;
+}
+
+static off_t
+hash_slot(uint32_t h,int bits)
+{
+  return (off_t)((h*2654435761u)>>(32-bits));
+}
+
+static off_t *
+hash_build(const u_char *oldp,off_t oldsize,int *bits,uint32_t *top)
+{
+  off_t *slots;
+  off_t i,s,n;
+
+  n=oldsize/BSDIFF_HASH_BLOCK;
+  for(*bits=1;((1<<*bits)<2*n) && ((1<<*bits)<BSDIFF_HASH_SLOTS_MAX);
+      (*bits)++);
+  if((slots=malloc(sizeof(off_t)<<*bits))==NULL) return NULL;
+  for(i=0;i<((off_t)1<<*bits);i++) slots[i]=-1;
+
+  for(i=0;i+BSDIFF_HASH_BLOCK<=oldsize;i+=BSDIFF_HASH_BLOCK) {
+    s=hash_slot(block_hash(oldp+i),*bits);
+    if(slots[s]<0) slots[s]=i;
   };
+
+  /* The weight of the byte leaving the hash when it rolls */
+  for(*top=1,i=1;i<BSDIFF_HASH_BLOCK;i++) *top*=HASH_MUL;
+  return slots;
+}
+
+/* Record a match length in the histogram */
+static void
+histogram_add(bsdiff_stats *st,off_t len)
+{
+  int b;
+
+  for(b=0;(len>1)&&(b<BSDIFF_STATS_HISTOGRAM-1);b++) len>>=1;
+  st->matchlen_hist[b]++;
 }
 
 static void
@@ -212,29 +374,843 @@ offtout(off_t x,u_char *buf)
   if(x<0) buf[7]|=0x80;
 }
 
+/* Read back a number written by offtout */
+static off_t
+ctrl_field(const u_char *buf)
+{
+  off_t y;
+  int i;
+
+  y=buf[7]&0x7F;
+  for(i=6;i>=0;i--) y=y*256+buf[i];
+  return (buf[7]&0x80) ? -y : y;
+}
+
+/* Append a ctrl triple */
+static void
+put_ctrl(u_char *ctrl,off_t *ctrllen,off_t x,off_t y,off_t z)
+{
+  offtout(x,ctrl+*ctrllen);
+  offtout(y,ctrl+*ctrllen+8);
+  offtout(z,ctrl+*ctrllen+16);
+  *ctrllen+=24;
+}
+
+/* The first number of a ctrl triple adding 'len' bytes */
+static off_t
+add_field(int flags,off_t len,int words)
+{
+  return (flags & BSDIFF_WORD_DIFF) ? len*2+words : len;
+}
+
+/* Runs shorter than this keep the mode of the run before under
+   BSDIFF_DIFF_AUTO: switching costs more LZ4 matches than they can save */
+#define AUTO_MIN_RUN 64
+
+/* Diff an add run of 'len' bytes into 'db' the way 'mode' (BSDIFF_DIFF_*)
+   says, 'at' being its offset in the new image. Returns whether the run is
+   word-wise. BSDIFF_DIFF_AUTO picks the mode that leaves fewer bytes LZ4
+   can't match, counting a byte as matched if it is zero or repeats the one
+   a word back; a short run, or a tie, goes the way of the run before,
+   which was word-wise if 'prev'. */
+static int
+diff_run(u_char *db,const u_char *newp,const u_char *oldp,off_t len,
+         off_t at,int mode,int prev)
+{
+  off_t i,cb,cw;
+  u_char b;
+  int words;
+
+  if(mode!=BSDIFF_DIFF_BYTES) bsfilter_diff_words(db,newp,oldp,len,at);
+  words=(mode==BSDIFF_DIFF_WORDS);
+  if(mode==BSDIFF_DIFF_AUTO) {
+    words=prev;
+    if(len>=AUTO_MIN_RUN) {
+      cb=0;cw=0;
+      for(i=0;i<len;i++) {
+        b=newp[i]-oldp[i];
+        if((b!=0)&&((i<4)||(b!=(u_char)(newp[i-4]-oldp[i-4])))) cb++;
+        if((db[i]!=0)&&((i<4)||(db[i]!=db[i-4]))) cw++;
+      };
+      if(cw!=cb) words=(cw<cb);
+    };
+  };
+  if(!words)
+    for(i=0;i<len;i++) db[i]=newp[i]-oldp[i];
+  return words;
+}
+
+/* Length of the run of p[i] starting at i, up to 'to' */
+static off_t
+run_length(const u_char *p,off_t i,off_t to)
+{
+  off_t j;
+
+  for(j=i+1;(j<to)&&(p[j]==p[i]);j++);
+  return j-i;
+}
+
+/* Rough compressed size of the two ctrl triples a fill inside an add run
+   takes. The diff bytes it saves count one each, but zeros only 1/255 (the
+   most LZ4 packs into a length byte): where the old file already matches,
+   the add run is cheaper unless it is very long. */
+#define FILL_CTRL_COST 24
+
+/* Find the first run of at least BSDIFF_FILL_MIN equal bytes in p[from,to)
+   that is worth a fill over adding the old bytes 'o' (o[0] goes with
+   p[from]). Returns its start, or 'to' if there is none, and its length in
+   *runlen */
+static off_t
+next_fill(const u_char *p,const u_char *o,off_t from,off_t to,off_t *runlen)
+{
+  off_t i,j,n,diff;
+
+  for(i=from;i<to;i+=n) {
+    n=run_length(p,i,to);
+    if(n<BSDIFF_FILL_MIN) continue;
+    for(diff=0,j=i;(j<i+n)&&(diff<=FILL_CTRL_COST);j++)
+      if(p[j]!=o[j-from]) diff++;
+    if(diff+(n-diff)/255>FILL_CTRL_COST) { *runlen=n; return i; };
+  };
+  *runlen=0;
+  return to;
+}
+
+/* Hash chains over the new file, for copies from earlier in it. Positions
+   go in as the scan passes them, so every candidate lies behind it. */
+#define COPY_HASH_BITS 16
+#define COPY_DEPTH 32
+
+typedef struct {
+  const u_char *newp;
+  off_t newsize;
+  off_t *head;  /* latest position of each hash, or -1 */
+  off_t *prev;  /* earlier position with the same hash, or -1 */
+  off_t next;   /* positions below this are chained */
+} copy_index;
+
+static off_t
+copy_hash(const u_char *p)
+{
+  return (off_t)((bsfilter_le32(p)*2654435761u)>>(32-COPY_HASH_BITS));
+}
+
+static int
+copy_init(copy_index *ci,const u_char *newp,off_t newsize)
+{
+  off_t i;
+
+  ci->newp=newp;
+  ci->newsize=newsize;
+  ci->next=0;
+  ci->prev=malloc((newsize+1)*sizeof(off_t));
+  ci->head=malloc(((off_t)1<<COPY_HASH_BITS)*sizeof(off_t));
+  if((ci->prev==NULL) || (ci->head==NULL)) {
+    free(ci->prev);
+    free(ci->head);
+    return -1;
+  };
+  for(i=0;i<((off_t)1<<COPY_HASH_BITS);i++) ci->head[i]=-1;
+  return 0;
+}
+
+/* Longest match for new[i,to) starting before i, its distance back in
+   *dist. Matches may run into i, as the copy overlaps its own output. */
+static off_t
+copy_find(copy_index *ci,off_t i,off_t to,off_t *dist)
+{
+  const u_char *newp=ci->newp;
+  off_t p,h,n,best,depth;
+
+  for(;ci->next<i;ci->next++) {
+    if(ci->next+4>ci->newsize) continue;
+    h=copy_hash(newp+ci->next);
+    ci->prev[ci->next]=ci->head[h];
+    ci->head[h]=ci->next;
+  };
+  if(i+4>to) return 0;
+
+  best=0;
+  p=ci->head[copy_hash(newp+i)];
+  for(depth=0;(p>=0)&&(depth<COPY_DEPTH);depth++,p=ci->prev[p]) {
+    for(n=0;(i+n<to)&&(newp[p+n]==newp[i+n]);n++);
+    if(n>best) { best=n; *dist=i-p; };
+  };
+  return best;
+}
+
+/* Pick the window of at most 64KB of the old file that shares the most
+   4-byte strings with the extra block, to prime its compressor. Windows
+   start on DICT_STEP boundaries. Returns the length of the window, or 0
+   for none, and its offset in *off. */
+#define DICT_MAX 65536
+#define DICT_STEP 4096
+#define DICT_HASH_BITS 20
+
+static off_t
+dict_hash(const u_char *p)
+{
+  return (off_t)((bsfilter_le32(p)*2654435761u)>>(32-DICT_HASH_BITS));
+}
+
+static off_t
+pick_dict(const u_char *oldp,off_t oldsize,const u_char *eb,off_t eblen,
+          off_t *off)
+{
+  u_char *seen;
+  off_t *score;
+  off_t i,h,nblocks,w,sum,best;
+
+  *off=0;
+  if((eblen<4) || (oldsize<4)) return 0;
+  if(oldsize<=DICT_MAX) return oldsize;
+
+  nblocks=(oldsize+DICT_STEP-1)/DICT_STEP;
+  seen=calloc((size_t)1<<(DICT_HASH_BITS-3),1);
+  score=calloc(nblocks,sizeof(off_t));
+  if((seen==NULL) || (score==NULL)) {
+    free(seen);
+    free(score);
+    return 0;
+  };
+
+  for(i=0;i+4<=eblen;i++) {
+    h=dict_hash(eb+i);
+    seen[h>>3]|=1<<(h&7);
+  };
+  for(i=0;i+4<=oldsize;i++) {
+    h=dict_hash(oldp+i);
+    if(seen[h>>3]&(1<<(h&7))) score[i/DICT_STEP]++;
+  };
+
+  /* Slide a window of DICT_MAX/DICT_STEP blocks over the scores */
+  w=MIN(DICT_MAX/DICT_STEP,nblocks);
+  sum=0;
+  for(i=0;i<w;i++) sum+=score[i];
+  best=sum;
+  for(i=w;i<nblocks;i++) {
+    sum+=score[i]-score[i-w];
+    if(sum>best) { best=sum; *off=(i-w+1)*DICT_STEP; };
+  };
+
+  free(seen);
+  free(score);
+  return MIN(DICT_MAX,oldsize-*off);
+}
+
+/* Compress 'src' with 'dict' loaded into a fresh LZ4 HC stream */
+static int
+compress_dict(const u_char *dict,off_t dictsz,const u_char *src,off_t srcsz,
+              u_char *dst,int dstsz)
+{
+  LZ4_streamHC_t *hc;
+  int res;
+
+  if((hc=LZ4_createStreamHC())==NULL) return 0;
+  LZ4_resetStreamHC_fast(hc,12);
+  LZ4_loadDictHC(hc,(const char*)dict,(int)dictsz);
+  res=LZ4_compress_HC_continue(hc,(const char*)src,(char*)dst,(int)srcsz,
+                               dstsz);
+  LZ4_freeStreamHC(hc);
+  return res;
+}
+
+/* Find the first op in new[from,to) that 'ops' allows: a fill, or a copy
+   from earlier in the new file. Returns its start, or 'to' if there is
+   none, its length in *len and the copy distance in *dist (0 for fills). */
+static off_t
+next_op(copy_index *ci,const u_char *newp,off_t from,off_t to,int ops,
+        off_t *len,off_t *dist)
+{
+  off_t i,n,runend;
+
+  runend=from;
+  for(i=from;(i<to)&&ops;i++) {
+    /* A run starting inside a short one is shorter still */
+    if((ops & BSDIFF_OP_FILL) && (i>=runend)) {
+      n=run_length(newp,i,to);
+      if(n>=BSDIFF_FILL_MIN) { *len=n; *dist=0; return i; };
+      runend=i+n;
+    };
+    if(ops & BSDIFF_OP_COPY) {
+      n=copy_find(ci,i,to,dist);
+      if(n>=BSDIFF_COPY_MIN) { *len=n; return i; };
+    };
+  };
+  *len=0;
+  *dist=0;
+  return to;
+}
+
+/* Append 'v' as LEB128 to buf[*len,cap). Returns -1 if it doesn't fit. */
+static int
+put_varint(u_char *buf,off_t *len,off_t cap,off_t v)
+{
+  do {
+    if(*len>=cap) return -1;
+    buf[(*len)++]=(v&0x7F)|((v>0x7F) ? 0x80 : 0);
+    v>>=7;
+  } while(v>0);
+  return 0;
+}
+
+/* Size of the unit of an add run at 'i' that is skipped or kept whole:
+   a word in the aligned middle of a word-wise run, a byte elsewhere */
+static off_t
+sparse_unit(off_t i,off_t head,off_t wend)
+{
+  return ((i>=head) && (i<wend)) ? 4 : 1;
+}
+
+static int
+sparse_zero(const u_char *db,off_t i,off_t n)
+{
+  for(;n>0;n--) if(db[i++]!=0) return 0;
+  return 1;
+}
+
+/* Recode the diff of an add run of 'len' bytes at 'at' in the new image
+   sparsely into sb[*sblen,cap). Returns -1 if it doesn't fit. */
+static int
+sparse_run(const u_char *db,off_t len,off_t at,int words,
+           u_char *sb,off_t *sblen,off_t cap)
+{
+  off_t i,j,z,lit,head,wend,u;
+
+  head=len;wend=len;
+  if(words) {
+    head=MIN((4-(at&3))&3,len);
+    wend=head+(len-head)/4*4;
+  };
+
+  for(i=0;i<len;) {
+    for(z=i;(i<len) && sparse_zero(db,i,u=sparse_unit(i,head,wend));i+=u);
+    for(lit=i;i<len;) {
+      if(!sparse_zero(db,i,u=sparse_unit(i,head,wend))) { i+=u; continue; };
+      for(j=i;(j<len) && sparse_zero(db,j,u=sparse_unit(j,head,wend));j+=u);
+      if((j==len) || (j-i>=BSDIFF_SPARSE_GAP)) break;
+      i=j;
+    };
+    if((put_varint(sb,sblen,cap,lit-z)!=0) ||
+       (put_varint(sb,sblen,cap,i-lit)!=0) ||
+       (i-lit>cap-*sblen))
+      return -1;
+    memcpy(sb+*sblen,db+lit,i-lit);
+    *sblen+=i-lit;
+  };
+  return 0;
+}
+
+/* Recode the whole diff block sparsely, walking the ctrl triples for the
+   add runs. Returns the new length, or -1 if it isn't shorter. */
+static off_t
+sparse_diff(const u_char *ctrl,off_t ctrllen,const u_char *db,
+            u_char *sb,off_t dblen,int flags,off_t new_base)
+{
+  off_t i,x,len,newpos,dbpos,sblen;
+  int words;
+
+  newpos=0;dbpos=0;sblen=0;
+  for(i=0;i<ctrllen;i+=24) {
+    x=ctrl_field(ctrl+i);
+    if((x==-1) || (x==-2)) { newpos+=ctrl_field(ctrl+i+8); continue; };
+    words=(flags & BSDIFF_WORD_DIFF) ? (int)(x&1) : 0;
+    len=(flags & BSDIFF_WORD_DIFF) ? x>>1 : x;
+    if(sparse_run(db+dbpos,len,new_base+newpos,words,sb,&sblen,dblen)!=0)
+      return -1;
+    dbpos+=len;
+    newpos+=len+ctrl_field(ctrl+i+8);
+  };
+  return (sblen<dblen) ? sblen : -1;
+}
+
 off_t
 bsdiff_patchsize_max(off_t newsize, off_t oldsize)
 {
   return newsize+oldsize+BSDIFF_PATCH_SLOP_SIZE;
 }
 
-int bsdiff(u_char* oldp, off_t oldsize,
-           u_char* newp, off_t newsize,
-           u_char* patch, off_t patchsz,
-           bool print_stats)
+/* Suffix index of an old file, shared by any number of diffs. With a
+   filter, the index is of a filtered copy of the old file, and 'plain'
+   indexes it as given. */
+struct bsdiff_index {
+  u_char *old;
+  u_char *raw;          /* the old file as given, for extra dictionaries */
+  off_t oldsize;
+  off_t *I;
+  off_t nI;             /* suffixes in I, all of them unless strided */
+  int borrowed;         /* I belongs to the caller */
+  off_t *slots;         /* hash engine index instead of I */
+  int slot_bits;
+  uint32_t top;
+  double sort_time;
+  bsdiff_options opts;
+  u_char *filtered;
+  struct bsdiff_index *plain;
+};
+
+static void
+index_free(bsdiff_index *idx)
+{
+  if(!idx->borrowed) free(idx->I);
+  free(idx->slots);
+  free(idx->filtered);
+  if(idx->plain!=NULL) {
+    index_free(idx->plain);
+    free(idx->plain);
+  };
+}
+
+static int
+options_valid(const bsdiff_options *o)
+{
+  return !((o->filter & ~BSDIFF_FILTERS) || (o->ops & ~BSDIFF_OPS) ||
+           (o->old_base<0) ||
+           (o->diff_mode<BSDIFF_DIFF_BYTES) ||
+           (o->diff_mode>BSDIFF_DIFF_AUTO) ||
+           (o->engine<BSDIFF_ENGINE_SUFFIX) ||
+           (o->engine>BSDIFF_ENGINE_HASH) ||
+           (o->stride<0) || (o->stride>BSDIFF_STRIDE_MAX));
+}
+
+static int
+index_init(bsdiff_index *idx,u_char *oldp,off_t oldsize,
+           const bsdiff_options *opts)
 {
-  off_t *I,*V;
+  bsdiff_options plain;
+  off_t *V;
+  double t0;
+
+  idx->old=oldp;
+  idx->raw=oldp;
+  idx->oldsize=oldsize;
+  if(opts!=NULL) idx->opts=*opts;
+  else memset(&idx->opts,0,sizeof(idx->opts));
+  idx->filtered=NULL;
+  idx->I=NULL;
+  idx->borrowed=0;
+  idx->slots=NULL;
+  idx->plain=NULL;
+
+  if(!options_valid(&idx->opts)) return -1;
+  if(idx->opts.filter) {
+    if((idx->filtered=malloc(oldsize+1))==NULL) return -1;
+    memcpy(idx->filtered,oldp,oldsize);
+    bsfilter_apply(idx->opts.filter,idx->filtered,oldsize,
+                   idx->opts.old_base,true);
+    idx->old=idx->filtered;
+
+    /* Rewritten calls only diff better where they moved and their targets
+       didn't, so diffs also try the old file as it is */
+    plain=idx->opts;
+    plain.filter=0;
+    if(((idx->plain=malloc(sizeof(*idx->plain)))==NULL) ||
+       (index_init(idx->plain,oldp,oldsize,&plain)!=0)) {
+      free(idx->plain);
+      idx->plain=NULL;
+      index_free(idx);
+      return -1;
+    };
+  };
+
+  if(idx->opts.engine==BSDIFF_ENGINE_HASH) {
+    t0=minibsdiff_clock();
+    idx->slots=hash_build(idx->old,oldsize,&idx->slot_bits,&idx->top);
+    idx->sort_time=minibsdiff_clock()-t0;
+    if(idx->slots==NULL) {
+      index_free(idx);
+      return -1;
+    };
+    return 0;
+  };
+
+  if(idx->opts.stride>1) {
+    t0=minibsdiff_clock();
+    idx->I=stride_sort(idx->old,oldsize,idx->opts.stride,&idx->nI);
+    idx->sort_time=minibsdiff_clock()-t0;
+    return (idx->I!=NULL) ? 0 : -1;
+  };
+
+  /* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
+     that we never try to malloc(0) and get a NULL pointer */
+  idx->nI=oldsize+1;
+  if(((idx->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+     ((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) {
+      index_free(idx);
+      return -1;
+  }
+
+  t0=minibsdiff_clock();
+  qsufsort(idx->I,V,idx->old,oldsize);
+  idx->sort_time=minibsdiff_clock()-t0;
+
+  free(V);
+  return 0;
+}
+
+bsdiff_index*
+bsdiff_index_build_with_options(u_char* oldp, off_t oldsize,
+                                const bsdiff_options* opts)
+{
+  bsdiff_index *idx;
+
+  if (oldp == NULL || oldsize < 0) return NULL;
+  if ((idx = malloc(sizeof(*idx))) == NULL) return NULL;
+  if (index_init(idx, oldp, oldsize, opts) != 0) {
+    free(idx);
+    return NULL;
+  }
+  return idx;
+}
+
+bsdiff_index*
+bsdiff_index_wrap(u_char* oldp, off_t oldsize, off_t* I, off_t n,
+                  const bsdiff_options* opts)
+{
+  bsdiff_index *idx;
+
+  if (oldp == NULL || oldsize < 0 || I == NULL || n < 1) return NULL;
+  if ((idx = malloc(sizeof(*idx))) == NULL) return NULL;
+  memset(idx, 0, sizeof(*idx));
+  if (opts != NULL) idx->opts = *opts;
+  if (!options_valid(&idx->opts) || idx->opts.filter ||
+      idx->opts.engine != BSDIFF_ENGINE_SUFFIX) {
+    free(idx);
+    return NULL;
+  }
+  idx->old = oldp;
+  idx->raw = oldp;
+  idx->oldsize = oldsize;
+  idx->I = I;
+  idx->nI = n;
+  idx->borrowed = 1;
+  return idx;
+}
+
+void
+bsdiff_suffix_sort(const u_char* oldp, off_t oldsize, off_t* I, off_t n)
+{
+  mkqsort(I, n, 0, oldp, oldsize);
+}
+
+int
+bsdiff_suffix_cmp(const u_char* oldp, off_t oldsize, off_t a, off_t b)
+{
+  return suffix_cmp(oldp, oldsize, a, b, 0);
+}
+
+off_t
+bsdiff_index_memory(off_t oldsize, const bsdiff_options* opts)
+{
+  off_t n, slots;
+
+  /* A filtered index comes with an unfiltered one */
+  if (opts != NULL && opts->filter) {
+    bsdiff_options plain = *opts;
+    plain.filter = 0;
+    return 2*bsdiff_index_memory(oldsize, &plain) + oldsize;
+  }
+  if (opts != NULL && opts->engine == BSDIFF_ENGINE_HASH) {
+    n = oldsize/BSDIFF_HASH_BLOCK;
+    for (slots = 2; slots < 2*n && slots < BSDIFF_HASH_SLOTS_MAX; slots *= 2);
+    return slots*(off_t)sizeof(off_t);
+  }
+  if (opts != NULL && opts->stride > 1)
+    return ((oldsize+opts->stride-1)/opts->stride+1)*(off_t)sizeof(off_t);
+  return 2*(oldsize+1)*(off_t)sizeof(off_t);
+}
+
+bsdiff_index*
+bsdiff_index_build(u_char* oldp, off_t oldsize)
+{
+  return bsdiff_index_build_with_options(oldp, oldsize, NULL);
+}
+
+void
+bsdiff_index_free(bsdiff_index* idx)
+{
+  if (idx == NULL) return;
+  index_free(idx);
+  free(idx);
+}
+
+int bsdiff_index_diff(const bsdiff_index* idx,
+                      u_char* newp, off_t newsize,
+                      u_char* patch, off_t patchsz,
+                      bsdiff_stats* stats)
+{
+  return bsdiff_index_diff_at(idx, newp, newsize, 0, patch, patchsz, stats);
+}
+
+/* Find a match for new[scan..] with the hash engine: the longer of the one
+   at 'hint', where the last match would go on, and the block that hashes
+   like the next BSDIFF_HASH_BLOCK new bytes */
+static off_t
+hash_search(const bsdiff_index *idx,u_char *newp,off_t newsize,off_t scan,
+            off_t hint,hash_cursor *cur,off_t *pos,bsdiff_stats *st)
+{
+  off_t cand,len,best;
+
+  st->search_probes++;
+  best=0;
+  if((hint>=0) && (hint<idx->oldsize)) {
+    best=matchlen(idx->old+hint,idx->oldsize-hint,newp+scan,newsize-scan,st);
+    *pos=hint;
+  };
+  if(newsize-scan<BSDIFF_HASH_BLOCK) return best;
+
+  if(cur->at==scan-1)
+    cur->h=(cur->h-newp[scan-1]*idx->top)*HASH_MUL+
+           newp[scan+BSDIFF_HASH_BLOCK-1];
+  else
+    cur->h=block_hash(newp+scan);
+  cur->at=scan;
+
+  cand=idx->slots[hash_slot(cur->h,idx->slot_bits)];
+  if(cand>=0) {
+    len=matchlen(idx->old+cand,idx->oldsize-cand,newp+scan,newsize-scan,st);
+    if(len>best) { best=len; *pos=cand; };
+  };
+  return best;
+}
+
+/* --max-compression plans the parse with a dynamic program instead of
+   bsdiff's greedy rules. At each new byte the parse is in an add run at
+   one of PARSE_SLOTS recently found match offsets, or in the extra bytes
+   after one, and starting an add run takes a ctrl triple. The costs below
+   estimate what each byte adds to the patch after LZ4, in 1/16 bytes. A
+   diff byte that is zero, or repeats the one a word back as relocated
+   pointers do, goes into an LZ4 match for next to nothing; others are
+   literals. The program runs over PARSE_WINDOW new bytes at a time and
+   commits the cheapest path through each. */
+#define PARSE_SLOTS 8
+#define PARSE_EXTRA PARSE_SLOTS         /* the state of extra bytes */
+#define PARSE_SWITCH 0x80               /* the state starts a new triple */
+#define PARSE_WINDOW ((off_t)1 << 16)
+
+#define COST_LITERAL 16                 /* a diff byte LZ4 can't match */
+#define COST_SEQUENCE 16                /* a match it has to break */
+#define COST_EXTRA 12                   /* extra bytes compress somewhat */
+#define COST_TRIPLE 256
+#define COST_NONE ((off_t)1 << 40)      /* no add run at that offset */
+
+/* The add runs of a planned parse, each starting a ctrl triple; extra
+   bytes fill the gaps between them */
+typedef struct {
+  off_t scan,pos,len;
+} parse_run;
+
+typedef struct {
+  parse_run *run;
+  off_t n,cap;
+} parse_plan;
+
+/* A match offset found for new[at..]. Once the program takes it into a
+   slot, 'slot' is that one and 'off' the offset the slot held before. */
+typedef struct {
+  off_t at,off;
+  int slot;
+} parse_cand;
+
+static int
+plan_add(parse_plan *plan,off_t scan,off_t pos,off_t len)
+{
+  parse_run *run;
+  off_t cap;
+
+  if(plan->n==plan->cap) {
+    cap=plan->cap ? plan->cap*2 : 1024;
+    if((run=realloc(plan->run,cap*sizeof(*run)))==NULL) return -1;
+    plan->run=run;plan->cap=cap;
+  };
+  plan->run[plan->n].scan=scan;
+  plan->run[plan->n].pos=pos;
+  plan->run[plan->n].len=len;
+  plan->n++;
+  return 0;
+}
+
+static int
+cand_cmp(const void *a,const void *b)
+{
+  off_t x=((const parse_cand*)a)->at,y=((const parse_cand*)b)->at;
+
+  return (x>y)-(x<y);
+}
+
+/* Search new[*next..to) for matches, like bsdiff at each byte it has no
+   match for, but only halfway into each one found, so the match that
+   follows it is found too. Each is extended back as far as it agrees,
+   but not before 'from'. Returns the number found, sorted by 'at'. */
+static off_t
+find_cands(const bsdiff_index *idx,u_char *newp,off_t newsize,
+           off_t from,off_t to,off_t *next,off_t *last,hash_cursor *cur,
+           parse_cand *cand,bsdiff_stats *st)
+{
+  off_t i,at,len,pos,n;
+
+  n=0;
+  for(i=*next;i<to;i=*next) {
+    if(idx->slots!=NULL)
+      len=hash_search(idx,newp,newsize,i,i+*last,cur,&pos,st);
+    else
+      len=search(idx->I,idx->old,idx->oldsize,newp+i,newsize-i,
+                 0,idx->nI-1,&pos,st);
+    st->search_calls++;
+    *next=i+MAX(len/2,1);
+    if(len==0) continue;
+
+    *last=pos-i;
+    for(at=i;(at>from)&&(at-1+*last>=0)&&
+             (newp[at-1]==idx->old[at-1+*last]);at--);
+    cand[n].at=at;cand[n].off=*last;cand[n].slot=-1;
+    n++;
+  };
+  qsort(cand,n,sizeof(*cand),cand_cmp);
+  return n;
+}
+
+static int
+plan_parse(const bsdiff_index *idx,u_char *newp,off_t newsize,
+           parse_plan *plan,bsdiff_stats *st)
+{
+  off_t off[PARSE_SLOTS],used[PARSE_SLOTS],keep[PARSE_SLOTS];
+  off_t cost[PARSE_SLOTS+1],next[PARSE_SLOTS+1];
+  off_t ws,we,w,i,j,d,c,best,k,nc,search_at,last;
+  u_char *oldp,*from,*state;
+  off_t *runoff,oldsize;
+  parse_cand *cand;
+  hash_cursor cur;
+  u_char v;
+  int s,t,b,f;
+
+  oldp=idx->old;oldsize=idx->oldsize;
+  w=MIN(newsize,PARSE_WINDOW)+1;
+  from=malloc(w*(PARSE_SLOTS+1));
+  state=malloc(w);
+  runoff=malloc(w*sizeof(off_t));
+  cand=malloc(w*sizeof(parse_cand));
+  if((from==NULL)||(state==NULL)||(runoff==NULL)||(cand==NULL)||
+     (plan_add(plan,0,0,0)!=0)) {
+    free(from);free(state);free(runoff);free(cand);
+    return -1;
+  };
+
+  /* The first triple adds from old offset 0; the other slots are empty */
+  for(s=0;s<PARSE_SLOTS;s++) {
+    off[s]=-newsize-1;used[s]=-1;cost[s]=COST_NONE;
+  };
+  off[0]=0;used[0]=0;cost[0]=0;cost[PARSE_EXTRA]=0;
+
+  search_at=0;last=0;cur.at=-2;cur.h=0;
+  for(ws=0;ws<newsize;ws=we) {
+    we=MIN(newsize,ws+PARSE_WINDOW);
+    nc=find_cands(idx,newp,newsize,ws,we,&search_at,&last,&cur,cand,st);
+
+    for(i=ws,k=0;i<we;i++) {
+      /* New offsets take the slots with the most expensive paths */
+      for(;(k<nc)&&(cand[k].at==i);k++) {
+        for(s=0;(s<PARSE_SLOTS)&&(off[s]!=cand[k].off);s++);
+        if(s<PARSE_SLOTS) continue;
+        for(s=0,t=1;t<PARSE_SLOTS;t++)
+          if((cost[t]>cost[s])||((cost[t]==cost[s])&&(used[t]<used[s]))) s=t;
+        d=off[s];off[s]=cand[k].off;cand[k].off=d;cand[k].slot=s;
+        used[s]=i;cost[s]=COST_NONE;
+      };
+
+      for(b=0,t=1;t<=PARSE_SLOTS;t++) if(cost[t]<cost[b]) b=t;
+      best=cost[b];
+      for(s=0;s<PARSE_SLOTS;s++) {
+        d=i+off[s];
+        if((d<0)||(d>=oldsize)) {
+          next[s]=COST_NONE;
+          from[(i-ws)*(PARSE_SLOTS+1)+s]=b;
+          continue;
+        };
+        if(newp[i]==oldp[d]) used[s]=i;
+        v=(u_char)(newp[i]-oldp[d]);
+        if((v==0)||((i>=4)&&(d>=4)&&(v==(u_char)(newp[i-4]-oldp[d-4])))) {
+          c=0;
+        } else {
+          c=COST_LITERAL;
+          if((i>0)&&(d>0)&&(newp[i-1]==oldp[d-1])) c+=COST_SEQUENCE;
+        };
+        if(cost[s]<=best+COST_TRIPLE) {
+          next[s]=cost[s]+c;
+          from[(i-ws)*(PARSE_SLOTS+1)+s]=s;
+        } else {
+          next[s]=best+COST_TRIPLE+c;
+          from[(i-ws)*(PARSE_SLOTS+1)+s]=b|PARSE_SWITCH;
+        };
+      };
+      /* Extra bytes go on from any add run in the same triple */
+      next[PARSE_EXTRA]=best+COST_EXTRA;
+      from[(i-ws)*(PARSE_SLOTS+1)+PARSE_EXTRA]=b;
+      memcpy(cost,next,sizeof(cost));
+    };
+
+    /* Trace the cheapest path back, undoing the slot changes on the way */
+    for(b=0,t=1;t<=PARSE_SLOTS;t++) if(cost[t]<cost[b]) b=t;
+    memcpy(keep,off,sizeof(off));
+    for(t=b,j=we-1,k=nc;j>=ws;j--) {
+      f=from[(j-ws)*(PARSE_SLOTS+1)+t];
+      state[j-ws]=(t==PARSE_EXTRA) ? t : (t|(f&PARSE_SWITCH));
+      if(t!=PARSE_EXTRA) runoff[j-ws]=off[t];
+      for(;(k>0)&&(cand[k-1].at==j);k--)
+        if(cand[k-1].slot>=0) off[cand[k-1].slot]=cand[k-1].off;
+      t=f&~PARSE_SWITCH;
+    };
+    memcpy(off,keep,sizeof(off));
+
+    for(j=ws;j<we;j++) {
+      t=state[j-ws];
+      if(t==PARSE_EXTRA) continue;
+      if(!(t&PARSE_SWITCH)) {
+        plan->run[plan->n-1].len++;
+      } else if(plan_add(plan,j,j+runoff[j-ws],1)!=0) {
+        free(from);free(state);free(runoff);free(cand);
+        return -1;
+      };
+    };
+
+    /* The next window goes on from where the path ends */
+    for(t=0;t<=PARSE_SLOTS;t++) cost[t]=(t==b) ? 0 : COST_NONE;
+  };
+
+  free(from);free(state);free(runoff);free(cand);
+  return 0;
+}
+
+static int
+diff_parsed(const bsdiff_index* idx,
+            u_char* newp, off_t newsize, off_t new_base,
+            u_char* patch, off_t patchsz,
+            int planned, int mode, bsdiff_stats* stats)
+{
+  off_t *I;
+  u_char *oldp;
+  off_t oldsize;
   off_t scan,pos,len;
   off_t lastscan,lastpos,lastoffset;
   off_t oldscore,scsc;
   off_t s,Sf,lenf,Sb,lenb;
   off_t overlap,Ss,lens;
   off_t i;
-  off_t dblen,eblen;
-  u_char *db,*eb;
-  u_char buf[8];
-  u_char header[32];
+  off_t dblen,eblen,sblen;
+  u_char *db,*eb,*sb;
+  u_char header[BSDIFF_DICT_HEADER_SIZE];
   u_char *fileblock;
+  u_char *filtered;
+  off_t hdrsize;
+  int flags,words,lastwords;
+  off_t as,ao,ae,es,ee,f,flen,fdist;
+  off_t dictoff,dictsz;
+  u_char *dict_compressed, *sparse_compressed;
+  int dict_compressed_size, sparse_compressed_size;
+  copy_index ci;
+  hash_cursor cur;
+  parse_plan plan;
+  off_t run;
 
   off_t ctrllen;
   
@@ -243,84 +1219,125 @@ int bsdiff(u_char* oldp, off_t oldsize,
   int ctrl_compressed_size, diff_compressed_size, extra_compressed_size;
   u_char *ctrl_buffer;
 
+  bsdiff_stats st;
+  double t0;
+
   /* Sanity checks */
-  if (oldp == NULL || newp == NULL || patch == NULL) return -1;
-  if (oldsize < 0 || newsize < 0 || patchsz < 0)     return -1;
-  if (bsdiff_patchsize_max(oldsize, newsize) > patchsz) return -1;
+  if (idx == NULL || newp == NULL || patch == NULL) return -1;
+  flags = idx->opts.filter;
+  if (mode != BSDIFF_DIFF_BYTES) flags |= BSDIFF_WORD_DIFF;
+  hdrsize = idx->opts.extra_dict ? BSDIFF_DICT_HEADER_SIZE :
+            (flags || idx->opts.ops || idx->opts.sparse_diff) ?
+                                       BSDIFF_FLAGS_HEADER_SIZE :
+                                       BSDIFF_HEADER_SIZE;
+  if (newsize < 0 || new_base < 0 || patchsz < hdrsize)  return -1;
 
-  /* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-     that we never try to malloc(0) and get a NULL pointer */
-  if(((I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
-     ((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) {
-      if (I) free(I);
-      return -1;
-  }
+  I = idx->I;
+  oldp = idx->old;
+  oldsize = idx->oldsize;
 
-  qsufsort(I,V,oldp,oldsize);
+  memset(&st, 0, sizeof(st));
 
-  free(V);
+  /* The new file is filtered like the old one, into a copy */
+  filtered = NULL;
+  if (idx->opts.filter) {
+    if ((filtered = malloc(newsize+1)) == NULL) return -1;
+    memcpy(filtered, newp, newsize);
+    bsfilter_apply(idx->opts.filter, filtered, newsize, new_base, true);
+    newp = filtered;
+  }
 
   /* Allocate newsize+1 bytes instead of newsize bytes to ensure
      that we never try to malloc(0) and get a NULL pointer */
   if(((db=malloc(newsize+1))==NULL) ||
      ((eb=malloc(newsize+1))==NULL)) {
     if (db) free(db);
-    free(I);
+    free(filtered);
     return -1;
   }
   dblen=0;
   eblen=0;
 
-  /* Write initial header placeholder */
-  memcpy(header, "MBSDIF43", 8);  // Use the exact magic number
-  offtout(0, header + 8);
-  offtout(0, header + 16);
-  offtout(newsize, header + 24);
-  memcpy(patch, header, 32);
-
   /* Set up initial pointers */
-  fileblock = patch + 32;
+  fileblock = patch + hdrsize;
   ctrllen = 0;
   
-  /* Allocate memory for control data */
-  if ((ctrl_buffer = malloc(newsize * 3 * 8)) == NULL) {
+  /* Allocate memory for control data, at most one triple per new byte
+     plus the final one */
+  if ((ctrl_buffer = malloc((newsize + 1) * 3 * 8)) == NULL) {
     free(db);
     free(eb);
-    free(I);
+    free(filtered);
+    return -1;
+  }
+
+  memset(&plan, 0, sizeof(plan));
+  if (planned && plan_parse(idx, newp, newsize, &plan, &st) != 0) {
+    free(plan.run);
+    free(ctrl_buffer);
+    free(db);
+    free(eb);
+    free(filtered);
     return -1;
   }
-  
-  u_char *ctrl_ptr = ctrl_buffer;
 
+  memset(&ci, 0, sizeof(ci));
+  if ((idx->opts.ops & BSDIFF_OP_COPY) && copy_init(&ci, newp, newsize) != 0) {
+    free(plan.run);
+    free(ctrl_buffer);
+    free(db);
+    free(eb);
+    free(filtered);
+    return -1;
+  }
+  
   /* Compute the differences, storing ctrl data in memory */
-  scan=0;len=0;pos=0;
+  t0=minibsdiff_clock();
+  scan=0;len=0;pos=0;run=0;lastwords=0;
   lastscan=0;lastpos=0;lastoffset=0;
+  cur.at=-2;cur.h=0;
   while(scan<newsize) {
-    oldscore=0;
+    if(plan.run!=NULL) {
+      /* The next triple of the planned parse */
+      lenf=plan.run[run].len;lenb=0;
+      if(++run<plan.n) {
+        scan=plan.run[run].scan;pos=plan.run[run].pos;len=plan.run[run].len;
+      } else {
+        scan=newsize;pos=lastpos+lenf;len=0;
+      };
+    } else {
+      oldscore=0;
 
-    for(scsc=scan+=len;scan<newsize;scan++) {
-      len=search(I,oldp,oldsize,newp+scan,newsize-scan,
-                 0,oldsize,&pos);
+      for(scsc=scan+=len;scan<newsize;scan++) {
+        if(idx->slots!=NULL)
+          len=hash_search(idx,newp,newsize,scan,scan+lastoffset,&cur,&pos,&st);
+        else
+          len=search(I,oldp,oldsize,newp+scan,newsize-scan,
+                     0,idx->nI-1,&pos,&st);
+        st.search_calls++;
 
-      for(;scsc<scan+len;scsc++)
-        if((scsc+lastoffset<oldsize) &&
-           (oldp[scsc+lastoffset] == newp[scsc]))
-          oldscore++;
+        for(;scsc<scan+len;scsc++)
+          if((scsc+lastoffset<oldsize) &&
+             (oldp[scsc+lastoffset] == newp[scsc]))
+            oldscore++;
 
-      if(((len==oldscore) && (len!=0)) ||
-         (len>oldscore+8)) break;
+        if(((len==oldscore) && (len!=0)) ||
+           (len>oldscore+8)) break;
 
-      if((scan+lastoffset<oldsize) &&
-         (oldp[scan+lastoffset] == newp[scan]))
-        oldscore--;
-    };
+        if((scan+lastoffset<oldsize) &&
+           (oldp[scan+lastoffset] == newp[scan]))
+          oldscore--;
+      };
+
+      if((len==oldscore) && (scan!=newsize)) continue;
 
-    if((len!=oldscore) || (scan==newsize)) {
       s=0;Sf=0;lenf=0;
       for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
         if(oldp[lastpos+i]==newp[lastscan+i]) s++;
         i++;
-        if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+        if(s*2-i>Sf*2-lenf) {
+          Sf=s; lenf=i;
+        };
       };
 
       lenb=0;
@@ -328,7 +1345,9 @@ int bsdiff(u_char* oldp, off_t oldsize,
         s=0;Sb=0;
         for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
           if(oldp[pos-i]==newp[scan-i]) s++;
-          if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+          if(s*2-i>Sb*2-lenb) {
+            Sb=s; lenb=i;
+          };
         };
       };
 
@@ -347,41 +1366,66 @@ int bsdiff(u_char* oldp, off_t oldsize,
         lenb-=lens;
       };
 
-      for(i=0;i<lenf;i++)
-        db[dblen+i]=newp[lastscan+i]-oldp[lastpos+i];
-      for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-        eb[eblen+i]=newp[lastscan+lenf+i];
-
-      dblen+=lenf;
-      eblen+=(scan-lenb)-(lastscan+lenf);
+    };
 
-      offtout(lenf, buf);
-      memcpy(ctrl_ptr, buf, 8);
-      ctrl_ptr += 8;
+    /* Runs of one byte in the new file, such as erased flash, become
+       fill ops instead of add or extra bytes. An add run stops at a
+       fill and seeks over it in the old file. */
+    as=lastscan;ao=lastpos;ae=lastscan+lenf;flen=0;
+    for(;;) {
+      f=(idx->opts.ops & BSDIFF_OP_FILL) ?
+        next_fill(newp,oldp+ao,as,ae,&flen) : ae;
+      words=diff_run(db+dblen,newp+as,oldp+ao,f-as,new_base+as,
+                     mode,lastwords);
+      lastwords=words;
+      dblen+=f-as;
+      st.add_bytes+=f-as;
+      if(f==ae) break;
+      put_ctrl(ctrl_buffer,&ctrllen,add_field(flags,f-as,words),0,flen);
+      put_ctrl(ctrl_buffer,&ctrllen,-1,flen,newp[f]);
+      st.fill_bytes+=flen;
+      flags|=BSDIFF_OP_FILL;
+      ao+=f+flen-as;as=f+flen;
+    };
 
-      offtout((scan-lenb)-(lastscan+lenf), buf);
-      memcpy(ctrl_ptr, buf, 8);
-      ctrl_ptr += 8;
+    /* Extra bytes may also be repeats of earlier new data */
+    es=ae;ee=scan-lenb;
+    for(;;) {
+      f=next_op(&ci,newp,es,ee,idx->opts.ops,&flen,&fdist);
+      memcpy(eb+eblen,newp+es,f-es);
+      eblen+=f-es;
+      st.extra_bytes+=f-es;
+      if(f==ee) break;
+      put_ctrl(ctrl_buffer,&ctrllen,add_field(flags,ae-as,words),f-es,0);
+      if(fdist==0) {
+        put_ctrl(ctrl_buffer,&ctrllen,-1,flen,newp[f]);
+        st.fill_bytes+=flen;
+        flags|=BSDIFF_OP_FILL;
+      } else {
+        put_ctrl(ctrl_buffer,&ctrllen,-2,flen,fdist);
+        st.copy_bytes+=flen;
+        flags|=BSDIFF_OP_COPY;
+      };
+      as=ae;words=0;es=f+flen;
+    };
 
-      offtout((pos-lenb)-(lastpos+lenf), buf);
-      memcpy(ctrl_ptr, buf, 8);
-      ctrl_ptr += 8;
-      
-      ctrllen += 24;
+    put_ctrl(ctrl_buffer,&ctrllen,add_field(flags,ae-as,words),ee-es,
+             (pos-lenb)-(lastpos+lenf));
+    st.seek_bytes+=MAX((pos-lenb)-(lastpos+lenf),
+                       (lastpos+lenf)-(pos-lenb));
+    histogram_add(&st,len);
 
-      lastscan=scan-lenb;
-      lastpos=pos-lenb;
-      lastoffset=pos-scan;
-    };
+    lastscan=scan-lenb;
+    lastpos=pos-lenb;
+    lastoffset=pos-scan;
   };
 
-  if (ctrllen > max_ctrllen) max_ctrllen = ctrllen;
-  if (eblen > max_eblen) max_eblen = eblen;
-
-  if (print_stats) {
-    printf("MaxControlDataSize: %d\n", max_ctrllen);
-    printf("MaxExtraDataSize: %d\n", max_eblen);
-  }
+  st.scan_time=minibsdiff_clock()-t0;
+  st.triples=ctrllen/24;
+  free(plan.run);
+  free(filtered);
+  free(ci.prev);
+  free(ci.head);
 
   /* Allocate memory for compressed data */
   int max_compressed_size = LZ4_compressBound(ctrllen);
@@ -389,7 +1433,6 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
     return -1;
   }
   
@@ -399,7 +1442,6 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
     return -1;
   }
   
@@ -410,11 +1452,11 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
     return -1;
   }
   
   /* Compress the control data */
+  t0=minibsdiff_clock();
   ctrl_compressed_size = LZ4_compress_HC((const char*)ctrl_buffer, 
                                         (char*)ctrl_compressed, 
                                         ctrllen, 
@@ -427,11 +1469,18 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
     return -1;
   }
   
-  /* Compress the diff data */
+  st.ctrl_compress_time=minibsdiff_clock()-t0;
+
+  /* Compress the diff data, and a sparse version skipping the zeros if
+     that is shorter */
+  t0=minibsdiff_clock();
+  sb = NULL;
+  sblen = -1;
+  if (idx->opts.sparse_diff && (sb = malloc(dblen+1)) != NULL)
+    sblen = sparse_diff(ctrl_buffer, ctrllen, db, sb, dblen, flags, new_base);
   diff_compressed_size = LZ4_compress_HC((const char*)db, 
                                         (char*)diff_compressed, 
                                         dblen, 
@@ -444,11 +1493,36 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
+    free(sb);
     return -1;
   }
-  
+
+  /* The sparse diff block is kept if it compresses no worse, counting the
+     flags header it needs */
+  if (sblen >= 0 &&
+      (sparse_compressed = malloc(LZ4_compressBound(sblen))) != NULL) {
+    sparse_compressed_size = LZ4_compress_HC((const char*)sb,
+                                             (char*)sparse_compressed,
+                                             sblen,
+                                             LZ4_compressBound(sblen),
+                                             12);
+    if (sparse_compressed_size > 0 &&
+        sparse_compressed_size +
+        (flags ? 0 : BSDIFF_FLAGS_HEADER_SIZE - BSDIFF_HEADER_SIZE) <=
+        diff_compressed_size) {
+      memcpy(diff_compressed, sparse_compressed, sparse_compressed_size);
+      diff_compressed_size = sparse_compressed_size;
+      dblen = sblen;
+      flags |= BSDIFF_SPARSE_DIFF;
+    }
+    free(sparse_compressed);
+  }
+  free(sb);
+
+  st.diff_compress_time=minibsdiff_clock()-t0;
+
   /* Compress the extra data */
+  t0=minibsdiff_clock();
   extra_compressed_size = LZ4_compress_HC((const char*)eb, 
                                          (char*)extra_compressed, 
                                          eblen, 
@@ -461,12 +1535,50 @@ int bsdiff(u_char* oldp, off_t oldsize,
     free(ctrl_buffer);
     free(db);
     free(eb);
-    free(I);
     return -1;
   }
   
+  /* Try again with a dictionary from the old file, keeping it if it wins
+     by more than the header fields it needs. It is taken from the old file
+     as given, which bspatch has at hand even for a filtered patch. */
+  dictoff=0;dictsz=0;
+  if (idx->opts.extra_dict &&
+      (dictsz=pick_dict(idx->raw, oldsize, eb, eblen, &dictoff)) > 0 &&
+      (dict_compressed=malloc(LZ4_compressBound(eblen)+1)) != NULL) {
+    dict_compressed_size = compress_dict(idx->raw+dictoff, dictsz, eb, eblen,
+                                         dict_compressed,
+                                         LZ4_compressBound(eblen));
+    if (dict_compressed_size > 0 &&
+        dict_compressed_size + BSDIFF_DICT_HEADER_SIZE -
+        (flags ? BSDIFF_FLAGS_HEADER_SIZE : BSDIFF_HEADER_SIZE) <
+        extra_compressed_size) {
+      memcpy(extra_compressed, dict_compressed, dict_compressed_size);
+      extra_compressed_size = dict_compressed_size;
+      flags |= BSDIFF_EXTRA_DICT;
+    }
+    free(dict_compressed);
+  }
+
+  st.extra_compress_time=minibsdiff_clock()-t0;
+
+  /* Ops and dictionaries are only flagged if the patch has them */
+  hdrsize = (flags & BSDIFF_EXTRA_DICT) ? BSDIFF_DICT_HEADER_SIZE :
+            flags ? BSDIFF_FLAGS_HEADER_SIZE : BSDIFF_HEADER_SIZE;
+
+  /* Make sure the patch fits before writing it out */
+  if (hdrsize + ctrl_compressed_size +
+      diff_compressed_size + extra_compressed_size > patchsz) {
+    free(extra_compressed);
+    free(diff_compressed);
+    free(ctrl_compressed);
+    free(ctrl_buffer);
+    free(db);
+    free(eb);
+    return -1;
+  }
+
   /* Write the compressed data to the patch file */
-  fileblock = patch + 32;
+  fileblock = patch + hdrsize;
   
   /* Write compressed control data */
   memcpy(fileblock, ctrl_compressed, ctrl_compressed_size);
@@ -479,10 +1591,36 @@ int bsdiff(u_char* oldp, off_t oldsize,
   /* Write compressed extra data */
   memcpy(fileblock, extra_compressed, extra_compressed_size);
   
-  /* Update the header with compressed sizes */
+  /* Write the header */
+  memcpy(header, flags ? BSDIFF_CONFIG_MAGIC_FLAGS :
+                         BSDIFF_CONFIG_MAGIC_EXT, 8);
   offtout(ctrl_compressed_size, header + 8);
   offtout(diff_compressed_size, header + 16);
-  memcpy(patch, header, 32);
+  offtout(newsize, header + 24);
+  offtout(hdrsize, header + 32);
+  offtout(ctrllen, header + 40);
+  offtout(dblen, header + 48);
+  offtout(eblen, header + 56);
+  if (flags) {
+    offtout(flags, header + 64);
+    offtout(idx->opts.old_base, header + 72);
+    offtout(new_base, header + 80);
+    offtout(oldsize, header + 88);
+  }
+  if (flags & BSDIFF_EXTRA_DICT) {
+    offtout(dictoff, header + 96);
+    offtout(dictsz, header + 104);
+  }
+  memcpy(patch, header, hdrsize);
+
+  if (stats != NULL) {
+    st.ctrllen = ctrllen;
+    st.dblen = dblen;
+    st.eblen = eblen;
+    st.patchsize = hdrsize + ctrl_compressed_size +
+                   diff_compressed_size + extra_compressed_size;
+    *stats = st;
+  }
 
   /* Free the memory we used */
   free(extra_compressed);
@@ -491,7 +1629,108 @@ int bsdiff(u_char* oldp, off_t oldsize,
   free(ctrl_buffer);
   free(db);
   free(eb);
-  free(I);
 
-  return (32 + ctrl_compressed_size + diff_compressed_size + extra_compressed_size);
+  return (hdrsize + ctrl_compressed_size + diff_compressed_size +
+          extra_compressed_size);
+}
+
+static int
+index_diff(const bsdiff_index* idx,
+           u_char* newp, off_t newsize, off_t new_base,
+           u_char* patch, off_t patchsz,
+           bsdiff_stats* stats)
+{
+  static const int fixed[] = { BSDIFF_DIFF_BYTES, BSDIFF_DIFF_WORDS };
+  u_char *trial;
+  bsdiff_stats st;
+  int best,res,planned,mode,nmodes,i;
+
+  if (idx == NULL || (!idx->opts.max_compression &&
+                      idx->opts.diff_mode != BSDIFF_DIFF_AUTO))
+    return diff_parsed(idx, newp, newsize, new_base, patch, patchsz,
+                       0, idx ? idx->opts.diff_mode : BSDIFF_DIFF_BYTES,
+                       stats);
+
+  /* The planned parse and the per-run diff modes are only estimated to be
+     smaller, so make the patch each way, and with each fixed mode too, and
+     keep the one that is, after compression */
+  if (patchsz < 0 || (trial = malloc(patchsz+1)) == NULL) return -1;
+  mode = idx->opts.diff_mode;
+  nmodes = (mode == BSDIFF_DIFF_AUTO) ? 3 : 1;
+  best = diff_parsed(idx, newp, newsize, new_base, patch, patchsz,
+                     0, mode, stats);
+  for (planned = 0; planned <= (idx->opts.max_compression ? 1 : 0);
+       planned++) {
+    for (i = 0; i < nmodes; i++) {
+      if (planned == 0 && i == 0) continue;
+      mode = (i == 0) ? idx->opts.diff_mode : fixed[i-1];
+      res = diff_parsed(idx, newp, newsize, new_base, trial, patchsz,
+                        planned, mode, &st);
+      if (res > 0 && (best <= 0 || res < best)) {
+        memcpy(patch, trial, res);
+        best = res;
+        if (stats != NULL) *stats = st;
+      }
+    }
+  }
+  free(trial);
+  return best;
+}
+
+int bsdiff_index_diff_at(const bsdiff_index* idx,
+                         u_char* newp, off_t newsize, off_t new_base,
+                         u_char* patch, off_t patchsz,
+                         bsdiff_stats* stats)
+{
+  u_char *trial;
+  bsdiff_stats st;
+  int best,res;
+
+  best = index_diff(idx, newp, newsize, new_base, patch, patchsz, stats);
+  if (idx == NULL || idx->plain == NULL) return best;
+
+  /* Keep the patch without the filter if it is smaller */
+  if (patchsz < 0 || (trial = malloc(patchsz+1)) == NULL) return -1;
+  res = index_diff(idx->plain, newp, newsize, new_base, trial, patchsz, &st);
+  if (res > 0 && (best <= 0 || res < best)) {
+    memcpy(patch, trial, res);
+    best = res;
+    if (stats != NULL) *stats = st;
+  }
+  free(trial);
+  return best;
+}
+
+int bsdiff(u_char* oldp, off_t oldsize,
+           u_char* newp, off_t newsize,
+           u_char* patch, off_t patchsz,
+           bsdiff_stats* stats)
+{
+  return bsdiff_with_options(oldp, oldsize, newp, newsize, patch, patchsz,
+                             NULL, stats);
+}
+
+int bsdiff_with_options(u_char* oldp, off_t oldsize,
+                        u_char* newp, off_t newsize,
+                        u_char* patch, off_t patchsz,
+                        const bsdiff_options* opts,
+                        bsdiff_stats* stats)
+{
+  bsdiff_index idx;
+  int res;
+
+  /* Sanity checks */
+  if (oldp == NULL || newp == NULL || patch == NULL) return -1;
+  if (oldsize < 0 || newsize < 0 || patchsz < 0)     return -1;
+  if (bsdiff_patchsize_max(oldsize, newsize) > patchsz) return -1;
+
+  if (index_init(&idx, oldp, oldsize, opts) != 0) return -1;
+
+  res = bsdiff_index_diff_at(&idx, newp, newsize,
+                             (opts != NULL) ? opts->new_base : 0,
+                             patch, patchsz, stats);
+  if (res > 0 && stats != NULL) stats->sort_time = idx.sort_time;
+
+  index_free(&idx);
+  return res;
 }
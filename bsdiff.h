@@ -43,6 +43,41 @@ extern "C" {
  */
 off_t bsdiff_patchsize_max(off_t oldsize, off_t newsize);
 
+/* Number of buckets in the match length histogram of `bsdiff_stats` */
+#define BSDIFF_STATS_HISTOGRAM 32
+
+/*-
+ * Statistics describing a single `bsdiff` call. All sizes are in bytes and
+ * all times are wall-clock seconds.
+ */
+typedef struct {
+  off_t ctrllen;   /* decompressed size of the ctrl block */
+  off_t dblen;     /* decompressed size of the diff block */
+  off_t eblen;     /* decompressed size of the extra block */
+  off_t patchsize; /* size of the finished patch, including the header */
+
+  double sort_time;           /* suffix sorting (or hashing) of the old file */
+  double scan_time;           /* match scan over the new file */
+  double ctrl_compress_time;  /* LZ4 compression of each block */
+  double diff_compress_time;
+  double extra_compress_time;
+
+  off_t search_calls;   /* top-level suffix array searches */
+  off_t search_probes;  /* binary search steps (hash lookups) over all
+                           searches */
+  off_t bytes_compared; /* bytes examined when measuring match lengths */
+  off_t triples;        /* ctrl triples emitted */
+  off_t add_bytes;      /* bytes produced by adding old and diff data */
+  off_t extra_bytes;    /* bytes copied from the extra block */
+  off_t seek_bytes;     /* total distance of all seeks in the old file */
+  off_t fill_bytes;     /* bytes written by fill ops */
+  off_t copy_bytes;     /* bytes copied from earlier in the new file */
+
+  /* Bucket i counts matches of length [2^i, 2^(i+1)); bucket 0 also
+     counts the empty match ending the file */
+  off_t matchlen_hist[BSDIFF_STATS_HISTOGRAM];
+} bsdiff_stats;
+
 /*-
  * Create a binary patch from the buffers pointed to by oldp and newp (with
  * respective sizes,) and store the result in the buffer pointed to by 'patch'.
@@ -50,11 +85,17 @@ off_t bsdiff_patchsize_max(off_t oldsize, off_t newsize);
  * The input pointer 'patch' must not be NULL, and the size of the buffer must
  * be at least 'bsdiff_patchsize_max(new,old)' in length.
  *
+ * If 'stats' is not NULL, it is filled in with sizes, timings and counters
+ * for this call.
+ *
  * Returns -1 if `patch` is NULL, the 'patch' buffer is not large enough, or if
  * memory cannot be allocated.
  * Otherwise, the return value is the size of the patch that was put in the
  * 'patch' buffer.
  *
+ * This function keeps no state between calls, so separate threads may run
+ * it concurrently as long as they don't share output buffers.
+ *
  * This function is memory-intensive, and requires max(17*n,9*n+m)+O(1) bytes
  * of memory, where n is the size of the new file and m is the size of the old
  * file. It runs in O((n+m) log n) time.
@@ -62,10 +103,178 @@ off_t bsdiff_patchsize_max(off_t oldsize, off_t newsize);
 int bsdiff(u_char* oldp, off_t oldsize,
            u_char* newp, off_t newsize,
            u_char* patch, off_t patchsize,
-           bool print_stats);
+           bsdiff_stats* stats);
 
-extern int max_ctrllen;
-extern int max_eblen;
+/*-
+ * Options changing how a patch is made. A zeroed struct, or NULL, gives
+ * the same patch as `bsdiff`.
+ *
+ * 'filter' is a set of BSDIFF_FILTER_* flags (see minibsdiff-config.h),
+ * run over both files before diffing and undone by `bspatch`, which filters
+ * the old bytes as it reads them and needs no extra workspace. The patch
+ * is also made without the filter, and the smaller one is kept, so an index
+ * with a filter holds a second, unfiltered one. Filtered patches can't be
+ * applied by a `bspatch` that predates the flags.
+ *
+ * 'diff_mode' is how add runs are subtracted: BSDIFF_DIFF_BYTES one byte
+ * at a time like `bsdiff`, BSDIFF_DIFF_WORDS as 32-bit little-endian words
+ * aligned in the new image, which suits tables of pointers that all moved
+ * by the same amount, or BSDIFF_DIFF_AUTO picking either for each run by
+ * which leaves fewer bytes that are neither zero nor a repeat of the word
+ * before. A run too short to pay for switching keeps the mode of the one
+ * before. Since that is only an estimate, auto also makes the patch with
+ * each fixed mode and keeps the smallest of the three, so it takes three
+ * times as long. Both of the latter make patches an older `bspatch`
+ * refuses.
+ *
+ * 'ops' is a set of BSDIFF_OP_* ctrl operations the patch may use, again
+ * only understood by a `bspatch` that knows them. With BSDIFF_OP_FILL,
+ * runs of at least BSDIFF_FILL_MIN equal bytes in the new file, such as
+ * erased flash, are written by a fill op rather than sent through the diff
+ * or extra block. With BSDIFF_OP_COPY, repeats of at least BSDIFF_COPY_MIN
+ * bytes that would go to the extra block are copied from earlier in the
+ * new file instead; finding them needs another 8 bytes per new byte.
+ * Patches only carry the flags of ops they use.
+ *
+ * 'extra_dict' primes the compressor of the extra block with the window of
+ * at most 64KB of the old file that shares the most strings with it, which
+ * `bspatch` hands the decompressor too. New code resembling old code then
+ * compresses better. The dictionary is only used if it makes the block
+ * smaller.
+ *
+ * 'sparse_diff' stores the diff block as runs of zeros to skip and the
+ * bytes between them, so `bspatch` copies old data in bulk and patches only
+ * the changed bytes. The decompressed diff block, usually the largest
+ * buffer when applying, shrinks with it. Used only if it is shorter.
+ *
+ * 'max_compression' also makes the patch from a parse planned by dynamic
+ * programming, which picks matches by an estimate of their size after
+ * compression, and keeps that one if it compresses smaller. Diffing takes
+ * about twice as long; the patch applies as any other.
+ *
+ * 'engine' is how matches are found. BSDIFF_ENGINE_SUFFIX sorts the
+ * suffixes of the old file, which finds the longest match anywhere.
+ * BSDIFF_ENGINE_HASH indexes a rolling hash of every BSDIFF_HASH_BLOCK
+ * bytes of the old file instead, in linear time and at most
+ * BSDIFF_HASH_SLOTS_MAX slots. It misses short matches and so makes
+ * larger patches, of the same format.
+ *
+ * 'stride', if above 1, makes the suffix engine index only the suffixes at
+ * multiples of that many bytes (at most BSDIFF_STRIDE_MAX), sorted on
+ * their first BSDIFF_STRIDE_DEPTH bytes. The index then takes 1/stride of
+ * the memory, and less time to sort; matches are found a few bytes late
+ * and extended back, and patches grow somewhat with the stride.
+ *
+ * 'old_base' and 'new_base' are the offsets of 'oldp' and 'newp' within
+ * their images, which position-dependent filters and word alignment need
+ * when diffing a chunk of an image. They are recorded in the patch.
+ */
+enum {
+  BSDIFF_DIFF_BYTES,
+  BSDIFF_DIFF_WORDS,
+  BSDIFF_DIFF_AUTO
+};
+
+enum {
+  BSDIFF_ENGINE_SUFFIX,
+  BSDIFF_ENGINE_HASH
+};
+
+typedef struct {
+  int filter;
+  int diff_mode;
+  int ops;
+  int extra_dict;
+  int sparse_diff;
+  int max_compression;
+  int engine;
+  int stride;
+  off_t old_base;
+  off_t new_base;
+} bsdiff_options;
+
+/*-
+ * Like `bsdiff`, with 'opts'. Also returns -1 for unknown filters, diff
+ * modes or ops.
+ * A filter needs one more copy of each file in memory.
+ */
+int bsdiff_with_options(u_char* oldp, off_t oldsize,
+                        u_char* newp, off_t newsize,
+                        u_char* patch, off_t patchsize,
+                        const bsdiff_options* opts,
+                        bsdiff_stats* stats);
+
+/*-
+ * A suffix index of an old file. Building it is the expensive part of
+ * `bsdiff`; once built it can serve any number of diffs against the same
+ * old file, e.g. one per chunk of a large new file, from several threads
+ * at once.
+ *
+ * `bsdiff_index_build` sorts the suffixes of 'oldp', which must stay valid
+ * and unchanged until the index is freed. It needs (m+1)*sizeof(off_t)
+ * bytes for the index, plus as much again while sorting, and returns NULL
+ * if memory cannot be allocated.
+ */
+typedef struct bsdiff_index bsdiff_index;
+
+bsdiff_index* bsdiff_index_build(u_char* oldp, off_t oldsize);
+void bsdiff_index_free(bsdiff_index* idx);
+
+/*-
+ * Like `bsdiff_index_build`, but indexes the old file as filtered by
+ * 'opts->filter' at 'opts->old_base'. Every diff against the index uses
+ * that filter and 'opts->diff_mode'; 'opts->new_base' is ignored here.
+ * With BSDIFF_ENGINE_HASH it is a hash index rather than a suffix index.
+ */
+bsdiff_index* bsdiff_index_build_with_options(u_char* oldp, off_t oldsize,
+                                              const bsdiff_options* opts);
+
+/*-
+ * Peak memory `bsdiff_index_build_with_options` needs for an old file of
+ * 'oldsize' bytes, not counting a filtered copy of it
+ */
+off_t bsdiff_index_memory(off_t oldsize, const bsdiff_options* opts);
+
+/*-
+ * For suffix indexes sorted elsewhere, e.g. in runs on disk when the
+ * old file is larger than memory. `bsdiff_suffix_sort` sorts the 'n' suffix
+ * offsets in 'I' the way a strided index does, on at most
+ * BSDIFF_STRIDE_DEPTH bytes, and `bsdiff_suffix_cmp` compares two suffixes
+ * in that order, to merge sorted runs.
+ */
+void bsdiff_suffix_sort(const u_char* oldp, off_t oldsize, off_t* I, off_t n);
+int bsdiff_suffix_cmp(const u_char* oldp, off_t oldsize, off_t a, off_t b);
+
+/*-
+ * An index of 'oldp' over the 'n' suffix offsets in 'I', in the order of
+ * `bsdiff_suffix_sort`. 'I' is neither copied nor freed and must stay valid
+ * until the index is freed. Returns NULL for a filter or the hash engine,
+ * which need an index built from the old file itself.
+ */
+bsdiff_index* bsdiff_index_wrap(u_char* oldp, off_t oldsize, off_t* I, off_t n,
+                                const bsdiff_options* opts);
+
+/*-
+ * Like `bsdiff`, but diffs 'newp' against the old file of 'idx'. The control
+ * data may seek anywhere in that file.
+ *
+ * A 'patch' buffer of 'bsdiff_patchsize_max(oldsize,newsize)' bytes is
+ * always enough, but a smaller one may be passed: if the patch doesn't
+ * fit, -1 is returned. The 'sort_time' of 'stats' is left at 0.
+ */
+int bsdiff_index_diff(const bsdiff_index* idx,
+                      u_char* newp, off_t newsize,
+                      u_char* patch, off_t patchsize,
+                      bsdiff_stats* stats);
+
+/*-
+ * Like `bsdiff_index_diff`, for a new file found at 'new_base' in its
+ * image. Only filtered and word-wise diffs care.
+ */
+int bsdiff_index_diff_at(const bsdiff_index* idx,
+                         u_char* newp, off_t newsize, off_t new_base,
+                         u_char* patch, off_t patchsize,
+                         bsdiff_stats* stats);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,185 @@
+/*-
+ * Reversible filters run over the old and new files around a diff. They
+ * rewrite data that changes in predictable ways when code moves, so that
+ * it reads the same in both files and diffs away. Also the word-wise
+ * arithmetic of add runs.
+ *
+ * Shared by bsdiff.c, which filters both files before diffing, and
+ * bspatch.c, which filters the old bytes each add run reads and unfilters
+ * the result.
+ */
+#ifndef _MINIBSDIFF_FILTER_H_
+#define _MINIBSDIFF_FILTER_H_
+
+#include "minibsdiff-config.h"
+
+/*-
+ * ARM Thumb-2 BL holds a signed halfword offset from the instruction
+ * address plus 4, split over two little-endian halfwords:
+ *
+ *   hw1 = 11110 S imm10
+ *   hw2 = 11 J1 1 J2 imm11
+ *
+ * with I1 = NOT(J1 XOR S), I2 = NOT(J2 XOR S) and the offset being
+ * S:I1:I2:imm10:imm11:0. Inserting code changes the offset of every call
+ * that crosses the insertion, though its target is the same. Encoding
+ * replaces the offset with the absolute target (BCJ-style), modulo 2^25,
+ * stored bit for bit in the S:J1:J2:imm10:imm11 fields; decoding undoes it.
+ *
+ * B.W has the same layout, but is left alone: it is rarer than BL, and
+ * matching it too rewrites far more data that merely looks like code.
+ * Literal pools need no such pass: they already hold absolute addresses.
+ *
+ * 'base' is the offset of 'buf' in its image, so that a chunk filters the
+ * same way as the whole file. Instructions are halfword aligned in the
+ * image; the bits that identify one are never changed, so decoding finds
+ * exactly the instructions encoding rewrote.
+ */
+static inline bool
+bsfilter_thumb2_bl(const u_char* p)
+{
+  return (p[1] & 0xF8) == 0xF0 && (p[3] & 0xD0) == 0xD0;
+}
+
+/* Rewrite the BL at 'p', at offset 'at' in its image */
+static inline void
+bsfilter_thumb2_insn(u_char* p, off_t at, bool encode)
+{
+  uint32_t hw1, hw2, s, j1, j2, v, pc;
+
+  hw1 = p[0] | ((uint32_t)p[1] << 8);
+  hw2 = p[2] | ((uint32_t)p[3] << 8);
+  s = (hw1 >> 10) & 1;
+  j1 = (hw2 >> 13) & 1;
+  j2 = (hw2 >> 11) & 1;
+  pc = (uint32_t)((at + 4) >> 1);
+  if (encode) {
+    v = (s << 23) | ((j1 ^ s ^ 1) << 22) | ((j2 ^ s ^ 1) << 21) |
+        ((hw1 & 0x3FF) << 11) | (hw2 & 0x7FF);
+    v = (v + pc) & 0xFFFFFF;
+    s = v >> 23;
+    j1 = (v >> 22) & 1;
+    j2 = (v >> 21) & 1;
+  } else {
+    v = (s << 23) | (j1 << 22) | (j2 << 21) |
+        ((hw1 & 0x3FF) << 11) | (hw2 & 0x7FF);
+    v = (v - pc) & 0xFFFFFF;
+    s = v >> 23;
+    j1 = ((v >> 22) & 1) ^ s ^ 1;
+    j2 = ((v >> 21) & 1) ^ s ^ 1;
+  }
+  hw1 = (hw1 & 0xF800) | (s << 10) | ((v >> 11) & 0x3FF);
+  hw2 = (hw2 & 0xD000) | (j1 << 13) | (j2 << 11) | (v & 0x7FF);
+
+  p[0] = hw1 & 0xFF; p[1] = hw1 >> 8;
+  p[2] = hw2 & 0xFF; p[3] = hw2 >> 8;
+}
+
+static inline void
+bsfilter_thumb2(u_char* buf, off_t size, off_t base, bool encode)
+{
+  off_t i;
+
+  for (i = (base & 1); i + 4 <= size; i += 2) {
+    if (!bsfilter_thumb2_bl(buf+i)) continue;
+    bsfilter_thumb2_insn(buf+i, base + i, encode);
+    i += 2;
+  }
+}
+
+/*-
+ * Encode 'dst', a copy of buf[from,from+len), as `bsfilter_thumb2` would
+ * leave those bytes encoding all of 'buf', reading only around the range:
+ * the scan looks for a BL at every halfword but the second one of a BL it
+ * took, so it can start at the first halfword after the last one before
+ * 'from' that is no BL. A BL may straddle either end of the range.
+ */
+static inline void
+bsfilter_thumb2_range(u_char* dst, const u_char* buf, off_t size, off_t base,
+                      off_t from, off_t len)
+{
+  u_char insn[4];
+  off_t i, j, first = (base & 1);
+
+  if (len <= 0) return;
+  i = from - ((from - first) & 1);
+  if (i < first) i = first;
+  while (i - 2 >= first && bsfilter_thumb2_bl(buf+i-2)) i -= 2;
+
+  for (; i + 4 <= size && i < from + len; i += 2) {
+    if (!bsfilter_thumb2_bl(buf+i)) continue;
+    memcpy(insn, buf+i, 4);
+    bsfilter_thumb2_insn(insn, base + i, true);
+    for (j = 0; j < 4; j++)
+      if (i + j >= from && i + j < from + len) dst[i+j-from] = insn[j];
+    i += 2;
+  }
+}
+
+/*-
+ * Add runs of patches with BSDIFF_WORD_DIFF may be word-wise: the 32-bit
+ * little-endian words aligned in the new image are subtracted modulo 2^32,
+ * the bytes before the first and after the last one byte by byte. A table
+ * of pointers that all moved by the same amount then diffs to one repeated
+ * word, where bytes would carry into their neighbours now and then.
+ * 'at' is the offset of the run in the new image.
+ */
+static inline uint32_t
+bsfilter_le32(const u_char* p)
+{
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static inline void
+bsfilter_diff_words(u_char* db, const u_char* newp, const u_char* oldp,
+                    off_t len, off_t at)
+{
+  uint32_t w;
+  off_t i, head;
+
+  head = (4 - (at & 3)) & 3;
+  for (i = 0; i < head && i < len; i++) db[i] = newp[i] - oldp[i];
+  for (; i + 4 <= len; i += 4) {
+    w = bsfilter_le32(newp+i) - bsfilter_le32(oldp+i);
+    db[i] = w & 0xFF;         db[i+1] = (w >> 8) & 0xFF;
+    db[i+2] = (w >> 16) & 0xFF; db[i+3] = w >> 24;
+  }
+  for (; i < len; i++) db[i] = newp[i] - oldp[i];
+}
+
+static inline void
+bsfilter_add_words(u_char* newp, const u_char* oldp, const u_char* db,
+                   off_t len, off_t at)
+{
+  uint32_t w;
+  off_t i, head;
+
+  head = (4 - (at & 3)) & 3;
+  for (i = 0; i < head && i < len; i++) newp[i] = oldp[i] + db[i];
+  for (; i + 4 <= len; i += 4) {
+    w = bsfilter_le32(oldp+i) + bsfilter_le32(db+i);
+    newp[i] = w & 0xFF;         newp[i+1] = (w >> 8) & 0xFF;
+    newp[i+2] = (w >> 16) & 0xFF; newp[i+3] = w >> 24;
+  }
+  for (; i < len; i++) newp[i] = oldp[i] + db[i];
+}
+
+/* Run the filters selected by 'flags' over 'buf' */
+static inline void
+bsfilter_apply(int flags, u_char* buf, off_t size, off_t base, bool encode)
+{
+  if (flags & BSDIFF_FILTER_THUMB2) bsfilter_thumb2(buf, size, base, encode);
+}
+
+/* Encode a copy of buf[from,from+len) in 'dst' as `bsfilter_apply` encodes
+   all of 'buf' */
+static inline void
+bsfilter_apply_range(int flags, u_char* dst, const u_char* buf, off_t size,
+                     off_t base, off_t from, off_t len)
+{
+  if (flags & BSDIFF_FILTER_THUMB2)
+    bsfilter_thumb2_range(dst, buf, size, base, from, len);
+}
+
+#endif /* _MINIBSDIFF_FILTER_H_ */
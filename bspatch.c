@@ -29,12 +29,17 @@
 __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:06 cperciva Exp $");
 #endif
 
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "bspatch.h"
+#include "bsfilter.h"
 #include "lz4.h"
 
 /*
@@ -49,8 +54,48 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:
   with control block a set of triples (x,y,z) meaning "add x bytes
   from oldfile to x bytes from the diff block; copy y bytes from the
   extra block; seek forwards in oldfile by z bytes".
+  With BSDIFF_SPARSE_DIFF the diff block holds, for each add run, LEB128
+  pairs (zeros, literals) each followed by that many diff bytes: the
+  zeros leave old bytes (or words) as they are.
+
+  Patches starting with BSDIFF_CONFIG_MAGIC_EXT carry an extended header
+  of H bytes, and the blocks start at H instead of 32:
+  32       8       H
+  40       8       decompressed length of the control block
+  48       8       decompressed length of the diff block
+  56       8       decompressed length of the extra block
+
+  Patches starting with BSDIFF_CONFIG_MAGIC_FLAGS go on with
+  64       8       feature flags (see minibsdiff-config.h)
+  72       8       offset of the old file in its image, for filters
+  80       8       offset of the new file in its image
+  88       8       length of the old file
+  and with BSDIFF_EXTRA_DICT
+  96       8       offset of the extra block's LZ4 dictionary in the
+                   (filtered) old file
+  104      8       length of the dictionary
 */
 
+/* Smallest extended headers we understand */
+#define BSPATCH_EXT_HEADER_SIZE 64
+#define BSPATCH_FLAGS_HEADER_SIZE 96
+#define BSPATCH_DICT_HEADER_SIZE 112
+
+/* Largest dictionary LZ4 can use */
+#define BSPATCH_DICT_MAX 65536
+
+/* Decoded patch header. Decompressed lengths are -1 if not recorded. */
+typedef struct {
+  off_t hdrlen;
+  off_t ctrllen, datalen, extralen;
+  off_t newsize;
+  off_t ctrlsz, diffsz, extrasz;
+  off_t flags;
+  off_t old_base, new_base;
+  off_t oldsize;  /* recorded with flags, -1 otherwise */
+  off_t dictoff, dictlen;
+} bspatch_header;
+
 static off_t
 offtin(u_char *buf)
 {
@@ -70,476 +115,452 @@ offtin(u_char *buf)
   return y;
 }
 
-bool
-bspatch_valid_header(u_char* patch, ssize_t patchsz)
+/* Compute the decompressed length of a raw LZ4 block without decoding it,
+   by walking its sequence headers. Returns -1 if the block is malformed. */
+static off_t
+lz4_block_size(const u_char* src, off_t srcsz)
 {
-  ssize_t newsize, ctrllen, datalen;
+  off_t ip, total, len;
+  u_char token, b;
+
+  ip=0;total=0;
+  while(ip<srcsz) {
+    token=src[ip++];
 
-  if (patchsz < 32) return false;
+    /* Literal run */
+    len=token>>4;
+    if(len==15) {
+      do {
+        if(ip>=srcsz) return -1;
+        b=src[ip++];len+=b;
+      } while(b==255);
+    };
+    if(len>srcsz-ip) return -1;
+    ip+=len;total+=len;
 
-  /* Make sure magic and header fields are valid */
-  if (memcmp(patch, "MBSDIF43", 8) != 0 && memcmp(patch, "BSDIFF40", 8) != 0) {
+    /* The last sequence carries literals only */
+    if(ip==srcsz) break;
+
+    /* Match: 2 byte offset, then length */
+    if(ip+2>srcsz) return -1;
+    ip+=2;
+    len=(token&15)+4;
+    if((token&15)==15) {
+      do {
+        if(ip>=srcsz) return -1;
+        b=src[ip++];len+=b;
+      } while(b==255);
+    };
+    total+=len;
+  };
+
+  return total;
+}
+
+static bool
+read_header(u_char* patch, off_t patchsz, bspatch_header* h)
+{
+  bool flagged;
+
+  if (patch == NULL || patchsz < 32) return false;
+
+  h->flags=0;
+  h->old_base=0;
+  h->new_base=0;
+  h->oldsize=-1;
+  h->dictoff=0;
+  h->dictlen=0;
+  flagged=(memcmp(patch, BSDIFF_CONFIG_MAGIC_FLAGS, 8) == 0);
+  if (flagged || memcmp(patch, BSDIFF_CONFIG_MAGIC_EXT, 8) == 0) {
+    if (patchsz < BSPATCH_EXT_HEADER_SIZE) return false;
+    h->hdrlen=offtin(patch+32);
+    if ((h->hdrlen < BSPATCH_EXT_HEADER_SIZE) || (h->hdrlen > patchsz))
+      return false;
+    h->ctrlsz=offtin(patch+40);
+    h->diffsz=offtin(patch+48);
+    h->extrasz=offtin(patch+56);
+    if ((h->ctrlsz < 0) || (h->diffsz < 0) || (h->extrasz < 0))
+      return false;
+    if (flagged) {
+      if (h->hdrlen < BSPATCH_FLAGS_HEADER_SIZE) return false;
+      h->flags=offtin(patch+64);
+      h->old_base=offtin(patch+72);
+      h->new_base=offtin(patch+80);
+      h->oldsize=offtin(patch+88);
+      if ((h->flags & ~(off_t)BSDIFF_FLAGS_KNOWN) || (h->old_base < 0) ||
+          (h->new_base < 0) || (h->oldsize < 0))
+        return false;
+      if (h->flags & BSDIFF_EXTRA_DICT) {
+        if (h->hdrlen < BSPATCH_DICT_HEADER_SIZE) return false;
+        h->dictoff=offtin(patch+96);
+        h->dictlen=offtin(patch+104);
+        if ((h->dictoff < 0) || (h->dictlen <= 0) ||
+            (h->dictlen > BSPATCH_DICT_MAX) ||
+            (h->dictoff > h->oldsize-h->dictlen))
+          return false;
+      }
+    }
+  } else if (memcmp(patch, BSDIFF_CONFIG_MAGIC, 8) == 0 ||
+             memcmp(patch, "BSDIFF40", 8) == 0) {
+    h->hdrlen=32;
+    h->ctrlsz=-1;
+    h->diffsz=-1;
+    h->extrasz=-1;
+  } else {
     return false;
   }
 
-  ctrllen=offtin(patch+8);
-  datalen=offtin(patch+16);
-  newsize=offtin(patch+24);
-  if((ctrllen<0) || (datalen<0) || (newsize<0))
+  h->ctrllen=offtin(patch+8);
+  h->datalen=offtin(patch+16);
+  h->newsize=offtin(patch+24);
+  if((h->ctrllen<0) || (h->datalen<0) || (h->newsize<0))
+    return false;
+  if((h->ctrllen>patchsz-h->hdrlen) ||
+     (h->datalen>patchsz-h->hdrlen-h->ctrllen))
     return false;
+  h->extralen=patchsz-h->hdrlen-h->ctrllen-h->datalen;
 
   return true;
 }
 
+bool
+bspatch_valid_header(u_char* patch, ssize_t patchsz)
+{
+  bspatch_header h;
+
+  return read_header(patch, patchsz, &h);
+}
+
 ssize_t
 bspatch_newsize(u_char* patch, ssize_t patchsz)
 {
-  if (!bspatch_valid_header(patch, patchsz)) return -1;
-  return offtin(patch+24);
+  bspatch_header h;
+
+  if (!read_header(patch, patchsz, &h)) return -1;
+  return h.newsize;
+}
+
+off_t
+bspatch_workspace_size(u_char* patch, off_t patchsz, bspatch_workspace* ws)
+{
+  bspatch_header h;
+  u_char* ctrlp;
+
+  if (!read_header(patch, patchsz, &h)) return -1;
+
+  /* Legacy headers don't record the decompressed sizes, so recover them
+     from the LZ4 sequence headers of each block */
+  if (h.ctrlsz < 0) {
+    ctrlp=patch+h.hdrlen;
+    h.ctrlsz=lz4_block_size(ctrlp, h.ctrllen);
+    h.diffsz=lz4_block_size(ctrlp+h.ctrllen, h.datalen);
+    h.extrasz=lz4_block_size(ctrlp+h.ctrllen+h.datalen, h.extralen);
+    if((h.ctrlsz<0) || (h.diffsz<0) || (h.extrasz<0)) return -1;
+  }
+
+  if (ws != NULL) {
+    ws->ctrl=NULL;  ws->ctrlsz=h.ctrlsz;
+    ws->diff=NULL;  ws->diffsz=h.diffsz;
+    ws->extra=NULL; ws->extrasz=h.extrasz;
+  }
+
+  return h.ctrlsz+h.diffsz+h.extrasz;
+}
+
+void
+bspatch_workspace_attach(bspatch_workspace* ws, u_char* mem)
+{
+  ws->ctrl=mem;
+  ws->diff=ws->ctrl+ws->ctrlsz;
+  ws->extra=ws->diff+ws->diffsz;
+}
+
+/* Read a LEB128 number of at most 56 bits from buf[*pos,size). Returns
+   false if it runs past the end or is longer. */
+static bool
+get_varint(const u_char* buf, off_t size, off_t* pos, off_t* v)
+{
+  int shift;
+  u_char b;
+
+  *v=0;
+  for(shift=0;shift<56;shift+=7) {
+    if (*pos >= size) return false;
+    b=buf[(*pos)++];
+    *v|=(off_t)(b&0x7F)<<shift;
+    if (!(b&0x80)) return true;
+  };
+  return false;
+}
+
+/* Add a sparse add run of 'len' bytes to the old data already copied to
+   'newp', reading from diff[*pos,size). 'at' is the offset of the run in
+   the new image. Returns false if the diff is corrupt. */
+static bool
+add_sparse(u_char* newp, off_t len, const u_char* diff, off_t size,
+           off_t* pos, bool words, off_t at)
+{
+  off_t i, j, zeros, lits;
+
+  for(i=0;i<len;) {
+    if (!get_varint(diff, size, pos, &zeros) ||
+        !get_varint(diff, size, pos, &lits) ||
+        (zeros > len-i) || (lits > len-i-zeros) || (lits > size-*pos) ||
+        (zeros+lits == 0))
+      return false;
+    i+=zeros;
+    if (words)
+      bsfilter_add_words(newp+i, newp+i, diff+*pos, lits, at+i);
+    else
+      for(j=0;j<lits;j++) newp[i+j]+=diff[*pos+j];
+    *pos+=lits;
+    i+=lits;
+  };
+  return true;
+}
+
+/* Decompress one LZ4 block into 'dst', which holds at most 'dstsz' bytes,
+   with the 'dictsz' bytes at 'dict' as dictionary if there are any.
+   Returns the decompressed length or -1. */
+static off_t
+decompress_block(const u_char* src, off_t srcsz, u_char* dst, off_t dstsz,
+                 const u_char* dict, off_t dictsz)
+{
+  int res;
+
+  /* LZ4 always emits at least one byte, even for empty input */
+  if (srcsz == 0) return 0;
+  if (dstsz > LZ4_MAX_INPUT_SIZE) dstsz = LZ4_MAX_INPUT_SIZE;
+
+  if (dictsz > 0)
+    res = LZ4_decompress_safe_usingDict((const char*)src, (char*)dst,
+                                        (int)srcsz, (int)dstsz,
+                                        (const char*)dict, (int)dictsz);
+  else
+    res = LZ4_decompress_safe((const char*)src, (char*)dst, (int)srcsz,
+                              (int)dstsz);
+  return (res < 0) ? -1 : (off_t)res;
 }
 
 int
-bspatch(u_char* oldp, off_t oldsize,
-        u_char* newp, off_t newsize,
-        u_char* patch, off_t patchsize)
+bspatch_with_workspace(u_char* oldp, off_t oldsize,
+                       u_char* newp, off_t newsize,
+                       u_char* patch, off_t patchsize,
+                       bspatch_workspace* ws, bspatch_stats* stats)
 {
-  u_char header[32], *ctrl_buf, *diff_buf, *extra_buf;
-  off_t ctrl_len, diff_len, new_size;
+  bspatch_header h;
+  bspatch_stats st;
+  double t0;
+  u_char* ctrlp;
+  off_t ctrlsz, diffsz, extrasz;
+  off_t ctrlpos, diffpos, extrapos;
   off_t oldpos, newpos;
   off_t ctrl[3];
   off_t i;
-  int ret = 0;
-  
-  // Add declarations for decompression result variables
-  int ctrl_decompressed_size, diff_decompressed_size, extra_decompressed_size;
-  
+  bool words;
+  const u_char* src;
+
   /* Sanity checks */
-  if (oldp == NULL || newp == NULL || patch == NULL) {
-    fprintf(stderr, "Error: NULL input pointer\n");
+  if (oldp == NULL || newp == NULL || patch == NULL || ws == NULL)
     return -1;
-  }
-  if (oldsize < 0 || newsize < 0 || patchsize < 0) {
-    fprintf(stderr, "Error: Negative size parameter\n");
+  if (oldsize < 0 || newsize < 0 || patchsize < 0) return -1;
+  if (ws->ctrlsz < 0 || ws->diffsz < 0 || ws->extrasz < 0)
     return -1;
-  }
-
-  /* Read header */
-  if (patchsize < 32) {
-    fprintf(stderr, "Error: Patch too small (< 32 bytes)\n");
+  if ((ws->ctrl == NULL && ws->ctrlsz > 0) ||
+      (ws->diff == NULL && ws->diffsz > 0) ||
+      (ws->extra == NULL && ws->extrasz > 0))
     return -1;
-  }
-  memcpy(header, patch, 32);
-  
-  // Print header bytes in hex
-  fprintf(stderr, "Debug: Header bytes: ");
-  for (i = 0; i < 8; i++) {
-    fprintf(stderr, "%02x ", header[i]);
-  }
-  fprintf(stderr, "\n");
 
-  /* Check for appropriate magic */
-  // Try both the original bzip2 format and our new LZ4 format
-  if (memcmp(header, "MBSDIF43", 8) != 0 && memcmp(header, "BSDIFF40", 8) != 0) {
-    fprintf(stderr, "Error: Invalid patch magic\n");
-    return -1;
-  }
+  /* Read header */
+  if (!read_header(patch, patchsize, &h)) return -2;
+  if (h.newsize != newsize) return -2;
+  if ((h.flags & (BSDIFF_FILTERS | BSDIFF_EXTRA_DICT)) &&
+      h.oldsize != oldsize)
+    return -2;
 
-  /* Read lengths from header */
-  ctrl_len = offtin(header + 8);
-  diff_len = offtin(header + 16);
-  new_size = offtin(header + 24);
-  
-  fprintf(stderr, "Debug: ctrl_len=%ld, diff_len=%ld, new_size=%ld\n", 
-          (long )ctrl_len, (long )diff_len, (long )new_size);
-  
-  if (ctrl_len < 0 || diff_len < 0 || new_size < 0) {
-    fprintf(stderr, "Error: Negative length in header\n");
-    return -1;
-  }
-  
-  /* Sanity check */
-  if ((ctrl_len > patchsize - 32) ||
-      (diff_len > patchsize - 32 - ctrl_len) ||
-      (new_size != newsize)) {
-    fprintf(stderr, "Error: Invalid patch sizes (ctrl_len=%ld, diff_len=%ld, patchsize=%ld, new_size=%ld, newsize=%ld)\n",
-            (long)ctrl_len, (long)diff_len, (long)patchsize, 
-            (long)new_size, (long)newsize);
-    return -1;
-  }
-  
-  /* Get pointers to the compressed data blocks */
-  ctrl_buf = malloc(newsize);
-  if (ctrl_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for control buffer\n");
-    return -1;
-  }
-  else{
+  memset(&st, 0, sizeof(st));
 
-      fprintf(stderr, "Debug: Malloc ctrl_buf size: %d\n", sizeof(u_char) * 4096);
-  }
-  
-  /* Allocate memory for decompressed diff data */
-  diff_buf = malloc(newsize);
-  if (diff_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for diff buffer\n");
-    free(ctrl_buf);
-    return -1;
-  }
-  else{
+  /* Decompress the ctrl, diff and extra blocks into the workspace; the
+     extra block may use a window of the old file as dictionary */
+  t0=minibsdiff_clock();
+  ctrlp=patch+h.hdrlen;
+  ctrlsz=decompress_block(ctrlp, h.ctrllen, ws->ctrl, ws->ctrlsz, NULL, 0);
+  diffsz=decompress_block(ctrlp+h.ctrllen, h.datalen, ws->diff, ws->diffsz,
+                          NULL, 0);
+  extrasz=decompress_block(ctrlp+h.ctrllen+h.datalen, h.extralen,
+                           ws->extra, ws->extrasz,
+                           oldp+h.dictoff, h.dictlen);
+  if ((ctrlsz < 0) || (diffsz < 0) || (extrasz < 0)) return -3;
+  st.decompress_time=minibsdiff_clock()-t0;
 
-      fprintf(stderr, "Debug: Malloc diff_buf size: %d\n", newsize);
-  }
-  
-  /* Allocate memory for decompressed extra data */
-  extra_buf = malloc(newsize);
-  if (extra_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for extra buffer\n");
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  else{
+  /* The extended header must agree with what was decompressed */
+  if ((h.ctrlsz >= 0) &&
+      ((ctrlsz != h.ctrlsz) || (diffsz != h.diffsz) ||
+       (extrasz != h.extrasz)))
+    return -3;
 
-      fprintf(stderr, "Debug: Malloc extra_buf size: %d\n",  sizeof(u_char) * 4096);
-  }
-  
-  /* Decompress control data */
-  ctrl_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32, 
-      (char*)ctrl_buf, 
-      ctrl_len, 
-      newsize * 3 * 8);
-  
-  if (ctrl_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for control data: %d\n", ctrl_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Control data decompressed size: %d\n", ctrl_decompressed_size);
-  
-  /* Decompress diff data */
-  diff_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32 + ctrl_len, 
-      (char*)diff_buf, 
-      diff_len, 
-      newsize);
-  
-  if (diff_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for diff data: %d\n", diff_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Diff data decompressed size: %d\n", diff_decompressed_size);
-  
-  /* Decompress extra data */
-  extra_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32 + ctrl_len + diff_len, 
-      (char*)extra_buf, 
-      patchsize - 32 - ctrl_len - diff_len, 
-      newsize);
-  
-  if (extra_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for extra data: %d\n", extra_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Extra data decompressed size: %d\n", extra_decompressed_size);
-  
   /* Now apply the patch using the decompressed data */
-  oldpos = 0;
-  newpos = 0;
-  
-  u_char *ctrl_ptr = ctrl_buf;
-  u_char *diff_ptr = diff_buf;
-  u_char *extra_ptr = extra_buf;
-  
-  while (newpos < newsize) {
+  t0=minibsdiff_clock();
+  oldpos=0;newpos=0;
+  ctrlpos=0;diffpos=0;extrapos=0;
+  while(newpos<newsize) {
     /* Read control data */
-    for (i = 0; i <= 2; i++) {
-      ctrl[i] = offtin(ctrl_ptr);
-      ctrl_ptr += 8;
+    if (ctrlpos+24 > ctrlsz) return -3;
+    for(i=0;i<=2;i++) {
+      ctrl[i]=offtin(ws->ctrl+ctrlpos);
+      ctrlpos+=8;
+    };
+
+    /* Fill ops write a run of one byte */
+    if ((h.flags & BSDIFF_OP_FILL) && (ctrl[0] == -1)) {
+      if ((ctrl[1] < 0) || (ctrl[1] > newsize-newpos) ||
+          (ctrl[2] < 0) || (ctrl[2] > 255))
+        return -3;
+      memset(newp+newpos, (int)ctrl[2], ctrl[1]);
+      newpos+=ctrl[1];
+      st.triples++;
+      st.fill_bytes+=ctrl[1];
+      continue;
+    }
+
+    /* Copy ops repeat earlier output, overlapping it like LZ77 matches */
+    if ((h.flags & BSDIFF_OP_COPY) && (ctrl[0] == -2)) {
+      if ((ctrl[1] < 0) || (ctrl[1] > newsize-newpos) ||
+          (ctrl[2] <= 0) || (ctrl[2] > newpos))
+        return -3;
+      if (ctrl[2] >= ctrl[1])
+        memcpy(newp+newpos, newp+newpos-ctrl[2], ctrl[1]);
+      else
+        for(i=0;i<ctrl[1];i++)
+          newp[newpos+i]=newp[newpos-ctrl[2]+i];
+      newpos+=ctrl[1];
+      st.triples++;
+      st.copy_bytes+=ctrl[1];
+      continue;
+    }
+
+    words=false;
+    if (h.flags & BSDIFF_WORD_DIFF) {
+      words=(ctrl[0] & 1);
+      ctrl[0]>>=1;
     }
-    
-    fprintf(stderr, "Debug: Control triple: (%ld, %ld, %ld)\n", 
-            (long)ctrl[0], (long)ctrl[1], (long)ctrl[2]);
-    
-    /* Sanity check */
-    if (newpos + ctrl[0] > newsize ||
-        oldpos + ctrl[0] > oldsize ||
-        newpos + ctrl[1] > newsize) {
-      fprintf(stderr, "Error: Invalid control data (newpos=%ld, ctrl[0]=%ld, oldpos=%ld, ctrl[1]=%ld, newsize=%ld, oldsize=%ld)\n",
-              (long)newpos, (long)ctrl[0], (long)oldpos, 
-              (long)ctrl[1], (long)newsize, (long)oldsize);
-      ret = -1;
-      goto out;
+
+    /* Sanity-check */
+    if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+        (ctrl[0] > newsize-newpos) ||
+        (!(h.flags & BSDIFF_SPARSE_DIFF) && (ctrl[0] > diffsz-diffpos)) ||
+        (oldpos < 0) || (ctrl[0] > oldsize-oldpos))
+      return -3;
+
+    /* A filtered patch adds to the filtered old file, and makes the
+       filtered new file; the old bytes are filtered as they are copied */
+    src=oldp+oldpos;
+    if (h.flags & (BSDIFF_FILTERS | BSDIFF_SPARSE_DIFF)) {
+      memcpy(newp+newpos, src, ctrl[0]);
+      bsfilter_apply_range((int)h.flags, newp+newpos, oldp, oldsize,
+                           h.old_base, oldpos, ctrl[0]);
+      src=newp+newpos;
     }
-    
+
     /* Add old data to diff string */
-    for (i = 0; i < ctrl[0]; i++) {
-      if ((oldpos + i >= 0) && (oldpos + i < oldsize)) {
-        newp[newpos + i] = oldp[oldpos + i] + diff_ptr[i];
-      } else {
-        newp[newpos + i] = diff_ptr[i];
-      }
+    if (h.flags & BSDIFF_SPARSE_DIFF) {
+      if (!add_sparse(newp+newpos, ctrl[0], ws->diff, diffsz, &diffpos,
+                      words, h.new_base+newpos))
+        return -3;
+    } else {
+      if (words)
+        bsfilter_add_words(newp+newpos, src, ws->diff+diffpos,
+                           ctrl[0], h.new_base+newpos);
+      else
+        for(i=0;i<ctrl[0];i++)
+          newp[newpos+i]=src[i]+ws->diff[diffpos+i];
+      diffpos+=ctrl[0];
     }
-    
+
     /* Adjust pointers */
-    diff_ptr += ctrl[0];
-    newpos += ctrl[0];
-    oldpos += ctrl[0];
-    
-    /* Sanity check */
-    if (newpos + ctrl[1] > newsize) {
-      fprintf(stderr, "Error: Invalid control data for extra block (newpos=%ld, ctrl[1]=%ld, newsize=%ld)\n",
-              (long)newpos, (long)ctrl[1], (long)newsize);
-      ret = -1;
-      goto out;
-    }
-    
-    /* Copy extra string */
-    memcpy(newp + newpos, extra_ptr, ctrl[1]);
-    
+    newpos+=ctrl[0];
+    oldpos+=ctrl[0];
+
+    /* Sanity-check */
+    if ((ctrl[1] > newsize-newpos) || (ctrl[1] > extrasz-extrapos))
+      return -3;
+
+    /* Read extra string */
+    memcpy(newp+newpos, ws->extra+extrapos, ctrl[1]);
+
     /* Adjust pointers */
-    extra_ptr += ctrl[1];
-    newpos += ctrl[1];
-    oldpos += ctrl[2];
+    extrapos+=ctrl[1];
+    newpos+=ctrl[1];
+    oldpos+=ctrl[2];
+
+    st.triples++;
+    st.add_bytes+=ctrl[0];
+    st.extra_bytes+=ctrl[1];
+    st.seek_bytes+=(ctrl[2]<0) ? -ctrl[2] : ctrl[2];
+  };
+
+  if (h.flags & BSDIFF_FILTERS)
+    bsfilter_apply((int)h.flags, newp, newsize, h.new_base, false);
+
+  if (stats != NULL) {
+    st.apply_time=minibsdiff_clock()-t0;
+    *stats=st;
   }
-  
-out:
-  free(extra_buf);
-  free(diff_buf);
-  free(ctrl_buf);
+
+  return 0;
+}
+
+/* Allocate a single block for 'ws', run the apply engine and release it */
+static int
+bspatch_alloc_and_apply(u_char* oldp, off_t oldsize,
+                        u_char* newp, off_t newsize,
+                        u_char* patch, off_t patchsize,
+                        bspatch_workspace* ws)
+{
+  u_char* mem;
+  int ret;
+
+  /* Never malloc(0) */
+  mem = malloc(ws->ctrlsz + ws->diffsz + ws->extrasz + 1);
+  if (mem == NULL) return -1;
+  bspatch_workspace_attach(ws, mem);
+
+  ret = bspatch_with_workspace(oldp, oldsize, newp, newsize,
+                               patch, patchsize, ws, NULL);
+  free(mem);
   return ret;
 }
 
-int optimized_bspatch(u_char* oldp, off_t oldsize,
+int
+bspatch(u_char* oldp, off_t oldsize,
         u_char* newp, off_t newsize,
-        u_char* patch, off_t patchsize,
-        off_t max_ctrl_decompressed_size, off_t max_extra_decompressed_size)
+        u_char* patch, off_t patchsize)
 {
-  u_char header[32], *ctrl_buf, *diff_buf, *extra_buf;
-  off_t ctrl_len, diff_len, new_size;
-  off_t oldpos, newpos;
-  off_t ctrl[3];
-  off_t i;
-  int ret = 0;
-  
-  // Add declarations for decompression result variables
-  int ctrl_decompressed_size, diff_decompressed_size, extra_decompressed_size;
-  
-  /* Sanity checks */
-  if (oldp == NULL || newp == NULL || patch == NULL) {
-    fprintf(stderr, "Error: NULL input pointer\n");
-    return -1;
-  }
-  if (oldsize < 0 || newsize < 0 || patchsize < 0) {
-    fprintf(stderr, "Error: Negative size parameter\n");
-    return -1;
-  }
+  bspatch_workspace ws;
 
-  /* Read header */
-  if (patchsize < 32) {
-    fprintf(stderr, "Error: Patch too small (< 32 bytes)\n");
-    return -1;
-  }
-  memcpy(header, patch, 32);
-  
-  // Print header bytes in hex
-  fprintf(stderr, "Debug: Header bytes: ");
-  for (i = 0; i < 8; i++) {
-    fprintf(stderr, "%02x ", header[i]);
-  }
-  fprintf(stderr, "\n");
+  if (oldp == NULL || newp == NULL || patch == NULL) return -1;
+  if (bspatch_workspace_size(patch, patchsize, &ws) < 0) return -2;
 
-  /* Check for appropriate magic */
-  // Try both the original bzip2 format and our new LZ4 format
-  if (memcmp(header, "MBSDIF43", 8) != 0 && memcmp(header, "BSDIFF40", 8) != 0) {
-    fprintf(stderr, "Error: Invalid patch magic\n");
-    return -1;
-  }
+  return bspatch_alloc_and_apply(oldp, oldsize, newp, newsize,
+                                 patch, patchsize, &ws);
+}
 
-  /* Read lengths from header */
-  ctrl_len = offtin(header + 8);
-  diff_len = offtin(header + 16);
-  new_size = offtin(header + 24);
-  
-  fprintf(stderr, "Debug: ctrl_len=%ld, diff_len=%ld, new_size=%ld\n", 
-          (long )ctrl_len, (long )diff_len, (long )new_size);
-  
-  if (ctrl_len < 0 || diff_len < 0 || new_size < 0) {
-    fprintf(stderr, "Error: Negative length in header\n");
-    return -1;
-  }
-  
-  /* Sanity check */
-  if ((ctrl_len > patchsize - 32) ||
-      (diff_len > patchsize - 32 - ctrl_len) ||
-      (new_size != newsize)) {
-    fprintf(stderr, "Error: Invalid patch sizes (ctrl_len=%ld, diff_len=%ld, patchsize=%ld, new_size=%ld, newsize=%ld)\n",
-            (long)ctrl_len, (long)diff_len, (long)patchsize, 
-            (long)new_size, (long)newsize);
-    return -1;
-  }
-  
-  /* Get pointers to the compressed data blocks */
-  ctrl_buf = (u_char*)malloc(sizeof(u_char) * max_ctrl_decompressed_size);
-  if (ctrl_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for control buffer\n");
-    return -1;
-  }
-  else{
+int
+optimized_bspatch(u_char* oldp, off_t oldsize,
+                  u_char* newp, off_t newsize,
+                  u_char* patch, off_t patchsize,
+                  off_t max_ctrl_decompressed_size,
+                  off_t max_extra_decompressed_size)
+{
+  bspatch_workspace ws;
 
-      fprintf(stderr, "Debug: Malloc ctrl_buf size: %d\n", sizeof(u_char) * max_ctrl_decompressed_size);
-  }
-  
-  /* Allocate memory for decompressed diff data */
-  diff_buf = malloc(newsize);
-  if (diff_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for diff buffer\n");
-    free(ctrl_buf);
+  if (max_ctrl_decompressed_size < 0 || max_extra_decompressed_size < 0)
     return -1;
-  }
-  else{
 
-      fprintf(stderr, "Debug: Malloc diff_buf size: %d\n", newsize);
-  }
-  
-  /* Allocate memory for decompressed extra data */
-  extra_buf =  (u_char*)malloc(sizeof(u_char) * max_extra_decompressed_size);
-  if (extra_buf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for extra buffer\n");
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  else{
+  ws.ctrlsz = max_ctrl_decompressed_size;
+  ws.diffsz = newsize;
+  ws.extrasz = max_extra_decompressed_size;
 
-      fprintf(stderr, "Debug: Malloc extra_buf size: %d\n",  sizeof(u_char) * max_extra_decompressed_size);
-  }
-  
-  /* Decompress control data */
-  ctrl_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32, 
-      (char*)ctrl_buf, 
-      ctrl_len, 
-      newsize * 3 * 8);
-  
-  if (ctrl_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for control data: %d\n", ctrl_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Control data decompressed size: %d\n", ctrl_decompressed_size);
-  
-  /* Decompress diff data */
-  diff_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32 + ctrl_len, 
-      (char*)diff_buf, 
-      diff_len, 
-      newsize);
-  
-  if (diff_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for diff data: %d\n", diff_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Diff data decompressed size: %d\n", diff_decompressed_size);
-  
-  /* Decompress extra data */
-  extra_decompressed_size = LZ4_decompress_safe(
-      (const char*)patch + 32 + ctrl_len + diff_len, 
-      (char*)extra_buf, 
-      patchsize - 32 - ctrl_len - diff_len, 
-      newsize);
-  
-  if (extra_decompressed_size < 0) {
-    fprintf(stderr, "Error: LZ4 decompression failed for extra data: %d\n", extra_decompressed_size);
-    free(extra_buf);
-    free(diff_buf);
-    free(ctrl_buf);
-    return -1;
-  }
-  
-  fprintf(stderr, "Debug: Extra data decompressed size: %d\n", extra_decompressed_size);
-  
-  /* Now apply the patch using the decompressed data */
-  oldpos = 0;
-  newpos = 0;
-  
-  u_char *ctrl_ptr = ctrl_buf;
-  u_char *diff_ptr = diff_buf;
-  u_char *extra_ptr = extra_buf;
-  
-  while (newpos < newsize) {
-    /* Read control data */
-    for (i = 0; i <= 2; i++) {
-      ctrl[i] = offtin(ctrl_ptr);
-      ctrl_ptr += 8;
-    }
-    
-    fprintf(stderr, "Debug: Control triple: (%ld, %ld, %ld)\n", 
-            (long)ctrl[0], (long)ctrl[1], (long)ctrl[2]);
-    
-    /* Sanity check */
-    if (newpos + ctrl[0] > newsize ||
-        oldpos + ctrl[0] > oldsize ||
-        newpos + ctrl[1] > newsize) {
-      fprintf(stderr, "Error: Invalid control data (newpos=%ld, ctrl[0]=%ld, oldpos=%ld, ctrl[1]=%ld, newsize=%ld, oldsize=%ld)\n",
-              (long)newpos, (long)ctrl[0], (long)oldpos, 
-              (long)ctrl[1], (long)newsize, (long)oldsize);
-      ret = -1;
-      goto out;
-    }
-    
-    /* Add old data to diff string */
-    for (i = 0; i < ctrl[0]; i++) {
-      if ((oldpos + i >= 0) && (oldpos + i < oldsize)) {
-        newp[newpos + i] = oldp[oldpos + i] + diff_ptr[i];
-      } else {
-        newp[newpos + i] = diff_ptr[i];
-      }
-    }
-    
-    /* Adjust pointers */
-    diff_ptr += ctrl[0];
-    newpos += ctrl[0];
-    oldpos += ctrl[0];
-    
-    /* Sanity check */
-    if (newpos + ctrl[1] > newsize) {
-      fprintf(stderr, "Error: Invalid control data for extra block (newpos=%ld, ctrl[1]=%ld, newsize=%ld)\n",
-              (long)newpos, (long)ctrl[1], (long)newsize);
-      ret = -1;
-      goto out;
-    }
-    
-    /* Copy extra string */
-    memcpy(newp + newpos, extra_ptr, ctrl[1]);
-    
-    /* Adjust pointers */
-    extra_ptr += ctrl[1];
-    newpos += ctrl[1];
-    oldpos += ctrl[2];
-  }
-  
-out:
-  free(extra_buf);
-  free(diff_buf);
-  free(ctrl_buf);
-  return ret;
-}
\ No newline at end of file
+  return bspatch_alloc_and_apply(oldp, oldsize, newp, newsize,
+                                 patch, patchsize, &ws);
+}
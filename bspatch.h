@@ -50,26 +50,78 @@ bool bspatch_valid_header(u_char* patch, ssize_t patchsz);
 ssize_t bspatch_newsize(u_char* patch, ssize_t patchsize);
 
 /*-
- * Apply a patch stored in 'patch' to 'oldp', result in 'newp', and store the
- * result in 'newp'.
+ * Scratch memory used by the apply engine to hold the decompressed ctrl,
+ * diff and extra blocks of a patch. Filtered patches (see `bsdiff_options`)
+ * filter the old bytes as they are read, and need no more. The caller owns
+ * all the buffers; they may live in static RAM and be reused across calls.
+ */
+typedef struct {
+  u_char* ctrl;  off_t ctrlsz;
+  u_char* diff;  off_t diffsz;
+  u_char* extra; off_t extrasz;
+} bspatch_workspace;
+
+/*-
+ * Statistics describing a single apply. All sizes are in bytes and all
+ * times are wall-clock seconds.
+ */
+typedef struct {
+  double decompress_time; /* LZ4 decompression of all three blocks */
+  double apply_time;      /* walking the ctrl block to build the new file */
+
+  off_t triples;     /* ctrl triples executed */
+  off_t add_bytes;   /* bytes produced by adding old and diff data */
+  off_t extra_bytes; /* bytes copied from the extra block */
+  off_t seek_bytes;  /* total distance of all seeks in the old file */
+  off_t fill_bytes;  /* bytes written by fill ops */
+  off_t copy_bytes;  /* bytes copied from earlier in the new file */
+} bspatch_stats;
+
+/*-
+ * Determine the exact amount of scratch memory needed to apply `patch`.
+ * If `ws` is not NULL, its `ctrlsz`, `diffsz` and `extrasz`
+ * fields are filled in (the buffer pointers are set to NULL.)
+ *
+ * The sizes are read straight from the extended header. For patches with
+ * a legacy header, they are recovered by walking the compressed blocks,
+ * which is cheap but linear in the size of the patch.
+ *
+ * Returns -1 if the patch header is invalid, otherwise the total number of
+ * bytes needed by all the buffers.
+ */
+off_t bspatch_workspace_size(u_char* patch, off_t patchsz,
+                             bspatch_workspace* ws);
+
+/*-
+ * Point the buffers of `ws` into the single block `mem`, which must be at
+ * least `ws->ctrlsz + ws->diffsz + ws->extrasz` bytes long.
+ */
+void bspatch_workspace_attach(bspatch_workspace* ws, u_char* mem);
+
+/*-
+ * Apply a patch stored in 'patch' to 'oldp', and store the result in
+ * 'newp', using only the memory provided in 'ws'.
  *
  * The input pointers must not be NULL.
  *
- * The size of 'newp', represented by 'newsz', must be at least
- * 'bspatch_newsize(oldsz,patchsz)' bytes in length.
+ * The size of 'newp', represented by 'newsize', must be exactly
+ * 'bspatch_newsize(patch,patchsize)' bytes in length, and every buffer of
+ * 'ws' must be at least as large as 'bspatch_workspace_size' reports.
  *
- * Returns -1 if memory can't be allocated, or the input pointers are NULL.
- * Returns -2 if the patch header is invalid. Returns -3 if the patch itself is
- * corrupt.
+ * Returns -1 if the input pointers are NULL or the workspace is malformed.
+ * Returns -2 if the patch header is invalid. Returns -3 if the patch itself
+ * is corrupt or does not fit in the workspace.
  * Otherwise, returns 0.
  *
- * This function requires n+m+O(1) bytes of memory, where n is the size of the
- * old file and m is the size of the new file. It does no allocations.
- * It runs in O(n+m) time.
+ * If 'stats' is not NULL, it is filled in with timings and counters for
+ * this call.
+ *
+ * This function does no allocations. It runs in O(n+m) time.
  */
-int bspatch(u_char* oldp, off_t oldsize,
-            u_char* newp, off_t newsize,
-            u_char* patch, off_t patchsize);
+int bspatch_with_workspace(u_char* oldp, off_t oldsize,
+                           u_char* newp, off_t newsize,
+                           u_char* patch, off_t patchsize,
+                           bspatch_workspace* ws, bspatch_stats* stats);
 
 /*-
  * Apply a patch stored in 'patch' to 'oldp', result in 'newp', and store the
@@ -85,14 +137,24 @@ int bspatch(u_char* oldp, off_t oldsize,
  * corrupt.
  * Otherwise, returns 0.
  *
- * This function requires n+m+O(1) bytes of memory, where n is the size of the
- * old file and m is the size of the new file. It does no allocations.
- * It runs in O(n+m) time.
+ * This is a wrapper around `bspatch_with_workspace` which allocates exactly
+ * `bspatch_workspace_size` bytes of scratch memory for the duration of the
+ * call. It runs in O(n+m) time.
  */
-int optimized_bspatch(u_char* oldp, off_t oldsize,
+int bspatch(u_char* oldp, off_t oldsize,
             u_char* newp, off_t newsize,
-            u_char* patch, off_t patchsize,
-            off_t max_ctrl_decompressed_size, off_t max_extra_decompressed_size);           
+            u_char* patch, off_t patchsize);
+
+/*-
+ * Like `bspatch`, but sizes the ctrl and extra scratch buffers from the
+ * caller-supplied maxima instead of the patch. A patch whose blocks do not
+ * fit is rejected as corrupt (-3).
+ */
+int optimized_bspatch(u_char* oldp, off_t oldsize,
+                      u_char* newp, off_t newsize,
+                      u_char* patch, off_t patchsize,
+                      off_t max_ctrl_decompressed_size,
+                      off_t max_extra_decompressed_size);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,245 @@
+/*
+ * Suffix indexes of old files larger than memory, sorted on disk
+ */
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* mkstemp */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "extindex.h"
+#include "fileio.h"
+
+#if !defined(_MSC_VER)
+#define EXTINDEX_POSIX 1
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+/* Suffixes sorted in memory at once when no limit is given, and at least */
+#define RUN_DEFAULT ((off_t)64 << 20)
+#define RUN_MIN ((off_t)1 << 16)
+
+struct extindex {
+    bsdiff_index* index;
+    fileio_buf map;       /* the merged index file */
+    char* path;
+};
+
+/* The head of one sorted run during the merge */
+typedef struct {
+    const off_t* at;
+    const off_t* end;
+} run_cursor;
+
+/* Create a new temporary file in 'dir', its name in 'path' */
+static FILE*
+temp_create(const char* dir, char* path, size_t cap)
+{
+    FILE* fp = NULL;
+    int n = snprintf(path, cap, "%s/minibsdiff-XXXXXX", dir);
+
+    if (n < 0 || (size_t)n >= cap) {
+        path[0] = '\0';
+        return NULL;
+    }
+#ifdef EXTINDEX_POSIX
+    {
+        int fd = mkstemp(path);
+        if (fd >= 0 && (fp = fdopen(fd, "wb")) == NULL) {
+            close(fd);
+            remove(path);
+        }
+    }
+#else
+    if (_mktemp_s(path, (size_t)n + 1) == 0) fp = fopen(path, "wb");
+#endif
+    if (fp == NULL) {
+        path[0] = '\0';
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    return fp;
+}
+
+static int
+temp_close(FILE* fp, int res)
+{
+    if (ferror(fp)) res = -1;
+    if (fclose(fp) != 0) res = -1;
+    return res;
+}
+
+/* Sort suffixes [first, first+len) of the 'n' in index order and write
+   them out */
+static int
+write_run(const u_char* old_data, off_t old_size, off_t k, off_t n,
+          off_t first, off_t len, off_t* buf, FILE* fp)
+{
+    off_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (first + i < n - 1) ? (first + i) * k : old_size;
+    }
+    bsdiff_suffix_sort(old_data, old_size, buf, len);
+    return (fwrite(buf, sizeof(off_t), (size_t)len, fp) == (size_t)len) ? 0 : -1;
+}
+
+/* Suffixes equal up to the sort depth go by offset, so the merge doesn't
+   depend on the run size */
+static int
+cursor_less(const u_char* old_data, off_t old_size,
+            const run_cursor* a, const run_cursor* b)
+{
+    int c = bsdiff_suffix_cmp(old_data, old_size, *a->at, *b->at);
+    return c < 0 || (c == 0 && *a->at < *b->at);
+}
+
+static void
+heap_down(run_cursor* heap, off_t size, off_t i,
+          const u_char* old_data, off_t old_size)
+{
+    run_cursor t;
+    off_t c;
+
+    while ((c = 2 * i + 1) < size) {
+        if (c + 1 < size && cursor_less(old_data, old_size, &heap[c + 1], &heap[c])) c++;
+        if (!cursor_less(old_data, old_size, &heap[c], &heap[i])) break;
+        t = heap[c];
+        heap[c] = heap[i];
+        heap[i] = t;
+        i = c;
+    }
+}
+
+/* Merge the 'runs' sorted runs of 'run_len' suffixes in 'sorted' */
+static int
+merge_runs(const u_char* old_data, off_t old_size, const off_t* sorted,
+           off_t n, off_t run_len, off_t runs, FILE* fp)
+{
+    run_cursor* heap;
+    off_t size, i;
+    int res = 0;
+
+    if ((heap = malloc((size_t)runs * sizeof(run_cursor))) == NULL) return -1;
+    for (i = 0; i < runs; i++) {
+        heap[i].at = sorted + i * run_len;
+        heap[i].end = sorted + ((i + 1) * run_len < n ? (i + 1) * run_len : n);
+    }
+    size = runs;
+    for (i = size / 2; i-- > 0;) heap_down(heap, size, i, old_data, old_size);
+
+    while (size > 0 && res == 0) {
+        if (fwrite(heap[0].at, sizeof(off_t), 1, fp) != 1) res = -1;
+        if (++heap[0].at == heap[0].end) heap[0] = heap[--size];
+        heap_down(heap, size, 0, old_data, old_size);
+    }
+    free(heap);
+    return res;
+}
+
+extindex*
+extindex_build(u_char* old_data, off_t old_size, const bsdiff_options* opts,
+               const char* dir, off_t memory_limit)
+{
+    extindex* ext;
+    fileio_buf runs_map;
+    off_t k = (opts != NULL && opts->stride > 1) ? opts->stride : 1;
+    off_t n, run_len, runs, r;
+    off_t* buf;
+    char* runs_path;
+    size_t cap;
+    FILE* fp;
+    int res = 0;
+
+    if (old_data == NULL || old_size < 0 || dir == NULL) return NULL;
+    if (opts != NULL && (opts->filter || opts->engine != BSDIFF_ENGINE_SUFFIX)) {
+        return NULL;
+    }
+
+    n = (old_size + k - 1) / k + 1;
+    run_len = ((memory_limit > 0) ? memory_limit : RUN_DEFAULT) / (off_t)sizeof(off_t);
+    if (run_len < RUN_MIN) run_len = RUN_MIN;
+    if (run_len > n) run_len = n;
+    runs = (n + run_len - 1) / run_len;
+
+    cap = strlen(dir) + 32;
+    ext = calloc(1, sizeof(*ext));
+    runs_path = malloc(cap);
+    buf = malloc((size_t)run_len * sizeof(off_t));
+    if (ext == NULL || runs_path == NULL || buf == NULL ||
+        (ext->path = malloc(cap)) == NULL) {
+        free(buf);
+        free(runs_path);
+        free(ext);
+        return NULL;
+    }
+    ext->path[0] = '\0';
+
+    /* A single run is the index; more are written to one file and merged */
+    if (runs == 1) {
+        if ((fp = temp_create(dir, ext->path, cap)) == NULL) goto fail;
+        res = temp_close(fp, write_run(old_data, old_size, k, n, 0, n, buf, fp));
+    } else {
+        if ((fp = temp_create(dir, runs_path, cap)) == NULL) goto fail;
+        for (r = 0; r < runs && res == 0; r++) {
+            res = write_run(old_data, old_size, k, n, r * run_len,
+                            (r + 1 < runs) ? run_len : n - r * run_len, buf, fp);
+        }
+        res = temp_close(fp, res);
+        free(buf);
+        buf = NULL;
+        if (res == 0) res = fileio_read(runs_path, FILEIO_SEQUENTIAL, &runs_map);
+        if (res == 0) {
+            if ((fp = temp_create(dir, ext->path, cap)) == NULL) {
+                res = -1;
+            } else {
+                res = temp_close(fp, merge_runs(old_data, old_size,
+                                                (const off_t*)runs_map.data,
+                                                n, run_len, runs, fp));
+            }
+            fileio_release(&runs_map);
+        }
+        remove(runs_path);
+    }
+    free(runs_path);
+    runs_path = NULL;
+    free(buf);
+    buf = NULL;
+    if (res != 0) goto fail;
+
+    if (fileio_read(ext->path, FILEIO_RANDOM, &ext->map) != 0) goto fail;
+    if (ext->map.size != n * (off_t)sizeof(off_t) ||
+        (ext->index = bsdiff_index_wrap(old_data, old_size, (off_t*)ext->map.data,
+                                        n, opts)) == NULL) {
+        goto fail;
+    }
+    return ext;
+
+fail:
+    free(runs_path);
+    free(buf);
+    extindex_free(ext);
+    return NULL;
+}
+
+bsdiff_index*
+extindex_index(extindex* ext)
+{
+    return ext->index;
+}
+
+void
+extindex_free(extindex* ext)
+{
+    if (ext == NULL) return;
+    bsdiff_index_free(ext->index);
+    fileio_release(&ext->map);
+    if (ext->path[0] != '\0') remove(ext->path);
+    free(ext->path);
+    free(ext);
+}
@@ -0,0 +1,39 @@
+/*
+ * Suffix indexes of old files larger than memory, sorted on disk
+ */
+#ifndef _MINIBSDIFF_EXTINDEX_H_
+#define _MINIBSDIFF_EXTINDEX_H_
+
+#include <sys/types.h>
+#include "minibsdiff-config.h"
+#include "bsdiff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct extindex extindex;
+
+/*
+ * Sort the suffixes of 'old_data' (every 'opts->stride'-th one when set) in
+ * runs of at most 'memory_limit' bytes of offsets (0 for a default), write
+ * each run to a temporary file in 'dir' and merge the runs into an index
+ * file there, which is mapped rather than read. Both files are removed when
+ * the index is freed. 'old_data' must stay valid until then.
+ * Filters and the hash engine are not supported.
+ * Returns NULL on error
+ */
+extindex* extindex_build(u_char* old_data, off_t old_size,
+                         const bsdiff_options* opts,
+                         const char* dir, off_t memory_limit);
+
+/* The index to diff against; owned by 'ext' */
+bsdiff_index* extindex_index(extindex* ext);
+
+void extindex_free(extindex* ext);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _MINIBSDIFF_EXTINDEX_H_ */
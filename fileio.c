@@ -0,0 +1,406 @@
+/*
+ * File I/O shared by the command line tool and the multi-patch code
+ */
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* posix_madvise, posix_fallocate, mkstemp */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "fileio.h"
+
+#if !defined(_MSC_VER)
+#define FILEIO_POSIX 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if !defined(MINIBSDIFF_NO_MMAP)
+#define FILEIO_MMAP 1
+#include <sys/mman.h>
+#endif
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+enum {
+    KIND_HEAP,            /* read into, or buffered in, malloc'd memory */
+    KIND_MAPPED,          /* read-only mapping of an input */
+    KIND_OUT_MAPPED,      /* shared mapping of a preallocated output */
+    KIND_OUT_HEAP         /* output buffered until fileio_commit */
+};
+
+/* Where "-" outputs go, see fileio_claim_stdout */
+#ifdef FILEIO_POSIX
+static int stdout_fd = 1;
+#endif
+
+static int
+is_stdio(const char* path)
+{
+    return strcmp(path, "-") == 0;
+}
+
+/* Read a stream of unknown size into memory */
+static int
+read_stream(FILE* fp, fileio_buf* buf)
+{
+    size_t cap = 1 << 16, len = 0, n;
+    u_char* data = malloc(cap);
+    u_char* grown;
+
+    if (data == NULL) return -1;
+    while ((n = fread(data + len, 1, cap - len, fp)) > 0) {
+        len += n;
+        if (len == cap) {
+            if (cap > SIZE_MAX / 2 || (grown = realloc(data, cap * 2)) == NULL) {
+                free(data);
+                return -1;
+            }
+            data = grown;
+            cap *= 2;
+        }
+    }
+    if (ferror(fp)) {
+        free(data);
+        return -1;
+    }
+
+    buf->data = data;
+    buf->size = (off_t)len;
+    buf->kind = KIND_HEAP;
+    return 0;
+}
+
+#ifdef FILEIO_POSIX
+/* Write all of 'data' to a file descriptor */
+static int
+write_fd(int fd, const u_char* data, off_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, data, (size_t)(size > (1 << 30) ? (1 << 30) : size));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Reserve disk space for an output; only running out of space is fatal,
+   file systems that can't preallocate are written to as usual */
+static int
+preallocate(int fd, off_t size)
+{
+    int err;
+
+    if (size <= 0) return 0;
+#if defined(__APPLE__)
+    (void)fd;
+    err = 0;              /* no posix_fallocate */
+#else
+    err = posix_fallocate(fd, 0, size);
+#endif
+    return (err == ENOSPC) ? -1 : 0;
+}
+
+/* Open a new file next to 'path' for an output to be renamed over it on
+   commit, so an input at the same path stays intact while it is read and a
+   failed output leaves nothing behind. Only a new path or a regular file
+   is replaced this way; symlinks, devices and FIFOs are written to as they
+   are. It gets the mode of the file it replaces, or the default one.
+   Returns the descriptor, or -1 with buf->tmp NULL if there is none. */
+static int
+open_temp(const char* path, fileio_buf* buf)
+{
+    struct stat st;
+    mode_t mask;
+    int fd, exists;
+
+    buf->tmp = NULL;
+    exists = (lstat(path, &st) == 0);
+    if (exists ? !S_ISREG(st.st_mode) : errno != ENOENT) return -1;
+    if ((buf->tmp = malloc(strlen(path) + 8)) == NULL) return -1;
+    sprintf(buf->tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(buf->tmp)) < 0) {
+        free(buf->tmp);
+        buf->tmp = NULL;
+        return -1;
+    }
+    if (exists) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    return fd;
+}
+
+/* Drop the temporary file of an output */
+static void
+drop_temp(fileio_buf* buf)
+{
+    if (buf->tmp == NULL) return;
+    remove(buf->tmp);
+    free(buf->tmp);
+    buf->tmp = NULL;
+}
+
+/* Move a finished temporary file over the output */
+static int
+rename_temp(fileio_buf* buf)
+{
+    int res;
+
+    if (buf->tmp == NULL) return 0;
+    res = (rename(buf->tmp, buf->path) == 0) ? 0 : -1;
+    if (res != 0) remove(buf->tmp);
+    free(buf->tmp);
+    buf->tmp = NULL;
+    return res;
+}
+#endif /* FILEIO_POSIX */
+
+int
+fileio_read(const char* path, int hint, fileio_buf* buf)
+{
+    FILE* fp;
+    int res;
+
+    if (path == NULL || buf == NULL) return -1;
+    memset(buf, 0, sizeof(*buf));
+    buf->fd = -1;
+    buf->path = path;
+
+    if (is_stdio(path)) {
+#ifdef _MSC_VER
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        return read_stream(stdin, buf);
+    }
+
+#ifdef FILEIO_POSIX
+    {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0) return -1;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+
+#ifdef FILEIO_MMAP
+        if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (unsigned long long)st.st_size < (unsigned long long)SIZE_MAX) {
+            void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                close(fd);
+                posix_madvise(p, (size_t)st.st_size,
+                              hint == FILEIO_SEQUENTIAL ? POSIX_MADV_SEQUENTIAL :
+                              hint == FILEIO_RANDOM ? POSIX_MADV_RANDOM :
+                              POSIX_MADV_WILLNEED);
+                buf->data = p;
+                buf->size = (off_t)st.st_size;
+                buf->kind = KIND_MAPPED;
+                return 0;
+            }
+        }
+#else
+        (void)hint;
+#endif
+
+        /* Pipes, empty files and failed mappings are read in full */
+        if ((fp = fdopen(fd, "rb")) == NULL) {
+            close(fd);
+            return -1;
+        }
+    }
+#else
+    (void)hint;
+    if ((fp = fopen(path, "rb")) == NULL) return -1;
+#endif
+
+    res = read_stream(fp, buf);
+    fclose(fp);
+    return res;
+}
+
+void
+fileio_release(fileio_buf* buf)
+{
+    if (buf == NULL || buf->data == NULL) return;
+#ifdef FILEIO_MMAP
+    if (buf->kind == KIND_MAPPED || buf->kind == KIND_OUT_MAPPED) {
+        munmap(buf->data, (size_t)buf->size);
+    } else
+#endif
+    free(buf->data);
+#ifdef FILEIO_POSIX
+    if (buf->fd >= 0) close(buf->fd);
+    drop_temp(buf);
+#endif
+    buf->data = NULL;
+    buf->fd = -1;
+}
+
+int
+fileio_create(const char* path, off_t size, fileio_buf* buf)
+{
+    if (path == NULL || buf == NULL || size < 0 ||
+        (unsigned long long)size >= (unsigned long long)SIZE_MAX) {
+        return -1;
+    }
+    memset(buf, 0, sizeof(*buf));
+    buf->fd = -1;
+    buf->path = path;
+    buf->size = size;
+
+#ifdef FILEIO_POSIX
+    if (!is_stdio(path) && (buf->fd = open_temp(path, buf)) >= 0) {
+        if (preallocate(buf->fd, size) != 0) {
+            close(buf->fd);
+            drop_temp(buf);
+            return -1;
+        }
+#ifdef FILEIO_MMAP
+        if (size > 0 && ftruncate(buf->fd, size) == 0) {
+            void* p = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           buf->fd, 0);
+            if (p != MAP_FAILED) {
+                buf->data = p;
+                buf->kind = KIND_OUT_MAPPED;
+                return 0;
+            }
+        }
+#endif
+    }
+#endif
+
+    /* stdout, no mapping, or a path that isn't replaced by a temporary
+       file: buffer and write out on commit */
+    buf->data = malloc((size_t)size + 1);
+    if (buf->data == NULL) {
+#ifdef FILEIO_POSIX
+        if (buf->fd >= 0) close(buf->fd);
+        drop_temp(buf);
+#endif
+        return -1;
+    }
+    buf->kind = KIND_OUT_HEAP;
+    return 0;
+}
+
+int
+fileio_commit(fileio_buf* buf, off_t size)
+{
+    int res = 0;
+
+    if (buf == NULL || buf->data == NULL || size < 0 || size > buf->size) {
+        return -1;
+    }
+
+#ifdef FILEIO_MMAP
+    if (buf->kind == KIND_OUT_MAPPED) {
+        res = munmap(buf->data, (size_t)buf->size);
+        if (size < buf->size && ftruncate(buf->fd, size) != 0) res = -1;
+        if (close(buf->fd) != 0) res = -1;
+        buf->data = NULL;
+        buf->fd = -1;
+        if (res != 0) drop_temp(buf);
+        else res = rename_temp(buf);
+        return res == 0 ? 0 : -1;
+    }
+#endif
+
+#ifdef FILEIO_POSIX
+    if (buf->fd >= 0) {
+        res = write_fd(buf->fd, buf->data, size);
+        if (ftruncate(buf->fd, size) != 0) res = -1;
+        if (close(buf->fd) != 0) res = -1;
+        buf->fd = -1;
+        if (res != 0) drop_temp(buf);
+        else res = rename_temp(buf);
+    } else
+#endif
+    res = fileio_write(buf->path, buf->data, size);
+
+    free(buf->data);
+    buf->data = NULL;
+    return res;
+}
+
+int
+fileio_write(const char* path, const u_char* data, off_t size)
+{
+#ifdef FILEIO_POSIX
+    int fd, res;
+
+    if (path == NULL || (data == NULL && size > 0)) return -1;
+    if (is_stdio(path)) return write_fd(stdout_fd, data, size);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return -1;
+    res = preallocate(fd, size);
+    if (res == 0) res = write_fd(fd, data, size);
+    if (close(fd) != 0) res = -1;
+    return res;
+#else
+    FILE* fp;
+    int res;
+
+    if (path == NULL || (data == NULL && size > 0)) return -1;
+    if (is_stdio(path)) {
+        _setmode(_fileno(stdout), _O_BINARY);
+        fp = stdout;
+    } else if ((fp = fopen(path, "wb")) == NULL) {
+        return -1;
+    }
+    res = (fwrite(data, 1, (size_t)size, fp) == (size_t)size) ? 0 : -1;
+    if (fp == stdout) {
+        if (fflush(fp) != 0) res = -1;
+    } else if (fclose(fp) != 0) {
+        res = -1;
+    }
+    return res;
+#endif
+}
+
+void
+fileio_claim_stdout(void)
+{
+#ifdef FILEIO_POSIX
+    if (stdout_fd != 1) return;
+    fflush(stdout);
+    stdout_fd = dup(1);
+    if (stdout_fd < 0 || dup2(2, 1) < 0) {
+        stdout_fd = 1;
+    }
+#endif
+}
+
+FILE*
+fileio_open_stdout(void)
+{
+#ifdef FILEIO_POSIX
+    FILE* fp;
+    int fd;
+
+    if (stdout_fd == 1) return stdout;
+    if ((fd = dup(stdout_fd)) < 0) return NULL;
+    if ((fp = fdopen(fd, "w")) == NULL) close(fd);
+    return fp;
+#else
+    return stdout;
+#endif
+}
@@ -0,0 +1,86 @@
+/*
+ * File I/O shared by the command line tool and the multi-patch code
+ */
+#ifndef _MINIBSDIFF_FILEIO_H_
+#define _MINIBSDIFF_FILEIO_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "minibsdiff-config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How a file will be read, passed on to the kernel as a paging hint */
+enum {
+    FILEIO_SEQUENTIAL,    /* front to back, once */
+    FILEIO_RANDOM,        /* scattered reads of a part of the file */
+    FILEIO_WILLNEED       /* all of it, in any order */
+};
+
+/* A file in memory. Only 'data' and 'size' are meant to be used. */
+typedef struct {
+    u_char* data;
+    off_t size;
+    int kind;             /* how 'data' was obtained */
+    int fd;               /* output being written through a mapping */
+    const char* path;
+    char* tmp;            /* file an output is written to until committed */
+} fileio_buf;
+
+/*
+ * Load a file. Regular files are mapped read-only where the platform allows
+ * it and 'hint' is applied to the mapping; other files, and "-" for stdin,
+ * are read into memory. 'buf->data' is never NULL on success, even for an
+ * empty file.
+ * Returns 0 on success, -1 on error
+ */
+int fileio_read(const char* path, int hint, fileio_buf* buf);
+
+/* Release a buffer from fileio_read */
+void fileio_release(fileio_buf* buf);
+
+/*
+ * Get a writable buffer of 'size' bytes that will become the file at 'path'.
+ * New and regular files are written to a preallocated and mapped temporary
+ * file in the same directory, renamed to 'path' on commit, so 'path' may
+ * also be an input. Other paths, such as symlinks, devices and FIFOs, and
+ * "-" (stdout) are buffered in memory and written to on commit.
+ * fileio_release discards an uncommitted output.
+ * Returns 0 on success, -1 on error
+ */
+int fileio_create(const char* path, off_t size, fileio_buf* buf);
+
+/*
+ * Finish a buffer from fileio_create, keeping its first 'size' bytes
+ * (at most the size it was created with).
+ * Returns 0 on success, -1 on error
+ */
+int fileio_commit(fileio_buf* buf, off_t size);
+
+/*
+ * Write 'size' bytes to the file at 'path' ("-" for stdout), preallocating
+ * regular files first.
+ * Returns 0 on success, -1 on error
+ */
+int fileio_write(const char* path, const u_char* data, off_t size);
+
+/*
+ * Reserve stdout for "-" outputs: from now on anything else printed to
+ * stdout goes to stderr, so messages don't end up in the output.
+ */
+void fileio_claim_stdout(void);
+
+/*
+ * A stream to the stdout reserved by fileio_claim_stdout, or stdout itself
+ * if it wasn't. Close it with fclose unless it is stdout.
+ * Returns NULL on error
+ */
+FILE* fileio_open_stdout(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _MINIBSDIFF_FILEIO_H_ */
@@ -43,11 +43,107 @@
 /** TODO FIXME: we should static_assert this */
 #define BSDIFF_CONFIG_MAGIC "MBSDIF43"
 
+/** Magic for patches carrying the extended header, which also records the
+    decompressed sizes of the ctrl, diff and extra blocks. MUST be 8 bytes
+    long, and differ from BSDIFF_CONFIG_MAGIC! */
+#define BSDIFF_CONFIG_MAGIC_EXT "MBSDIF44"
+
+/** Magic for patches whose extended header also carries feature flags,
+    which change how the patch is applied. Decoders that predate a flag
+    must refuse the patch, so it never reads as BSDIFF_CONFIG_MAGIC_EXT.
+    MUST be 8 bytes long. */
+#define BSDIFF_CONFIG_MAGIC_FLAGS "MBSDIF45"
+
+/** Feature flags. A decoder rejects patches with flags it doesn't know. */
+#define BSDIFF_FILTER_THUMB2 0x1 /* ARM Thumb-2 BL branch filter */
+#define BSDIFF_FILTERS       0x1 /* all of the filters above */
+#define BSDIFF_WORD_DIFF     0x2 /* add runs may subtract 32-bit words */
+#define BSDIFF_OP_FILL       0x4 /* ctrl triples (-1,n,b) write n bytes b */
+#define BSDIFF_OP_COPY       0x8 /* ctrl triples (-2,n,d) copy n bytes from
+                                    d bytes back in the new file */
+#define BSDIFF_OPS           0xC /* all of the ctrl operations above */
+#define BSDIFF_EXTRA_DICT    0x10 /* the extra block is compressed with a
+                                     window of the old file as dictionary */
+#define BSDIFF_SPARSE_DIFF   0x20 /* the diff block skips runs of zeros */
+#define BSDIFF_FLAGS_KNOWN   0x3F
+
+/* ------------------------------------------------------------------------- */
+/* -- Shortest run of one byte made a fill op ------------------------------ */
+
+/* A fill op costs a ctrl triple, and another to seek over the run when it
+   interrupts an add run */
+#define BSDIFF_FILL_MIN 128
+
+/* ------------------------------------------------------------------------- */
+/* -- Shortest repeat made a copy op --------------------------------------- */
+
+/* Copies replace extra bytes; shorter repeats are left to LZ4 */
+#define BSDIFF_COPY_MIN 32
+
+/* ------------------------------------------------------------------------- */
+/* -- Shortest run of zeros skipped in a sparse diff block ----------------- */
+
+/* Each skip costs a zero count and a literal count; shorter runs of zeros
+   stay among the literals */
+#define BSDIFF_SPARSE_GAP 8
+
+/* ------------------------------------------------------------------------- */
+/* -- Block index of the hash engine --------------------------------------- */
+
+/* The old file is hashed in blocks of this many bytes, so matches shorter
+   than two blocks may be missed */
+#define BSDIFF_HASH_BLOCK 16
+
+/* At most this many index slots (of sizeof(off_t) bytes), however large the
+   old file; a power of two */
+#define BSDIFF_HASH_SLOTS_MAX (1 << 22)
+
+/* ------------------------------------------------------------------------- */
+/* -- Strided suffix index ------------------------------------------------- */
+
+/* Suffixes indexed every k bytes are sorted on at most this many leading
+   bytes; longer common prefixes are left in any order */
+#define BSDIFF_STRIDE_DEPTH 64
+
+/* Largest stride accepted */
+#define BSDIFF_STRIDE_MAX 256
+
 /* ------------------------------------------------------------------------- */
 /* -- Slop size for temporary patch buffer --------------------------------- */
 
 #define BSDIFF_PATCH_SLOP_SIZE 102400
 
+/* ------------------------------------------------------------------------- */
+/* -- Wall clock used for statistics --------------------------------------- */
+
+/* Returns a monotonic time in seconds. Define MINIBSDIFF_NO_CLOCK on targets
+   without a usable clock; all timings then read as zero. */
+#if defined(MINIBSDIFF_NO_CLOCK)
+static inline double minibsdiff_clock(void) { return 0.0; }
+#elif defined(_MSC_VER)
+static __inline double
+minibsdiff_clock(void)
+{
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+}
+#else
+#include <time.h>
+static inline double
+minibsdiff_clock(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+#endif /* MINIBSDIFF_NO_CLOCK */
+
 /* ------------------------------------------------------------------------- */
 /* -- Type definitions ----------------------------------------------------- */
 
@@ -42,17 +42,26 @@
 
 #ifdef _MSC_VER
 #define _CRT_SECURE_NO_WARNINGS 1
+#else
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
 #endif /* _MSC_VER */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#include <sys/stat.h>
+#else
+#include <direct.h>
+#endif /* _MSC_VER */
 
 /* Create one large compilation unit */
 #include "bspatch.c"
 #include "bsdiff.c"
 #include "multipatch.h"
+#include "fileio.h"
 
 /* Add string.h for strdup */
 #include <string.h>
@@ -74,58 +83,309 @@ usage(void)
 {
   printf("usage:\n\n"
          "Generate patch:\n"
-         "\t$ %s gen <v1> <v2> <patch> [--mgen <num_chunks>]\n"
+         "\t$ %s gen <v1> <v2> <patch> [--stats <file>]\n"
+         "\t      [--mgen <num_chunks> [--threads <n>] [--mem-limit <MB>]\n"
+         "\t       [--window <KB> | --global]]\n"
+         "\t      [--budget <ctrl>,<extra>,<diff> [--window <KB>]]\n"
+         "\t      [--cache <dir>]  (with --mgen or --budget)\n"
+         "\t      [--index-dir <dir>]  (with --global, or --budget without --window)\n"
+         "\t      [--filter thumb2] [--diff-mode bytes|words|auto] [--ops fill,copy]\n"
+         "\t      [--extra-dict] [--sparse-diff] [--max-compression]\n"
+         "\t      [--engine suffix|hash] [--index-stride <k>]\n"
          "Apply patch:\n"
-         "\t$ %s app <v1> <patch> <v2>\n"
+         "\t$ %s app <v1> <patch> <v2> [--stats <file>]\n"
          "Apply multi-patch:\n"
-         "\t$ %s mapp <v1> <patch> <v2>\n", 
-         progname, progname, progname);
+         "\t$ %s mapp <v1> <patch> <v2> [--threads <n>]\n"
+         "Show the memory needed to apply a patch or multi-patch:\n"
+         "\t$ %s info <patch>\n\n"
+         "Files may be '-' for stdin or stdout\n"
+         "--stats writes timings and counters as JSON ('-' for stdout, with\n"
+         "messages on stderr); not with --mgen or --budget\n"
+         "--window diffs each chunk against the best matching old window\n"
+         "of at most that size instead of its proportional position;\n"
+         "--global lets every chunk match anywhere in the old file\n"
+         "--budget picks the chunks so the device buffers (bytes, 0 for\n"
+         "no limit) fit, with the smallest total patch\n"
+         "--cache keeps chunk patches in <dir> and reuses those whose old\n"
+         "and new data are unchanged\n"
+         "--index-dir sorts the index of the old file in <dir>, in runs of\n"
+         "at most --mem-limit, and maps it, for old files larger than memory\n"
+         "--filter thumb2 turns ARM Thumb-2 BL offsets into absolute\n"
+         "targets before diffing, for firmware images, if that is smaller\n"
+         "--diff-mode words subtracts aligned 32-bit words instead of bytes,\n"
+         "auto picks bytes or words for each run\n"
+         "--ops fill writes runs of one byte, such as erased flash, with a\n"
+         "fill operation; copy repeats earlier parts of the new file\n"
+         "--extra-dict compresses new data with the most similar 64KB of\n"
+         "the old file as dictionary, when that is smaller\n"
+         "--sparse-diff skips the runs of zeros in the diff block\n"
+         "--max-compression also picks matches by their estimated size\n"
+         "after compression and keeps the smaller patch, at about twice\n"
+         "the diffing time\n"
+         "--engine hash finds matches with a rolling hash of the old file\n"
+         "instead of sorting it: faster and smaller, for larger patches\n"
+         "--index-stride sorts only every k-th suffix of the old file, for\n"
+         "1/k of the index memory\n",
+         progname, progname, progname, progname);
   exit(EXIT_FAILURE);
 }
 
+/* Load a file ("-" for stdin); regular files are mapped, not copied */
 static long
-read_file(const char* f, u_char** buf)
+read_file(const char* f, int hint, fileio_buf* buf)
 {
-  FILE* fp;
-  long fsz;
-
-  fsz = 0;
-  if ( ((fp = fopen(f, "rb"))  == NULL)         ||
-       (fseek(fp, 0, SEEK_END)  != 0)           ||
-       ((fsz = ftell(fp))       == -1)          ||
-       ((*buf = malloc(fsz+1))  == NULL)        ||
-       (fseek(fp, 0, SEEK_SET)  != 0)           ||
-       (fread(*buf, 1, fsz, fp) != (size_t)fsz) ||
-       (fclose(fp)              != 0)
-     ) barf("Couldn't open file for reading!\n");
-
-  return fsz;
+  if (fileio_read(f, hint, buf) != 0)
+    barf("Couldn't open file for reading!\n");
+
+  return (long)buf->size;
 }
 
 static void
 write_file(const char* f, u_char* buf, long sz)
+{
+  if (fileio_write(f, buf, sz) != 0)
+    barf("Couldn't open file for writing!\n");
+
+  return;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Command line options ------------------------------------------------- */
+
+typedef struct {
+  int mgen_chunks;        /* --mgen <num_chunks>; 0 for a single patch */
+  const char* stats_file; /* --stats <file>; "-" is stdout */
+  int threads;            /* --threads <n>; chunks diffed at once */
+  off_t memory_limit;     /* --mem-limit <MB>; cap on chunk diffs in flight */
+  off_t window;           /* --window <KB>; anchor-aligned old window per
+                             chunk, 0 for proportional windows */
+  int global;             /* --global; every chunk sees the whole old file */
+  int use_budget;         /* --budget <ctrl>,<extra>,<diff>; search the
+                             chunk layout for the device buffers */
+  multipatch_budget budget;
+  const char* cache_dir;  /* --cache <dir>; chunk patches of earlier builds */
+  const char* index_dir;  /* --index-dir <dir>; sort the old index on disk */
+  int filter;             /* --filter <name>; BSDIFF_FILTER_* */
+  int diff_mode;          /* --diff-mode <name>; BSDIFF_DIFF_* */
+  int ops;                /* --ops <name>[,<name>]; BSDIFF_OP_* */
+  int extra_dict;         /* --extra-dict; old data primes the extra block */
+  int sparse_diff;        /* --sparse-diff; zeros of the diff are skipped */
+  int max_compression;    /* --max-compression; a planned parse if smaller */
+  int engine;             /* --engine <name>; BSDIFF_ENGINE_* */
+  int stride;             /* --index-stride <k>; 0 indexes every suffix */
+} options;
+
+/* Default to one worker per online CPU */
+static int
+default_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return (int)n;
+#endif
+  return 1;
+}
+
+/* Default to letting chunk diffs use half of physical memory */
+static off_t
+default_memory_limit(void)
+{
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+  long pages = sysconf(_SC_PHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && pagesize > 0) return (off_t)pages * pagesize / 2;
+#endif
+  return 0;
+}
+
+/* Parse a comma separated list of ctrl operations */
+static int
+parse_ops(const char* list)
+{
+  char name[16];
+  int ops = 0;
+  size_t n;
+
+  while (*list) {
+    n = strcspn(list, ",");
+    if (n == 0 || n >= sizeof(name)) usage();
+    memcpy(name, list, n);
+    name[n] = '\0';
+    if (strcmp(name, "fill") == 0) ops |= BSDIFF_OP_FILL;
+    else if (strcmp(name, "copy") == 0) ops |= BSDIFF_OP_COPY;
+    else usage();
+    list += n;
+    if (*list == ',') list++;
+  }
+  return ops;
+}
+
+static void
+parse_options(int ac, char* av[], int first, options* opts)
+{
+  int i;
+
+  memset(opts, 0, sizeof(*opts));
+  opts->threads = default_threads();
+  opts->memory_limit = default_memory_limit();
+  for (i = first; i < ac; i++) {
+    if (strcmp(av[i], "--mgen") == 0 && i+1 < ac) {
+      opts->mgen_chunks = atoi(av[++i]);
+      if (opts->mgen_chunks <= 0) usage();
+    } else if (strcmp(av[i], "--threads") == 0 && i+1 < ac) {
+      opts->threads = atoi(av[++i]);
+      if (opts->threads <= 0) usage();
+    } else if (strcmp(av[i], "--mem-limit") == 0 && i+1 < ac) {
+      opts->memory_limit = (off_t)atol(av[++i]) * 1024 * 1024;
+      if (opts->memory_limit < 0) usage();
+    } else if (strcmp(av[i], "--window") == 0 && i+1 < ac) {
+      opts->window = (off_t)atol(av[++i]) * 1024;
+      if (opts->window <= 0) usage();
+    } else if (strcmp(av[i], "--budget") == 0 && i+1 < ac) {
+      long long c, e, d;
+      if (sscanf(av[++i], "%lld,%lld,%lld", &c, &e, &d) != 3 ||
+          c < 0 || e < 0 || d < 0) usage();
+      opts->use_budget = 1;
+      opts->budget.ctrl_size = (off_t)c;
+      opts->budget.extra_size = (off_t)e;
+      opts->budget.diff_size = (off_t)d;
+    } else if (strcmp(av[i], "--cache") == 0 && i+1 < ac) {
+      opts->cache_dir = av[++i];
+    } else if (strcmp(av[i], "--index-dir") == 0 && i+1 < ac) {
+      opts->index_dir = av[++i];
+    } else if (strcmp(av[i], "--filter") == 0 && i+1 < ac) {
+      if (strcmp(av[++i], "thumb2") != 0) usage();
+      opts->filter = BSDIFF_FILTER_THUMB2;
+    } else if (strcmp(av[i], "--diff-mode") == 0 && i+1 < ac) {
+      i++;
+      if (strcmp(av[i], "bytes") == 0) opts->diff_mode = BSDIFF_DIFF_BYTES;
+      else if (strcmp(av[i], "words") == 0) opts->diff_mode = BSDIFF_DIFF_WORDS;
+      else if (strcmp(av[i], "auto") == 0) opts->diff_mode = BSDIFF_DIFF_AUTO;
+      else usage();
+    } else if (strcmp(av[i], "--ops") == 0 && i+1 < ac) {
+      opts->ops = parse_ops(av[++i]);
+    } else if (strcmp(av[i], "--extra-dict") == 0) {
+      opts->extra_dict = 1;
+    } else if (strcmp(av[i], "--sparse-diff") == 0) {
+      opts->sparse_diff = 1;
+    } else if (strcmp(av[i], "--max-compression") == 0) {
+      opts->max_compression = 1;
+    } else if (strcmp(av[i], "--engine") == 0 && i+1 < ac) {
+      i++;
+      if (strcmp(av[i], "suffix") == 0) opts->engine = BSDIFF_ENGINE_SUFFIX;
+      else if (strcmp(av[i], "hash") == 0) opts->engine = BSDIFF_ENGINE_HASH;
+      else usage();
+    } else if (strcmp(av[i], "--index-stride") == 0 && i+1 < ac) {
+      opts->stride = atoi(av[++i]);
+      if (opts->stride < 1 || opts->stride > BSDIFF_STRIDE_MAX) usage();
+    } else if (strcmp(av[i], "--global") == 0) {
+      opts->global = 1;
+    } else if (strcmp(av[i], "--stats") == 0 && i+1 < ac) {
+      opts->stats_file = av[++i];
+    } else {
+      usage();
+    }
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Statistics output ---------------------------------------------------- */
+
+static FILE*
+open_stats(const char* f)
 {
   FILE* fp;
 
-  if ( ((fp = fopen(f, "w+b")) == NULL)       ||
-       (fwrite(buf, 1, sz, fp) != (size_t)sz) ||
-       (fclose(fp)             != 0)
-     ) barf("Couldn't open file for writing!\n");
+  if (strcmp(f, "-") == 0) fp = fileio_open_stdout();
+  else fp = fopen(f, "w");
+  if (fp == NULL)
+    barf("Couldn't open statistics file for writing!\n");
+  return fp;
+}
 
-  return;
+static void
+close_stats(FILE* fp)
+{
+  if (fp != stdout) fclose(fp);
+  else fflush(fp);
+}
+
+/* Statistics on stdout take it over, so they aren't mixed with messages;
+   the output can't be stdout too */
+static void
+claim_stats_stdout(const options* opts, const char* outf)
+{
+  if (opts->stats_file == NULL || strcmp(opts->stats_file, "-") != 0) return;
+  if (strcmp(outf, "-") == 0) usage();
+  fileio_claim_stdout();
+}
+
+static void
+write_diff_stats(const char* f, const bsdiff_stats* st)
+{
+  FILE* fp = open_stats(f);
+  int i;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"ctrllen\": %lld,\n", (long long)st->ctrllen);
+  fprintf(fp, "  \"dblen\": %lld,\n", (long long)st->dblen);
+  fprintf(fp, "  \"eblen\": %lld,\n", (long long)st->eblen);
+  fprintf(fp, "  \"patchsize\": %lld,\n", (long long)st->patchsize);
+  fprintf(fp, "  \"sort_time\": %.6f,\n", st->sort_time);
+  fprintf(fp, "  \"scan_time\": %.6f,\n", st->scan_time);
+  fprintf(fp, "  \"ctrl_compress_time\": %.6f,\n", st->ctrl_compress_time);
+  fprintf(fp, "  \"diff_compress_time\": %.6f,\n", st->diff_compress_time);
+  fprintf(fp, "  \"extra_compress_time\": %.6f,\n", st->extra_compress_time);
+  fprintf(fp, "  \"search_calls\": %lld,\n", (long long)st->search_calls);
+  fprintf(fp, "  \"search_probes\": %lld,\n", (long long)st->search_probes);
+  fprintf(fp, "  \"bytes_compared\": %lld,\n", (long long)st->bytes_compared);
+  fprintf(fp, "  \"triples\": %lld,\n", (long long)st->triples);
+  fprintf(fp, "  \"add_bytes\": %lld,\n", (long long)st->add_bytes);
+  fprintf(fp, "  \"extra_bytes\": %lld,\n", (long long)st->extra_bytes);
+  fprintf(fp, "  \"seek_bytes\": %lld,\n", (long long)st->seek_bytes);
+  fprintf(fp, "  \"fill_bytes\": %lld,\n", (long long)st->fill_bytes);
+  fprintf(fp, "  \"copy_bytes\": %lld,\n", (long long)st->copy_bytes);
+  fprintf(fp, "  \"matchlen_hist\": [");
+  for (i = 0; i < BSDIFF_STATS_HISTOGRAM; i++)
+    fprintf(fp, "%s%lld", i ? ", " : "", (long long)st->matchlen_hist[i]);
+  fprintf(fp, "]\n}\n");
+
+  close_stats(fp);
+}
+
+static void
+write_patch_stats(const char* f, const bspatch_stats* st)
+{
+  FILE* fp = open_stats(f);
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"decompress_time\": %.6f,\n", st->decompress_time);
+  fprintf(fp, "  \"apply_time\": %.6f,\n", st->apply_time);
+  fprintf(fp, "  \"triples\": %lld,\n", (long long)st->triples);
+  fprintf(fp, "  \"add_bytes\": %lld,\n", (long long)st->add_bytes);
+  fprintf(fp, "  \"extra_bytes\": %lld,\n", (long long)st->extra_bytes);
+  fprintf(fp, "  \"seek_bytes\": %lld,\n", (long long)st->seek_bytes);
+  fprintf(fp, "  \"fill_bytes\": %lld,\n", (long long)st->fill_bytes);
+  fprintf(fp, "  \"copy_bytes\": %lld\n", (long long)st->copy_bytes);
+  fprintf(fp, "}\n");
+
+  close_stats(fp);
 }
 
 /* ------------------------------------------------------------------------- */
 /* -- Main routines -------------------------------------------------------- */
 
 static void
-diff(const char* oldf, const char* newf, const char* patchf)
+diff(const char* oldf, const char* newf, const char* patchf,
+     const options* opts)
 {
+  fileio_buf oldb, newb;
   u_char* old;
   u_char* new;
   u_char* patch;
   long oldsz, newsz;
   off_t patchsz;
+  bsdiff_options bopts;
+  bsdiff_stats st;
   int res;
 
 #ifndef NDEBUG
@@ -133,8 +393,10 @@ diff(const char* oldf, const char* newf, const char* patchf)
 #endif /* NDEBUG */
 
   /* Read old and new files */
-  oldsz = read_file(oldf, &old);
-  newsz = read_file(newf, &new);
+  oldsz = read_file(oldf, FILEIO_RANDOM, &oldb);
+  newsz = read_file(newf, FILEIO_SEQUENTIAL, &newb);
+  old = oldb.data;
+  new = newb.data;
 
 #ifndef NDEBUG
   printf("Old file = %lu bytes\nNew file = %lu bytes\n", oldsz, newsz);
@@ -147,35 +409,30 @@ diff(const char* oldf, const char* newf, const char* patchf)
 
   patchsz = bsdiff_patchsize_max(oldsz, newsz);
   patch = malloc(patchsz+1); /* Never malloc(0) */
-  res = bsdiff(old, oldsz, new, newsz, patch, patchsz, false);
+  memset(&bopts, 0, sizeof(bopts));
+  bopts.filter = opts->filter;
+  bopts.diff_mode = opts->diff_mode;
+  bopts.ops = opts->ops;
+  bopts.extra_dict = opts->extra_dict;
+  bopts.sparse_diff = opts->sparse_diff;
+  bopts.max_compression = opts->max_compression;
+  bopts.engine = opts->engine;
+  bopts.stride = opts->stride;
+  res = bsdiff_with_options(old, oldsz, new, newsz, patch, patchsz, &bopts, &st);
   if (res <= 0) barf("bsdiff() failed!");
   patchsz = res;
 
+  if (opts->stats_file != NULL) write_diff_stats(opts->stats_file, &st);
+
 #ifndef NDEBUG
   printf("sizeof(delta('%s', '%s')) = %lld bytes\n", oldf, newf, patchsz);
 #endif /* NDEBUG */
 
   /* Write patch */
-  FILE *f = fopen(patchf, "wb");  // Make sure it's opened in binary mode
-  if (f == NULL) {
-    fprintf(stderr, "ERROR: Couldn't create patch file %s\n", patchf);
-    free(patch);
-    return;
-  }
+  write_file(patchf, patch, patchsz);
 
-  // Write patch file
-  size_t bytes_written = fwrite(patch, 1, patchsz, f);
-  if ((size_t)bytes_written != (size_t)patchsz) {
-    printf("ERROR: Could not write patch file (wrote %zu of %lld bytes)\n", 
-           bytes_written, (long long)patchsz);
-    fclose(f);
-    free(patch);
-    return;
-  }
-  fclose(f);
-
-  free(old);
-  free(new);
+  fileio_release(&oldb);
+  fileio_release(&newb);
   free(patch);
 
 #ifndef NDEBUG
@@ -185,13 +442,19 @@ diff(const char* oldf, const char* newf, const char* patchf)
 }
 
 static void
-patch(const char* inf, const char* patchf, const char* outf)
+patch(const char* inf, const char* patchf, const char* outf,
+      const options* opts)
 {
+  fileio_buf inb, patchb, outb;
   u_char* inp;
   u_char* patchp;
   u_char* newp;
+  u_char* wsp;
   long insz, patchsz;
   ssize_t newsz;
+  off_t wssz;
+  bspatch_workspace ws;
+  bspatch_stats st;
   int res;
 
 #ifndef NDEBUG
@@ -199,58 +462,42 @@ patch(const char* inf, const char* patchf, const char* outf)
 #endif /* NDEBUG */
 
   /* Read old file and patch file */
-  insz    = read_file(inf, &inp);
-  FILE *f = fopen(patchf, "rb");  // Make sure it's opened in binary mode
-  if (f == NULL) {
-    fprintf(stderr, "ERROR: Couldn't open patch file %s\n", patchf);
-    return;
-  }
-
-  // Check file size
-  fseek(f, 0, SEEK_END);
-  patchsz = ftell(f);
-  fseek(f, 0, SEEK_SET);
-
-  // Allocate memory for patch
-  patchp = malloc(patchsz);
-  if (patchp == NULL) {
-    fprintf(stderr, "ERROR: Couldn't allocate memory for patch\n");
-    fclose(f);
-    return;
-  }
-
-  // Read patch file
-  size_t bytes_read = fread(patchp, 1, patchsz, f);
-  if ((size_t)bytes_read != (size_t)patchsz) {
-    printf("ERROR: Couldn't read patch file (read %zu of %lld bytes)\n", 
-           bytes_read, (long long)patchsz);
-    free(patchp);
-    fclose(f);
-    return;
-  }
-  fclose(f);
-
-  // Print first few bytes of patch file for debugging
-  printf("Debug: First 8 bytes of patch file: ");
-  for (int i = 0; i < 8; i++) {
-    printf("%02x ", patchp[i]);
-  }
-  printf("\n");
+  insz    = read_file(inf, FILEIO_WILLNEED, &inb);
+  patchsz = read_file(patchf, FILEIO_SEQUENTIAL, &patchb);
+  inp     = inb.data;
+  patchp  = patchb.data;
 
   /* Apply delta */
   newsz = bspatch_newsize(patchp, patchsz);
   if (newsz <= 0) barf("Couldn't determine new file size; patch corrupt!");
 
-  newp = malloc(newsz+1); /* Never malloc(0) */
-  res = bspatch(inp, insz, newp, newsz, patchp, patchsz);
-  if (res != 0) barf("bspatch() failed!");
+  wssz = bspatch_workspace_size(patchp, patchsz, &ws);
+  if (wssz < 0) barf("Couldn't determine workspace size; patch corrupt!");
+
+  /* The new file is patched in place in its output */
+  if (fileio_create(outf, newsz, &outb) != 0)
+    barf("Couldn't open file for writing!\n");
+  newp = outb.data;
+  wsp = malloc(wssz+1); /* Never malloc(0) */
+  if (wsp == NULL) barf("Couldn't allocate memory!\n");
+  bspatch_workspace_attach(&ws, wsp);
+
+  res = bspatch_with_workspace(inp, insz, newp, newsz, patchp, patchsz,
+                               &ws, &st);
+  if (res != 0) {
+    fileio_release(&outb); /* leaves no partial output */
+    barf("bspatch() failed!");
+  }
+  free(wsp);
+
+  if (opts->stats_file != NULL) write_patch_stats(opts->stats_file, &st);
 
   /* Write new file */
-  write_file(outf, newp, newsz);
+  if (fileio_commit(&outb, newsz) != 0)
+    barf("Couldn't open file for writing!\n");
 
-  free(inp);
-  free(patchp);
-  free(newp);
+  fileio_release(&inb);
+  fileio_release(&patchb);
 
 #ifndef NDEBUG
   printf("Successfully applied patch; new file is %s\n", outf);
@@ -258,9 +505,141 @@ patch(const char* inf, const char* patchf, const char* outf)
   exit(EXIT_SUCCESS);
 }
 
+/* Write a finished multi-patch; `info` reports its buffer sizes */
 static void
-split_and_diff(const char* oldf, const char* newf, const char* patchf, int num_chunks)
+write_multipatch(const char* patchf, u_char* patch, off_t patchsz)
 {
+  int num_chunks = (int)multipatch_num_patches(patch, patchsz);
+
+  /* Write patch to file */
+  if (fileio_write(patchf, patch, patchsz) != 0) {
+    printf("ERROR: Could not write patch file %s\n", patchf);
+    free(patch);
+    exit(EXIT_FAILURE);
+  }
+  free(patch);
+
+  printf("Created multi-patch file %s with %d chunks (%lld bytes)\n", 
+         patchf, num_chunks, (long long)patchsz);
+
+  exit(EXIT_SUCCESS);
+}
+
+/* Point the chunk diffs at the --cache directory, creating it if needed */
+static void
+open_cache(const options* opts, multipatch_params* params,
+           multipatch_cache_stats* st)
+{
+  memset(st, 0, sizeof(*st));
+  if (opts->cache_dir == NULL) return;
+#ifndef _MSC_VER
+  mkdir(opts->cache_dir, 0777);
+#else
+  _mkdir(opts->cache_dir);
+#endif
+  params->cache_dir = opts->cache_dir;
+  params->cache_stats = st;
+}
+
+/* Sort the shared old index in the --index-dir directory, creating it if
+   needed */
+static void
+open_index_dir(const options* opts, multipatch_params* params)
+{
+  if (opts->index_dir == NULL) return;
+#ifndef _MSC_VER
+  mkdir(opts->index_dir, 0777);
+#else
+  _mkdir(opts->index_dir);
+#endif
+  params->index_dir = opts->index_dir;
+}
+
+static void
+report_cache(const options* opts, const multipatch_cache_stats* st)
+{
+  if (opts->cache_dir == NULL) return;
+  printf("Chunk cache: %d hits, %d misses\n", st->hits, st->misses);
+  if (st->store_errors > 0)
+    printf("WARNING: Could not store %d chunk patches in %s\n",
+           st->store_errors, opts->cache_dir);
+}
+
+static void
+budget_diff(const char* oldf, const char* newf, const char* patchf,
+            const options* opts)
+{
+  multipatch_params params;
+  multipatch_cache_stats cache;
+  multipatch_budget_stats search;
+  multipatch_budget budget = opts->budget;
+  fileio_buf old_file, new_file;
+  u_char *old_data, *new_data;
+  long old_size, new_size;
+  off_t patchsz, res;
+  u_char* patch;
+  
+  old_size = read_file(oldf, FILEIO_WILLNEED, &old_file);
+  new_size = read_file(newf, FILEIO_SEQUENTIAL, &new_file);
+  old_data = old_file.data;
+  new_data = new_file.data;
+  
+  printf("Searching chunk layouts for ctrl <= %lld, extra <= %lld, diff <= %lld bytes\n",
+         (long long)budget.ctrl_size, (long long)budget.extra_size,
+         (long long)budget.diff_size);
+  
+  /* Chunk patches rarely exceed their new data; allow the worst case of
+     each of the most chunks the search may pick */
+  budget.window = opts->window;
+  budget.max_chunks = 4096;
+  budget.stats = &search;
+  memset(&search, 0, sizeof(search));
+  patchsz = sizeof(multipatch_header) + 2 * (off_t)new_size +
+            (off_t)budget.max_chunks * (sizeof(chunk_entry) + 1024);
+  patch = malloc(patchsz);
+  if (!patch) {
+    printf("ERROR: Could not allocate memory for patch\n");
+    exit(EXIT_FAILURE);
+  }
+  
+  memset(&params, 0, sizeof(params));
+  params.threads = opts->threads;
+  params.memory_limit = opts->memory_limit;
+  params.filter = opts->filter;
+  params.diff_mode = opts->diff_mode;
+  params.ops = opts->ops;
+  params.extra_dict = opts->extra_dict;
+  params.sparse_diff = opts->sparse_diff;
+  params.max_compression = opts->max_compression;
+  params.engine = opts->engine;
+  params.stride = opts->stride;
+  open_index_dir(opts, &params);
+  open_cache(opts, &params, &cache);
+  res = create_multipatch_budget(old_data, old_size, new_data, new_size,
+                                 &budget, patch, patchsz, &params);
+  printf("Budget search: %d trials, %d chunk diffs, %d reused\n",
+         search.trials, search.diffs, search.reused);
+  report_cache(opts, &cache);
+  fileio_release(&old_file);
+  fileio_release(&new_file);
+  
+  if (res <= 0) {
+    printf("ERROR: Failed to create multi-patch\n");
+    free(patch);
+    exit(EXIT_FAILURE);
+  }
+  
+  write_multipatch(patchf, patch, res);
+}
+
+static void
+split_and_diff(const char* oldf, const char* newf, const char* patchf,
+               const options* opts)
+{
+  int num_chunks = opts->mgen_chunks;
+  multipatch_params params;
+  multipatch_cache_stats cache;
+  fileio_buf old_file, new_file;
   u_char *old_data, *new_data;
   long old_size, new_size;
   off_t patchsz, res;
@@ -269,8 +648,10 @@ split_and_diff(const char* oldf, const char* newf, const char* patchf, int num_c
   printf("Splitting files into %d chunks and creating multi-patch\n", num_chunks);
   
   /* Read input files */
-  old_size = read_file(oldf, &old_data);
-  new_size = read_file(newf, &new_data);
+  old_size = read_file(oldf, FILEIO_WILLNEED, &old_file);
+  new_size = read_file(newf, FILEIO_SEQUENTIAL, &new_file);
+  old_data = old_file.data;
+  new_data = new_file.data;
   
   printf("Old file = %ld bytes\nNew file = %ld bytes\n", old_size, new_size);
   
@@ -280,29 +661,32 @@ split_and_diff(const char* oldf, const char* newf, const char* patchf, int num_c
   /* Ensure chunk sizes are at least 1 byte */
   if (new_chunk_size < 1) {
     printf("ERROR: New file too small to split into %d chunks\n", num_chunks);
-    free(old_data);
-    free(new_data);
+    fileio_release(&old_file);
+    fileio_release(&new_file);
     exit(EXIT_FAILURE);
   }
   
-  /* Create temporary files for chunks */
-  char **old_chunk_files = malloc(num_chunks * sizeof(char*));
-  char **new_chunk_files = malloc(num_chunks * sizeof(char*));
-  
-  if (!old_chunk_files || !new_chunk_files) {
+  /* Slice both images into chunks; the chunks are ranges of the loaded
+     files, nothing is copied or written out */
+  multipatch_chunk* chunks = malloc(num_chunks * sizeof(multipatch_chunk));
+  if (!chunks) {
     printf("ERROR: Memory allocation failed\n");
-    free(old_data);
-    free(new_data);
+    fileio_release(&old_file);
+    fileio_release(&new_file);
     exit(EXIT_FAILURE);
   }
   
-  /* Initialize pointers to NULL */
-  for (int i = 0; i < num_chunks; i++) {
-    old_chunk_files[i] = NULL;
-    new_chunk_files[i] = NULL;
+  /* Old windows follow content anchors when a window limit is given */
+  multipatch_anchors* anchors = NULL;
+  if (opts->window > 0) {
+    anchors = multipatch_anchors_build(old_data, old_size);
+    if (!anchors) {
+      printf("ERROR: Could not index old file\n");
+      exit(EXIT_FAILURE);
+    }
   }
   
-  /* Split files into chunks and save to temporary files */
+  patchsz = sizeof(multipatch_header) + (off_t)num_chunks * sizeof(chunk_entry);
   for (int i = 0; i < num_chunks; i++) {
     /* Calculate chunk boundaries for NEW file */
     off_t new_start = i * new_chunk_size;
@@ -319,76 +703,38 @@ split_and_diff(const char* oldf, const char* newf, const char* patchf, int num_c
       old_end = (off_t)(((double)(i + 1) * new_chunk_size / new_size) * old_size);
     }
     
-    /* Ensure we don't exceed file boundaries */
-    if (new_start >= new_size) {
-      printf("WARNING: Chunk %d exceeds new file size, skipping\n", i);
-      continue;
+    if (anchors) {
+      off_t old_len = old_end - old_start;
+      if (multipatch_select_window(anchors, new_data + new_start,
+                                   new_end - new_start, opts->window,
+                                   &old_start, &old_len) > 0) {
+        old_end = old_start + old_len;
+      } else if (old_len > opts->window) {
+        old_end = old_start + opts->window;
+      }
     }
     
-    /* Create temporary filenames */
-    char old_temp[256], new_temp[256];
-    sprintf(old_temp, "old_chunk_%d.tmp", i);
-    sprintf(new_temp, "new_chunk_%d.tmp", i);
-    
-    /* Allocate memory for filenames */
-    old_chunk_files[i] = malloc(strlen(old_temp) + 1);
-    new_chunk_files[i] = malloc(strlen(new_temp) + 1);
-    
-    if (!old_chunk_files[i] || !new_chunk_files[i]) {
-      printf("ERROR: Memory allocation failed for chunk filenames\n");
-      exit(EXIT_FAILURE);
+    /* With --global every chunk is diffed against the whole old file
+       through one shared index; its patch is bounded by the chunk */
+    if (opts->global) {
+      old_start = 0;
+      old_end = old_size;
     }
     
-    /* Copy filenames */
-    strcpy(old_chunk_files[i], old_temp);
-    strcpy(new_chunk_files[i], new_temp);
-    
-    /* Write chunks to temporary files */
-    FILE *f = fopen(old_temp, "wb");
-    if (!f) {
-      printf("ERROR: Could not create temporary file %s\n", old_temp);
-      exit(EXIT_FAILURE);
-    }
-    fwrite(old_data + old_start, 1, old_end - old_start, f);
-    fclose(f);
+    chunks[i].old_offset = old_start;
+    chunks[i].old_size = old_end - old_start;
+    chunks[i].new_offset = new_start;
+    chunks[i].new_size = new_end - new_start;
+    patchsz += bsdiff_patchsize_max(opts->global ? chunks[i].new_size : chunks[i].old_size,
+                                    chunks[i].new_size);
     
-    f = fopen(new_temp, "wb");
-    if (!f) {
-      printf("ERROR: Could not create temporary file %s\n", new_temp);
-      exit(EXIT_FAILURE);
-    }
-    fwrite(new_data + new_start, 1, new_end - new_start, f);
-    fclose(f);
-    
-    printf("Created chunk %d: old=%ld bytes, new=%ld bytes\n", 
-           i, (long)(old_end - old_start), (long)(new_end - new_start));
-  }
-  
-  /* Free original file data */
-  free(old_data);
-  free(new_data);
-  
-  /* Calculate a more generous patch size estimate */
-  size_t estimated_patch_size = sizeof(multipatch_header) + 
-                              (size_t)num_chunks * sizeof(patch_entry);
-  
-  /* Add estimated patch sizes */
-  size_t chunk_size = (size_t)((new_size + num_chunks - 1) / num_chunks);
-  estimated_patch_size += (size_t)num_chunks * bsdiff_patchsize_max(chunk_size, chunk_size);
-  
-  /* Add safety margin */
-  estimated_patch_size += 1024 * num_chunks;
-  
-  /* Check for reasonable size limits */
-  if (estimated_patch_size < sizeof(multipatch_header) || 
-      estimated_patch_size > (size_t)(1024 * 1024 * 1024)) { /* 1GB limit */
-    printf("ERROR: Patch size estimation overflow or too large (%zu bytes)\n", estimated_patch_size);
-    exit(EXIT_FAILURE);
+    printf("Created chunk %d: old=%ld bytes at %ld, new=%ld bytes\n", 
+           i, (long)chunks[i].old_size, (long)old_start,
+           (long)chunks[i].new_size);
   }
+  multipatch_anchors_free(anchors);
   
-  printf("Allocating %zu bytes for patch container\n", estimated_patch_size);
-  
-  patchsz = estimated_patch_size * 1.05;
+  printf("Allocating %lld bytes for patch container\n", (long long)patchsz);
   
   patch = malloc(patchsz);
   if (!patch) {
@@ -397,166 +743,183 @@ split_and_diff(const char* oldf, const char* newf, const char* patchf, int num_c
   }
   
   /* Create multi-patch from chunks */
-  res = create_multipatch((const char**)old_chunk_files, (const char**)new_chunk_files, 
-                         num_chunks, patch, patchsz);
+  memset(&params, 0, sizeof(params));
+  params.threads = opts->threads;
+  params.memory_limit = opts->memory_limit;
+  params.filter = opts->filter;
+  params.diff_mode = opts->diff_mode;
+  params.ops = opts->ops;
+  params.extra_dict = opts->extra_dict;
+  params.sparse_diff = opts->sparse_diff;
+  params.max_compression = opts->max_compression;
+  params.engine = opts->engine;
+  params.stride = opts->stride;
+  open_index_dir(opts, &params);
+  open_cache(opts, &params, &cache);
+  res = create_multipatch_chunks(old_data, old_size, new_data, new_size,
+                                 chunks, num_chunks, patch, patchsz, &params);
+  report_cache(opts, &cache);
+  
+  free(chunks);
+  fileio_release(&old_file);
+  fileio_release(&new_file);
+  
   if (res <= 0) {
     printf("ERROR: Failed to create multi-patch\n");
     free(patch);
-    
-    /* Clean up temporary files */
-    for (int i = 0; i < num_chunks; i++) {
-      if (old_chunk_files[i]) {
-        remove(old_chunk_files[i]);
-        free(old_chunk_files[i]);
-      }
-      if (new_chunk_files[i]) {
-        remove(new_chunk_files[i]);
-        free(new_chunk_files[i]);
-      }
-    }
-    
-    free(old_chunk_files);
-    free(new_chunk_files);
-    
-    exit(EXIT_FAILURE);
-  }
-  
-  patchsz = res;
-  
-  /* Write patch to file */
-  FILE* f = fopen(patchf, "wb");
-  if (!f) {
-    printf("ERROR: Could not create patch file %s\n", patchf);
-    free(patch);
     exit(EXIT_FAILURE);
   }
   
-  size_t bytes_written = fwrite(patch, 1, patchsz, f);
-  if ((size_t)bytes_written != (size_t)patchsz) {
-    printf("ERROR: Could not write patch file (wrote %zu of %lld bytes)\n", 
-           bytes_written, (long long)patchsz);
-    fclose(f);
-    free(patch);
-    exit(EXIT_FAILURE);
-  }
-  
-  fclose(f);
-  free(patch);
-  
-  /* Clean up temporary files */
-  for (int i = 0; i < num_chunks; i++) {
-    remove(old_chunk_files[i]);
-    remove(new_chunk_files[i]);
-    free(old_chunk_files[i]);
-    free(new_chunk_files[i]);
-  }
-  
-  free(old_chunk_files);
-  free(new_chunk_files);
-  
-
-  int ctrllen_hex = (max_ctrllen + 127) / 128;
-  int eblen_hex = (max_eblen + 127) / 128;
-  
-  printf("Created multi-patch file %s with %d chunks (%lld bytes)\n", 
-         patchf, num_chunks, (long long)patchsz);
-
-  printf("4C0601740304%02X%02X\n", ctrllen_hex, eblen_hex);
-
-  exit(EXIT_SUCCESS);
+  write_multipatch(patchf, patch, res);
 }
 
 static void
-multipatch(const char* inf, const char* patchf, const char* outf)
+multipatch(const char* inf, const char* patchf, const char* outf,
+           const options* opts)
 {
+  fileio_buf patchb;
   u_char* patchp;
   off_t patchsz;
   
   printf("Applying multi-patch %s to %s\n", patchf, inf);
   
   /* Read patch file */
-  FILE* f = fopen(patchf, "rb");
-  if (f == NULL) {
-    printf("ERROR: Couldn't open patch file %s\n", patchf);
-    exit(EXIT_FAILURE);
-  }
-  
-  fseek(f, 0, SEEK_END);
-  patchsz = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  
-  patchp = malloc(patchsz);
-  if (patchp == NULL) {
-    printf("ERROR: Couldn't allocate memory for patch\n");
-    fclose(f);
-    exit(EXIT_FAILURE);
-  }
-  
-  size_t bytes_read = fread(patchp, 1, patchsz, f);
-  if ((size_t)bytes_read != (size_t)patchsz) {
-    printf("ERROR: Couldn't read patch file (read %zu of %lld bytes)\n", 
-           bytes_read, (long long)patchsz);
-    free(patchp);
-    fclose(f);
-    exit(EXIT_FAILURE);
-  }
-  
-  fclose(f);
+  patchsz = read_file(patchf, FILEIO_WILLNEED, &patchb);
+  patchp = patchb.data;
   
   /* Validate multi-patch */
   if (!multipatch_valid(patchp, patchsz)) {
     printf("ERROR: Invalid multi-patch file\n");
-    free(patchp);
+    fileio_release(&patchb);
     exit(EXIT_FAILURE);
   }
   
   /* Apply multi-patch */
-  int res = apply_multipatch(inf, outf, patchp, patchsz);
+  int res = apply_multipatch_threads(inf, outf, patchp, patchsz, opts->threads);
   if (res != 0) {
     printf("ERROR: Failed to apply multi-patch\n");
-    free(patchp);
+    fileio_release(&patchb);
     exit(EXIT_FAILURE);
   }
   
-  free(patchp);
+  fileio_release(&patchb);
   
   printf("Successfully applied multi-patch; new file is %s\n", outf);
   exit(EXIT_SUCCESS);
 }
 
+static void
+info(const char* patchf)
+{
+  fileio_buf patchb;
+  u_char* patchp;
+  long patchsz;
+  bspatch_workspace ws;
+  chunk_entry entry;
+  off_t wssz, newsz;
+  const char* prefix;
+
+  patchsz = read_file(patchf, FILEIO_SEQUENTIAL, &patchb);
+  patchp = patchb.data;
+
+  if (multipatch_valid(patchp, patchsz)) {
+    wssz = multipatch_workspace_size(patchp, patchsz, &ws);
+    newsz = multipatch_total_size(patchp, patchsz);
+    prefix = "Max";
+  } else {
+    wssz = bspatch_workspace_size(patchp, patchsz, &ws);
+    newsz = bspatch_newsize(patchp, patchsz);
+    prefix = "";
+  }
+  if (wssz < 0 || newsz < 0) barf("Invalid patch file!\n");
+
+  printf("NewFileSize: %lld\n", (long long)newsz);
+  printf("%sControlDataSize: %lld\n", prefix, (long long)ws.ctrlsz);
+  printf("%sDiffDataSize: %lld\n", prefix, (long long)ws.diffsz);
+  printf("%sExtraDataSize: %lld\n", prefix, (long long)ws.extrasz);
+  printf("WorkspaceSize: %lld\n", (long long)wssz);
+
+  /* Chunk buffers of an MPATCH02 container */
+  if (multipatch_chunk_info(patchp, patchsz, 0, &entry) == 0) {
+    off_t maxin = 0, maxout = 0, i, n = multipatch_num_patches(patchp, patchsz);
+    for (i = 0; i < n; i++) {
+      if (multipatch_chunk_info(patchp, patchsz, (int)i, &entry) != 0)
+        barf("Invalid patch file!\n");
+      if (entry.old_size > maxin) maxin = entry.old_size;
+      if (entry.new_size > maxout) maxout = entry.new_size;
+    }
+    printf("MaxInputSize: %lld\n", (long long)maxin);
+    printf("MaxOutputSize: %lld\n", (long long)maxout);
+  }
+
+  fileio_release(&patchb);
+  exit(EXIT_SUCCESS);
+}
+
 /* ------------------------------------------------------------------------- */
 /* -- Driver --------------------------------------------------------------- */
 
 int
 main(int ac, char* av[])
 {
+  options opts;
+
   /* WIN32 FIXME: av[0] becomes the full path to minibsdiff */
   progname = av[0];
   
   if (ac < 3) usage();
 
+  /* Keep messages out of a patch or new file written to stdout */
+  if (ac >= 5 && strcmp(av[4], "-") == 0) fileio_claim_stdout();
+
   if (memcmp(av[1], "gen", 3) == 0) {
-    if (ac == 5) {
-      // Standard patch generation
-      diff(av[2], av[3], av[4]);
-    } else if (ac == 7 && strcmp(av[5], "--mgen") == 0) {
+    if (ac < 5) usage();
+    parse_options(ac, av, 5, &opts);
+    if (opts.global && (opts.mgen_chunks <= 0 || opts.window > 0)) usage();
+    if (opts.stats_file && (opts.mgen_chunks > 0 || opts.use_budget)) usage();
+    if (opts.cache_dir && opts.mgen_chunks <= 0 && !opts.use_budget) usage();
+    if (opts.index_dir && ((!opts.global && !opts.use_budget) || opts.window > 0 ||
+                           opts.filter || opts.engine != BSDIFF_ENGINE_SUFFIX))
+      usage();
+    claim_stats_stdout(&opts, av[4]);
+    if (opts.use_budget) {
+      if (opts.mgen_chunks > 0 || opts.global) usage();
+      budget_diff(av[2], av[3], av[4], &opts);
+    }
+    if (opts.mgen_chunks > 0) {
       // Split files into chunks and create multi-patch
-      int num_chunks = atoi(av[6]);
-      if (num_chunks <= 0) usage();
-      split_and_diff(av[2], av[3], av[4], num_chunks);
+      split_and_diff(av[2], av[3], av[4], &opts);
     } else {
-      usage();
+      // Standard patch generation
+      diff(av[2], av[3], av[4], &opts);
     }
   }
   
   if (memcmp(av[1], "app", 3) == 0) {
-    if (ac != 5) usage();
-    patch(av[2], av[3], av[4]);
+    if (ac < 5) usage();
+    parse_options(ac, av, 5, &opts);
+    if (opts.mgen_chunks > 0 || opts.filter || opts.diff_mode || opts.ops ||
+        opts.extra_dict || opts.sparse_diff || opts.max_compression ||
+        opts.engine || opts.stride || opts.index_dir)
+      usage();
+    claim_stats_stdout(&opts, av[4]);
+    patch(av[2], av[3], av[4], &opts);
   }
   
   if (memcmp(av[1], "mapp", 4) == 0) {
-    if (ac != 5) usage();
-    multipatch(av[2], av[3], av[4]);
+    if (ac < 5) usage();
+    parse_options(ac, av, 5, &opts);
+    if (opts.mgen_chunks > 0 || opts.stats_file || opts.window > 0 || opts.global ||
+        opts.use_budget || opts.cache_dir || opts.filter || opts.diff_mode ||
+        opts.ops || opts.extra_dict || opts.sparse_diff ||
+        opts.max_compression || opts.engine || opts.stride || opts.index_dir)
+      usage();
+    multipatch(av[2], av[3], av[4], &opts);
+  }
+
+  if (memcmp(av[1], "info", 4) == 0) {
+    if (ac != 3) usage();
+    info(av[2]);
   }
 
   usage(); /* patch()/diff() don't return */
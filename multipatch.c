@@ -1,14 +1,29 @@
 /*
  * Implementation of multi-patch container format
  */
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* pthreads */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "multipatch.h"
 #include "bsdiff.h"
 #include "bspatch.h"
+#include "fileio.h"
+#include "extindex.h"
+
+#if !defined(MINIBSDIFF_NO_THREADS) && !defined(_MSC_VER)
+#define MULTIPATCH_THREADS 1
+#include <pthread.h>
+#endif
+
 
 /* Write an off_t value to a byte buffer */
 static void
@@ -41,311 +56,1834 @@ read_off_t(u_char* buf)
     y = y * 256 + buf[1];
     y = y * 256 + buf[0];
 
-    if (buf[7] & 0x80) y = -y;
+    if (buf[7] & 0x80) y = -y;
+
+    return y;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Chunk patch cache ---------------------------------------------------- */
+
+/* Bump when the patches made for the same inputs change */
+#define CACHE_FORMAT 2
+
+/* 128-bit content digest (MurmurHash3 x64_128). It is not cryptographic:
+   a cached patch is only used once it has reproduced its new data. */
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+} cache_digest;
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static uint64_t
+load64(const u_char* p, int n)
+{
+    uint64_t v = 0;
+    
+    while (n-- > 0) v = (v << 8) | p[n];
+    return v;
+}
+
+static void
+cache_hash(const u_char* data, off_t size, uint64_t seed, cache_digest* d)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
+    off_t i, tail;
+    
+    for (i = 0; i + 16 <= size; i += 16) {
+        k1 = load64(data + i, 8) * c1;
+        k2 = load64(data + i + 8, 8) * c2;
+        h1 ^= rotl64(k1, 31) * c2;
+        h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= rotl64(k2, 33) * c1;
+        h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    
+    tail = size - i;
+    if (tail > 8) h2 ^= rotl64(load64(data + i + 8, (int)tail - 8) * c2, 33) * c1;
+    if (tail > 0) h1 ^= rotl64(load64(data + i, tail > 8 ? 8 : (int)tail) * c1, 31) * c2;
+    
+    h1 ^= (uint64_t)size;
+    h2 ^= (uint64_t)size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    d->h1 = h1;
+    d->h2 = h2;
+}
+
+/* Name of the cache entry for a pair of inputs. Diffing against a shared
+   index or a private one gives the same patch, so the inputs, the bsdiff
+   options and the format are all that matter. */
+static void
+cache_name(const cache_digest* old_digest,
+           const u_char* old_data, off_t old_size,
+           const u_char* new_data, off_t new_size,
+           const bsdiff_options* opts, char* name)
+{
+    cache_digest old_d, new_d, key;
+    bool based = (opts->filter != 0 || opts->diff_mode != BSDIFF_DIFF_BYTES);
+    u_char buf[136];
+    
+    if (old_digest != NULL) {
+        old_d = *old_digest;
+    } else {
+        cache_hash(old_data, old_size, 0, &old_d);
+    }
+    cache_hash(new_data, new_size, 0, &new_d);
+    
+    write_off_t(old_size, buf);
+    write_off_t(new_size, buf + 8);
+    write_off_t((off_t)(old_d.h1 >> 1), buf + 16);
+    write_off_t((off_t)(old_d.h2 >> 1), buf + 24);
+    write_off_t((off_t)(new_d.h1 >> 1), buf + 32);
+    write_off_t((off_t)(new_d.h2 >> 1), buf + 40);
+    write_off_t(CACHE_FORMAT, buf + 48);
+    write_off_t(opts->filter, buf + 56);
+    write_off_t(opts->diff_mode, buf + 64);
+    write_off_t(opts->ops, buf + 72);
+    write_off_t(based ? opts->old_base : 0, buf + 80);
+    write_off_t(based ? opts->new_base : 0, buf + 88);
+    write_off_t(opts->extra_dict, buf + 96);
+    write_off_t(opts->sparse_diff, buf + 104);
+    write_off_t(opts->max_compression, buf + 112);
+    write_off_t(opts->engine, buf + 120);
+    write_off_t(opts->stride, buf + 128);
+    cache_hash(buf, sizeof(buf), 0, &key);
+    
+    sprintf(name, "%016llx%016llx", (unsigned long long)key.h1,
+            (unsigned long long)key.h2);
+}
+
+static char*
+cache_path(const char* dir, const char* name, const char* suffix)
+{
+    size_t len = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+    char* path = malloc(len);
+    
+    if (path != NULL) sprintf(path, "%s/%s%s", dir, name, suffix);
+    return path;
+}
+
+/* Load the cached patch of a job if there is one and it still turns the
+   old data into the new data. Returns the patch size, or 0 on a miss. */
+static off_t
+cache_load(const char* path, u_char* old_data, off_t old_size,
+           const u_char* new_data, off_t new_size, u_char** patch)
+{
+    fileio_buf in;
+    u_char* check;
+    off_t size = 0;
+    
+    if (fileio_read(path, FILEIO_SEQUENTIAL, &in) != 0) return 0;
+    
+    if (bspatch_newsize(in.data, in.size) == new_size &&
+        (check = malloc((size_t)new_size + 1)) != NULL) {
+        if (bspatch(old_data, old_size, check, new_size, in.data, in.size) == 0 &&
+            memcmp(check, new_data, (size_t)new_size) == 0 &&
+            (*patch = malloc((size_t)in.size)) != NULL) {
+            memcpy(*patch, in.data, (size_t)in.size);
+            size = in.size;
+        }
+        free(check);
+    }
+    
+    fileio_release(&in);
+    return size;
+}
+
+/* Store a finished patch, through a temporary file so that a concurrent
+   or interrupted build never sees half an entry */
+static bool
+cache_store(const char* dir, const char* name, int index,
+            const u_char* patch, off_t patch_size)
+{
+    char suffix[32];
+    char* path;
+    char* tmp;
+    bool ok = false;
+    
+    sprintf(suffix, ".%d.tmp", index);
+    path = cache_path(dir, name, "");
+    tmp = cache_path(dir, name, suffix);
+    if (path != NULL && tmp != NULL &&
+        fileio_write(tmp, patch, patch_size) == 0) {
+        ok = (rename(tmp, path) == 0);
+        if (!ok) remove(tmp);
+    }
+    
+    free(path);
+    free(tmp);
+    return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Chunk diff worker pool ----------------------------------------------- */
+
+enum { CHUNK_PENDING, CHUNK_DONE, CHUNK_FAILED };
+
+/* What the patch cache did for a job */
+enum { CACHE_UNUSED, CACHE_HIT, CACHE_STORED, CACHE_UNSTORED };
+
+/* One chunk diff handed to the worker pool. Its inputs are either files,
+   read by the worker, or buffers owned by the caller. */
+typedef struct {
+    const char* old_file;
+    const char* new_file;
+    u_char* old_data;
+    u_char* new_data;
+    off_t old_size;
+    off_t new_size;
+    const bsdiff_index* old_index; /* shared index of old_data, or NULL */
+    const char* cache_dir;  /* patch cache, or NULL */
+    const cache_digest* old_digest; /* digest of an indexed old image */
+    off_t old_offset;   /* ranges of an MPATCH02 chunk */
+    off_t new_offset;
+    bsdiff_options diff; /* the chunk offsets are its bases */
+    off_t memory;       /* estimated peak memory while diffing */
+    u_char* patch;      /* finished patch, owned by the assembler */
+    off_t patch_size;
+    int index;
+    int state;
+    int cache;          /* CACHE_* */
+    char cache_key[33]; /* cache entry name, once looked up */
+} chunk_job;
+
+typedef struct {
+    chunk_job* jobs;
+    int num_jobs;
+    int next_job;           /* next job a worker may claim */
+    bool abort;             /* stop claiming jobs after a failure */
+    off_t memory_limit;     /* 0 for no limit */
+    off_t memory_in_flight; /* sum of estimates of running diffs */
+    int num_threads;        /* 0 when diffing serially */
+    cache_digest index_digest; /* old image of the indexed jobs */
+    multipatch_cache_stats* cache_stats;
+#ifdef MULTIPATCH_THREADS
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+} chunk_pool;
+
+/* The bsdiff options of a chunk at the given offsets */
+static void
+chunk_options(const multipatch_params* params, off_t old_offset,
+              off_t new_offset, bsdiff_options* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    if (params != NULL) {
+        opts->filter = params->filter;
+        opts->diff_mode = params->diff_mode;
+        opts->ops = params->ops;
+        opts->extra_dict = params->extra_dict;
+        opts->sparse_diff = params->sparse_diff;
+        opts->max_compression = params->max_compression;
+        opts->engine = params->engine;
+        opts->stride = params->stride;
+    }
+    opts->old_base = old_offset;
+    opts->new_base = new_offset;
+}
+
+/* Index the whole old image once for the chunks that share it: sorted on
+   disk in runs under params->memory_limit when params->index_dir is set,
+   in memory otherwise. *ext is what to free it with. */
+static bsdiff_index*
+shared_index_build(u_char* old_data, off_t old_size, const bsdiff_options* opts,
+                   const multipatch_params* params, extindex** ext)
+{
+    *ext = NULL;
+    if (params == NULL || params->index_dir == NULL) {
+        return bsdiff_index_build_with_options(old_data, old_size, opts);
+    }
+    *ext = extindex_build(old_data, old_size, opts, params->index_dir,
+                          params->memory_limit);
+    return (*ext != NULL) ? extindex_index(*ext) : NULL;
+}
+
+static void
+shared_index_free(bsdiff_index* idx, extindex* ext)
+{
+    if (ext != NULL) extindex_free(ext);
+    else bsdiff_index_free(idx);
+}
+
+/* Rough peak memory of one bsdiff() call: the index being built (a suffix
+   array and its inverse, or hash slots), both inputs, the diff and extra
+   buffers, and the patch buffer. The ctrl buffer is only touched as triples
+   are emitted, so it is left out. */
+static off_t
+chunk_memory(off_t old_size, off_t new_size, const bsdiff_options* opts)
+{
+    return bsdiff_index_memory(old_size, opts) +
+           old_size + 3 * (new_size + 1) +
+           bsdiff_patchsize_max(old_size, new_size);
+}
+
+/* A diff against a shared index only adds the new-side buffers */
+static off_t
+indexed_chunk_memory(off_t new_size)
+{
+    return 3 * (new_size + 1) + bsdiff_patchsize_max(new_size, new_size);
+}
+
+/* Look a job up in the patch cache, leaving the patch in the job on a hit.
+   The entry name is kept for storing the patch after a miss. */
+static bool
+cache_lookup(chunk_job* job, u_char* old_data, off_t old_size,
+             const u_char* new_data, off_t new_size)
+{
+    char* path;
+    
+    cache_name(job->old_digest, old_data, old_size, new_data, new_size,
+               &job->diff, job->cache_key);
+    path = cache_path(job->cache_dir, job->cache_key, "");
+    job->patch_size = (path != NULL) ? cache_load(path, old_data, old_size, new_data,
+                                                  new_size, &job->patch) : 0;
+    free(path);
+    if (job->patch_size <= 0) return false;
+    
+    job->cache = CACHE_HIT;
+    return true;
+}
+
+/* Read and diff one chunk, leaving the patch in the job. Returns the new
+   state of the job, which the caller publishes. */
+static int
+run_chunk(chunk_job* job)
+{
+    fileio_buf old_in, new_in;
+    u_char* old_data;
+    u_char* new_data;
+    u_char* patch_data;
+    u_char* shrunk;
+    off_t old_size, new_size, patch_size;
+    bool from_files = (job->old_file != NULL);
+    int res;
+    
+    if (!from_files) {
+        old_data = job->old_data;
+        new_data = job->new_data;
+        old_size = job->old_size;
+        new_size = job->new_size;
+    } else {
+        if (fileio_read(job->old_file, FILEIO_WILLNEED, &old_in) != 0) {
+            fprintf(stderr, "Error: Could not read old file %s\n", job->old_file);
+            return CHUNK_FAILED;
+        }
+        
+        if (fileio_read(job->new_file, FILEIO_SEQUENTIAL, &new_in) != 0) {
+            fprintf(stderr, "Error: Could not read new file %s\n", job->new_file);
+            fileio_release(&old_in);
+            return CHUNK_FAILED;
+        }
+        
+        old_data = old_in.data;
+        new_data = new_in.data;
+        old_size = old_in.size;
+        new_size = new_in.size;
+        if (old_size != job->old_size || new_size != job->new_size) {
+            fprintf(stderr, "Error: Files %s and %s changed while creating the multi-patch\n",
+                    job->old_file, job->new_file);
+            fileio_release(&old_in);
+            fileio_release(&new_in);
+            return CHUNK_FAILED;
+        }
+    }
+    
+    /* A chunk diffed by an earlier build comes from the cache */
+    if (job->cache_dir != NULL && job->cache_key[0] == '\0' &&
+        cache_lookup(job, old_data, old_size, new_data, new_size)) {
+        if (from_files) {
+            fileio_release(&old_in);
+            fileio_release(&new_in);
+        }
+        return CHUNK_DONE;
+    }
+    
+    /* Against a shared index the old side is the whole image, which
+       would make the worst-case bound huge; start from the bound of a
+       chunk-sized old file and only fall back to the full one if the
+       patch does not fit */
+    patch_size = bsdiff_patchsize_max(job->old_index != NULL ? new_size : old_size,
+                                      new_size);
+    patch_data = malloc((size_t)patch_size);
+    if (patch_data == NULL) {
+        fprintf(stderr, "Error: Could not allocate %lld bytes for patch\n", 
+                (long long)patch_size);
+        if (from_files) {
+            fileio_release(&old_in);
+            fileio_release(&new_in);
+        }
+        return CHUNK_FAILED;
+    }
+    
+    if (job->old_index != NULL) {
+        res = bsdiff_index_diff_at(job->old_index, new_data, new_size,
+                                   job->new_offset, patch_data, patch_size, NULL);
+        if (res <= 0 && patch_size < bsdiff_patchsize_max(old_size, new_size)) {
+            free(patch_data);
+            patch_size = bsdiff_patchsize_max(old_size, new_size);
+            patch_data = malloc((size_t)patch_size);
+            if (patch_data == NULL) {
+                fprintf(stderr, "Error: Could not allocate %lld bytes for patch\n", 
+                        (long long)patch_size);
+                return CHUNK_FAILED;
+            }
+            res = bsdiff_index_diff_at(job->old_index, new_data, new_size,
+                                       job->new_offset, patch_data, patch_size, NULL);
+        }
+    } else {
+        res = bsdiff_with_options(old_data, old_size, new_data, new_size,
+                                  patch_data, patch_size, &job->diff, NULL);
+    }
+    if (from_files) {
+        fileio_release(&old_in);
+        fileio_release(&new_in);
+    }
+    if (res <= 0) {
+        fprintf(stderr, "Error: Could not create patch %d (error: %d)\n", 
+                job->index, res);
+        free(patch_data);
+        return CHUNK_FAILED;
+    }
+    
+    /* Finished patches wait for the assembler, so don't hold on to slack */
+    shrunk = realloc(patch_data, (size_t)res);
+    job->patch = (shrunk != NULL) ? shrunk : patch_data;
+    job->patch_size = res;
+    if (job->cache_dir != NULL) {
+        job->cache = cache_store(job->cache_dir, job->cache_key, job->index,
+                                 job->patch, job->patch_size) ?
+                     CACHE_STORED : CACHE_UNSTORED;
+    }
+    return CHUNK_DONE;
+}
+
+#ifdef MULTIPATCH_THREADS
+static void*
+chunk_worker(void* arg)
+{
+    chunk_pool* pool = arg;
+    chunk_job* job;
+    int state;
+    
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->abort && pool->next_job < pool->num_jobs) {
+        job = &pool->jobs[pool->next_job];
+        if (job->state != CHUNK_PENDING) {
+            pool->next_job++;
+            continue;
+        }
+        
+        /* Admission control: wait until the diff fits in the memory limit.
+           A diff that exceeds the limit on its own still runs, alone. */
+        if (pool->memory_limit > 0 && pool->memory_in_flight > 0 &&
+            pool->memory_in_flight + job->memory > pool->memory_limit) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+            continue;
+        }
+        
+        pool->next_job++;
+        pool->memory_in_flight += job->memory;
+        pthread_mutex_unlock(&pool->lock);
+        
+        state = run_chunk(job);
+        
+        pthread_mutex_lock(&pool->lock);
+        job->state = state;
+        pool->memory_in_flight -= job->memory;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return NULL;
+}
+#endif /* MULTIPATCH_THREADS */
+
+/* Wait for job i to finish. Without worker threads, run it right here. */
+static int
+wait_chunk(chunk_pool* pool, int i)
+{
+    int state;
+    
+    if (pool->jobs[i].state != CHUNK_PENDING) {
+        return pool->jobs[i].state;
+    }
+    
+    if (pool->num_threads <= 0) {
+        pool->jobs[i].state = run_chunk(&pool->jobs[i]);
+        return pool->jobs[i].state;
+    }
+    
+#ifdef MULTIPATCH_THREADS
+    pthread_mutex_lock(&pool->lock);
+    while (pool->jobs[i].state == CHUNK_PENDING)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    state = pool->jobs[i].state;
+    if (state == CHUNK_FAILED) {
+        pool->abort = true;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#else
+    state = CHUNK_FAILED;
+#endif
+    
+    return state;
+}
+
+/* Start up to params->threads workers on the pending jobs. Jobs that are
+   already done are skipped. */
+static void
+pool_start(chunk_pool* pool, chunk_job* jobs, int num_jobs,
+           const multipatch_params* params)
+{
+    const char* cache_dir = (params != NULL) ? params->cache_dir : NULL;
+    const u_char* indexed_old = NULL;
+    int num_threads = 0;
+    int i;
+    
+    memset(pool, 0, sizeof(*pool));
+    pool->jobs = jobs;
+    pool->num_jobs = num_jobs;
+    if (params != NULL) {
+        pool->memory_limit = params->memory_limit;
+        pool->cache_stats = params->cache_stats;
+        num_threads = params->threads;
+    }
+    
+    for (i = 0; i < num_jobs; i++) {
+        jobs[i].index = i;
+        chunk_options(params, jobs[i].old_offset, jobs[i].new_offset, &jobs[i].diff);
+        jobs[i].memory = (jobs[i].old_index != NULL) ?
+                         indexed_chunk_memory(jobs[i].new_size) :
+                         chunk_memory(jobs[i].old_size, jobs[i].new_size,
+                                      &jobs[i].diff);
+        
+        /* Indexed jobs share one old image; digest it once for the cache */
+        jobs[i].cache_dir = cache_dir;
+        if (cache_dir != NULL && jobs[i].old_index != NULL &&
+            jobs[i].state == CHUNK_PENDING && jobs[i].cache_key[0] == '\0') {
+            if (indexed_old == NULL) {
+                indexed_old = jobs[i].old_data;
+                cache_hash(indexed_old, jobs[i].old_size, 0, &pool->index_digest);
+            }
+            if (jobs[i].old_data == indexed_old) jobs[i].old_digest = &pool->index_digest;
+        }
+    }
+    if (num_threads > num_jobs) num_threads = num_jobs;
+#ifdef MULTIPATCH_THREADS
+    if (num_threads > 1) {
+        int started;
+        
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->changed, NULL);
+        pool->threads = malloc((size_t)num_threads * sizeof(pthread_t));
+        for (started = 0; pool->threads != NULL && started < num_threads; started++) {
+            if (pthread_create(&pool->threads[started], NULL, chunk_worker, pool) != 0)
+                break;
+        }
+        if (started == 0) {
+            fprintf(stderr, "Warning: Could not start worker threads, diffing serially\n");
+            pthread_cond_destroy(&pool->changed);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool->threads);
+            pool->threads = NULL;
+        }
+        pool->num_threads = started;
+    }
+#endif
+}
+
+/* Stop claiming jobs and wait for the running ones */
+static void
+pool_stop(chunk_pool* pool)
+{
+    multipatch_cache_stats* st = pool->cache_stats;
+    int i;
+    
+#ifdef MULTIPATCH_THREADS
+    if (pool->num_threads > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->abort = true;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+        pthread_cond_destroy(&pool->changed);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+#endif
+    pool->num_threads = 0;
+    
+    for (i = 0; st != NULL && i < pool->num_jobs; i++) {
+        switch (pool->jobs[i].cache) {
+        case CACHE_HIT:      st->hits++; break;
+        case CACHE_STORED:   st->misses++; break;
+        case CACHE_UNSTORED: st->misses++; st->store_errors++; break;
+        }
+        pool->jobs[i].cache = CACHE_UNUSED;
+    }
+}
+
+off_t
+create_multipatch(const char** old_files, const char** new_files, int num_files, 
+                 u_char* container, off_t container_size)
+{
+    return create_multipatch_files(old_files, new_files, num_files,
+                                   container, container_size, NULL);
+}
+
+/* Get the size of a file without reading it */
+static off_t
+file_size(const char* filename)
+{
+    struct stat st;
+    
+    if (stat(filename, &st) != 0) {
+        fprintf(stderr, "Error: Could not stat file %s\n", filename);
+        return -1;
+    }
+    
+    return (off_t)st.st_size;
+}
+
+/* Diff every job and assemble the patches into the container. Patches are
+   appended as they become available in index order, and the entry table
+   is written last. Jobs already marked done only have their patch placed. */
+static off_t
+create_from_jobs(chunk_job* jobs, int num_jobs,
+                 u_char* container, off_t container_size,
+                 const multipatch_params* params, bool chunked)
+{
+    off_t entry_size = chunked ? (off_t)sizeof(chunk_entry) : (off_t)sizeof(patch_entry);
+    patch_entry* entries;
+    chunk_pool pool;
+    off_t total_newsize = 0;
+    off_t patch_size;
+    off_t current_offset;
+    off_t result = -1;
+    int i;
+    
+    for (i = 0; i < num_jobs; i++) {
+        total_newsize += jobs[i].new_size;
+    }
+    
+    /* The header and entry table must fit; patches are checked as they are
+       appended */
+    current_offset = (off_t)sizeof(multipatch_header) + (off_t)num_jobs * entry_size;
+    if (current_offset > container_size) {
+        fprintf(stderr, "Error: Container size too small (need %lld bytes, have %lld bytes)\n", 
+                (long long)current_offset, (long long)container_size);
+        return -1;
+    }
+    
+    /* Allocate memory for patch entries */
+    entries = malloc(num_jobs * sizeof(patch_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for patch entries\n");
+        return -1;
+    }
+    
+    /* Start the workers */
+    pool_start(&pool, jobs, num_jobs, params);
+    
+    /* Assemble finished patches in index order */
+    for (i = 0; i < num_jobs; i++) {
+        if (wait_chunk(&pool, i) != CHUNK_DONE) {
+            goto out;
+        }
+        
+        /* Check if adding this patch would overflow the container */
+        patch_size = jobs[i].patch_size;
+        if (patch_size <= 0 || patch_size > container_size - current_offset) {
+            fprintf(stderr, "Error: Container size too small for patch %d (need %lld more bytes)\n", 
+                    i, (long long)(current_offset + patch_size - container_size));
+            goto out;
+        }
+        
+        /* Fill in patch entry */
+        entries[i].patch_offset = current_offset;
+        entries[i].patch_size = patch_size;
+        entries[i].input_size = jobs[i].old_size;
+        entries[i].output_size = jobs[i].new_size;
+        
+        /* Copy patch data to container */
+        memcpy(container + current_offset, jobs[i].patch, patch_size);
+        free(jobs[i].patch);
+        jobs[i].patch = NULL;
+        
+        /* Update current offset */
+        current_offset += patch_size;
+    }
+    
+    /* Write header */
+    memcpy(container, chunked ? MULTIPATCH_CHUNKED_MAGIC : MULTIPATCH_MAGIC, 8);
+    write_off_t(num_jobs, container + 8);
+    write_off_t(total_newsize, container + 16);
+    
+    /* Write patch entries */
+    for (i = 0; i < num_jobs; i++) {
+        off_t offset = (off_t)sizeof(multipatch_header) + i * entry_size;
+        write_off_t(entries[i].patch_offset, container + offset);
+        write_off_t(entries[i].patch_size, container + offset + 8);
+        if (chunked) {
+            write_off_t(jobs[i].old_offset, container + offset + 16);
+            write_off_t(entries[i].input_size, container + offset + 24);
+            write_off_t(jobs[i].new_offset, container + offset + 32);
+            write_off_t(entries[i].output_size, container + offset + 40);
+        } else {
+            write_off_t(entries[i].input_size, container + offset + 16);
+            write_off_t(entries[i].output_size, container + offset + 24);
+        }
+    }
+    
+    result = current_offset;
+    
+out:
+    pool_stop(&pool);
+    
+    /* Free memory */
+    for (i = 0; i < num_jobs; i++) free(jobs[i].patch);
+    free(entries);
+    
+    return result;
+}
+
+off_t
+create_multipatch_files(const char** old_files, const char** new_files, int num_files, 
+                        u_char* container, off_t container_size,
+                        const multipatch_params* params)
+{
+    chunk_job* jobs;
+    off_t result;
+    int i;
+    
+    if (num_files <= 0) {
+        fprintf(stderr, "Error: No files to create a multi-patch from\n");
+        return -1;
+    }
+    
+    jobs = calloc((size_t)num_files, sizeof(chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for chunk jobs\n");
+        return -1;
+    }
+    
+    /* Only the sizes are needed up front; each file is read once, by the
+       worker that diffs it */
+    for (i = 0; i < num_files; i++) {
+        /* Validate file pointers */
+        if (old_files[i] == NULL || new_files[i] == NULL) {
+            fprintf(stderr, "Error: NULL file pointer at index %d\n", i);
+            free(jobs);
+            return -1;
+        }
+        
+        jobs[i].old_file = old_files[i];
+        jobs[i].new_file = new_files[i];
+        jobs[i].old_size = file_size(old_files[i]);
+        jobs[i].new_size = file_size(new_files[i]);
+        if (jobs[i].old_size < 0 || jobs[i].new_size < 0) {
+            free(jobs);
+            return -1;
+        }
+    }
+    
+    result = create_from_jobs(jobs, num_files, container, container_size, params, false);
+    free(jobs);
+    return result;
+}
+
+off_t
+create_multipatch_buffers(const multipatch_input* inputs, int num_inputs,
+                          u_char* container, off_t container_size,
+                          const multipatch_params* params)
+{
+    chunk_job* jobs;
+    off_t result;
+    int i;
+    
+    if (inputs == NULL || num_inputs <= 0) {
+        fprintf(stderr, "Error: No buffers to create a multi-patch from\n");
+        return -1;
+    }
+    
+    jobs = calloc((size_t)num_inputs, sizeof(chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for chunk jobs\n");
+        return -1;
+    }
+    
+    for (i = 0; i < num_inputs; i++) {
+        if (inputs[i].old_data == NULL || inputs[i].new_data == NULL ||
+            inputs[i].old_size < 0 || inputs[i].new_size < 0) {
+            fprintf(stderr, "Error: Invalid input buffers at index %d\n", i);
+            free(jobs);
+            return -1;
+        }
+        
+        jobs[i].old_data = inputs[i].old_data;
+        jobs[i].new_data = inputs[i].new_data;
+        jobs[i].old_size = inputs[i].old_size;
+        jobs[i].new_size = inputs[i].new_size;
+    }
+    
+    result = create_from_jobs(jobs, num_inputs, container, container_size, params, false);
+    free(jobs);
+    return result;
+}
+
+off_t
+create_multipatch_chunks(u_char* old_data, off_t old_size,
+                         u_char* new_data, off_t new_size,
+                         const multipatch_chunk* chunks, int num_chunks,
+                         u_char* container, off_t container_size,
+                         const multipatch_params* params)
+{
+    chunk_job* jobs;
+    bsdiff_index* old_index = NULL;
+    extindex* old_ext = NULL;
+    bsdiff_options opts;
+    cache_digest whole_digest;
+    cache_digest* old_digest = NULL;
+    bool* whole;
+    off_t next_new = 0;
+    off_t result;
+    int i;
+    
+    if (old_data == NULL || new_data == NULL || chunks == NULL || num_chunks <= 0) {
+        fprintf(stderr, "Error: No chunks to create a multi-patch from\n");
+        return -1;
+    }
+    
+    jobs = calloc((size_t)num_chunks, sizeof(chunk_job));
+    whole = calloc((size_t)num_chunks, sizeof(bool));
+    if (jobs == NULL || whole == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for chunk jobs\n");
+        free(jobs);
+        free(whole);
+        return -1;
+    }
+    
+    for (i = 0; i < num_chunks; i++) {
+        const multipatch_chunk* c = &chunks[i];
+        
+        /* New ranges tile the new image in order; old ranges are free */
+        if (c->new_offset != next_new || c->new_size <= 0 ||
+            c->new_size > new_size - c->new_offset ||
+            c->old_offset < 0 || c->old_size < 0 ||
+            c->old_offset > old_size || c->old_size > old_size - c->old_offset) {
+            fprintf(stderr, "Error: Invalid chunk ranges at index %d\n", i);
+            free(jobs);
+            free(whole);
+            return -1;
+        }
+        next_new += c->new_size;
+        whole[i] = (c->old_offset == 0 && c->old_size == old_size && num_chunks > 1);
+        
+        jobs[i].old_data = old_data + c->old_offset;
+        jobs[i].old_size = c->old_size;
+        jobs[i].old_offset = c->old_offset;
+        jobs[i].new_data = new_data + c->new_offset;
+        jobs[i].new_size = c->new_size;
+        jobs[i].new_offset = c->new_offset;
+        chunk_options(params, c->old_offset, c->new_offset, &jobs[i].diff);
+    }
+    
+    if (next_new != new_size) {
+        fprintf(stderr, "Error: Chunks cover %lld of %lld new bytes\n",
+                (long long)next_new, (long long)new_size);
+        free(jobs);
+        free(whole);
+        return -1;
+    }
+    
+    /* Take what the cache has first: when every chunk that sees the whole
+       old image is cached, the old image is never sorted */
+    if (params != NULL && params->cache_dir != NULL) {
+        for (i = 0; i < num_chunks; i++) {
+            if (whole[i] && old_digest == NULL) {
+                cache_hash(old_data, old_size, 0, &whole_digest);
+                old_digest = &whole_digest;
+            }
+            jobs[i].cache_dir = params->cache_dir;
+            jobs[i].old_digest = whole[i] ? old_digest : NULL;
+            if (cache_lookup(&jobs[i], jobs[i].old_data, jobs[i].old_size,
+                             jobs[i].new_data, jobs[i].new_size)) {
+                jobs[i].state = CHUNK_DONE;
+            }
+        }
+    }
+    
+    /* Chunks seeing the whole old image share a single index of it */
+    chunk_options(params, 0, 0, &opts);
+    for (i = 0; i < num_chunks; i++) {
+        if (!whole[i] || jobs[i].state != CHUNK_PENDING) continue;
+        if (old_index == NULL &&
+            (old_index = shared_index_build(old_data, old_size, &opts, params,
+                                            &old_ext)) == NULL) {
+            fprintf(stderr, "Error: Could not index old data\n");
+            for (i = 0; i < num_chunks; i++) free(jobs[i].patch);
+            free(jobs);
+            free(whole);
+            return -1;
+        }
+        jobs[i].old_index = old_index;
+    }
+    
+    result = create_from_jobs(jobs, num_chunks, container, container_size, params, true);
+    shared_index_free(old_index, old_ext);
+    free(jobs);
+    free(whole);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Chunk layout search under a RAM budget ------------------------------- */
+
+#define PLAN_MAX_CHUNKS 4096
+
+/* A diffed range, kept so that later trials can reuse it */
+typedef struct {
+    multipatch_chunk range;
+    u_char* patch;
+    off_t patch_size;
+    bspatch_workspace ws;   /* decompressed block sizes of the patch */
+} plan_result;
+
+typedef struct {
+    u_char* old_data;
+    off_t old_size;
+    u_char* new_data;
+    off_t new_size;
+    const multipatch_budget* budget;
+    const multipatch_params* params;
+    bsdiff_index* old_index;        /* whole-image chunks */
+    extindex* old_ext;              /* old_index sorted on disk */
+    multipatch_anchors* anchors;    /* windowed chunks */
+    plan_result* results;
+    int num_results;
+    int max_results;
+    int trials;
+    int reused;
+} planner;
+
+/* Old range a new range is diffed against */
+static void
+plan_old_range(planner* p, multipatch_chunk* c)
+{
+    off_t old_len;
+    
+    if (p->anchors == NULL) {
+        c->old_offset = 0;
+        c->old_size = p->old_size;
+        return;
+    }
+    
+    /* Proportional position, moved to where the anchors match */
+    c->old_offset = (off_t)(((double)c->new_offset / p->new_size) * p->old_size);
+    old_len = p->budget->window;
+    if (c->old_offset > p->old_size) c->old_offset = p->old_size;
+    if (old_len > p->old_size - c->old_offset) old_len = p->old_size - c->old_offset;
+    multipatch_select_window(p->anchors, p->new_data + c->new_offset, c->new_size,
+                             p->budget->window, &c->old_offset, &old_len);
+    c->old_size = old_len;
+}
+
+static plan_result*
+plan_lookup(planner* p, off_t new_offset, off_t new_size)
+{
+    int i;
+    
+    for (i = 0; i < p->num_results; i++) {
+        if (p->results[i].range.new_offset == new_offset &&
+            p->results[i].range.new_size == new_size) {
+            return &p->results[i];
+        }
+    }
+    return NULL;
+}
+
+static bool
+plan_fits(const planner* p, const plan_result* r)
+{
+    const multipatch_budget* b = p->budget;
+    
+    return (b->ctrl_size <= 0 || r->ws.ctrlsz <= b->ctrl_size) &&
+           (b->diff_size <= 0 || r->ws.diffsz <= b->diff_size) &&
+           (b->extra_size <= 0 || r->ws.extrasz <= b->extra_size);
+}
+
+/* Diff every chunk that no earlier trial has diffed, through the worker
+   pool */
+static bool
+plan_evaluate(planner* p, multipatch_chunk* chunks, int num_chunks)
+{
+    chunk_job* jobs;
+    chunk_pool pool;
+    bool ok = true;
+    int num_jobs = 0;
+    int i;
+    
+    p->trials++;
+    jobs = calloc((size_t)num_chunks, sizeof(chunk_job));
+    if (jobs == NULL) return false;
+    
+    for (i = 0; i < num_chunks; i++) {
+        if (plan_lookup(p, chunks[i].new_offset, chunks[i].new_size) != NULL) {
+            p->reused++;
+            continue;
+        }
+        plan_old_range(p, &chunks[i]);
+        jobs[num_jobs].old_data = p->old_data + chunks[i].old_offset;
+        jobs[num_jobs].old_size = chunks[i].old_size;
+        jobs[num_jobs].old_offset = chunks[i].old_offset;
+        jobs[num_jobs].new_data = p->new_data + chunks[i].new_offset;
+        jobs[num_jobs].new_size = chunks[i].new_size;
+        jobs[num_jobs].new_offset = chunks[i].new_offset;
+        if (p->anchors == NULL) jobs[num_jobs].old_index = p->old_index;
+        num_jobs++;
+    }
+    
+    if (p->num_results + num_jobs > p->max_results) {
+        int max_results = (p->num_results + num_jobs) * 2;
+        plan_result* grown = realloc(p->results, (size_t)max_results * sizeof(plan_result));
+        if (grown == NULL) {
+            free(jobs);
+            return false;
+        }
+        p->results = grown;
+        p->max_results = max_results;
+    }
+    
+    pool_start(&pool, jobs, num_jobs, p->params);
+    for (i = 0; i < num_jobs; i++) {
+        plan_result* r;
+        
+        if (wait_chunk(&pool, i) != CHUNK_DONE) {
+            ok = false;
+            break;
+        }
+        
+        r = &p->results[p->num_results];
+        r->range.old_offset = jobs[i].old_offset;
+        r->range.old_size = jobs[i].old_size;
+        r->range.new_offset = jobs[i].new_offset;
+        r->range.new_size = jobs[i].new_size;
+        r->patch = jobs[i].patch;
+        r->patch_size = jobs[i].patch_size;
+        jobs[i].patch = NULL;
+        if (bspatch_workspace_size(r->patch, r->patch_size, &r->ws) < 0) {
+            free(r->patch);
+            ok = false;
+            break;
+        }
+        p->num_results++;
+    }
+    pool_stop(&pool);
+    
+    for (i = 0; i < num_jobs; i++) free(jobs[i].patch);
+    free(jobs);
+    return ok;
+}
+
+/* Total container size of a layout, or -1 if a chunk exceeds the budget */
+static off_t
+plan_cost(planner* p, const multipatch_chunk* chunks, int num_chunks)
+{
+    off_t total = (off_t)sizeof(multipatch_header) + num_chunks * (off_t)sizeof(chunk_entry);
+    int i;
+    
+    for (i = 0; i < num_chunks; i++) {
+        plan_result* r = plan_lookup(p, chunks[i].new_offset, chunks[i].new_size);
+        if (r == NULL || !plan_fits(p, r)) return -1;
+        total += r->patch_size;
+    }
+    return total;
+}
+
+/* Cut the new image into n chunks of nearly equal size */
+static void
+plan_uniform(planner* p, multipatch_chunk* chunks, int n)
+{
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        chunks[i].new_offset = p->new_size * i / n;
+        chunks[i].new_size = p->new_size * (i + 1) / n - chunks[i].new_offset;
+    }
+}
+
+off_t
+create_multipatch_budget(u_char* old_data, off_t old_size,
+                         u_char* new_data, off_t new_size,
+                         const multipatch_budget* budget,
+                         u_char* container, off_t container_size,
+                         const multipatch_params* params)
+{
+    planner p;
+    multipatch_chunk* best = NULL;
+    multipatch_chunk* trial = NULL;
+    multipatch_chunk* next = NULL;
+    chunk_job* jobs = NULL;
+    off_t best_cost = -1, cost;
+    int best_n = 0, n, next_n, lo, hi, max_chunks;
+    off_t result = -1;
+    int i;
+    
+    if (old_data == NULL || new_data == NULL || budget == NULL || new_size <= 0) {
+        fprintf(stderr, "Error: Invalid arguments for the budget search\n");
+        return -1;
+    }
+    
+    memset(&p, 0, sizeof(p));
+    p.old_data = old_data;
+    p.old_size = old_size;
+    p.new_data = new_data;
+    p.new_size = new_size;
+    p.budget = budget;
+    p.params = params;
+    
+    max_chunks = (budget->max_chunks > 0) ? budget->max_chunks : PLAN_MAX_CHUNKS;
+    if (max_chunks > new_size) max_chunks = (int)new_size;
+    
+    /* The old image is indexed once for every trial */
+    if (budget->window > 0) {
+        p.anchors = multipatch_anchors_build(old_data, old_size);
+    } else {
+        bsdiff_options opts;
+        
+        chunk_options(params, 0, 0, &opts);
+        p.old_index = shared_index_build(old_data, old_size, &opts, params,
+                                         &p.old_ext);
+    }
+    best = malloc((size_t)max_chunks * sizeof(multipatch_chunk));
+    trial = malloc((size_t)max_chunks * sizeof(multipatch_chunk));
+    next = malloc((size_t)max_chunks * sizeof(multipatch_chunk));
+    if ((p.anchors == NULL && p.old_index == NULL) ||
+        best == NULL || trial == NULL || next == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for the budget search\n");
+        goto out;
+    }
+    
+    /* Non-uniform layout: bisect every chunk that exceeds the budget until
+       all of them fit */
+    n = 1;
+    trial[0].new_offset = 0;
+    trial[0].new_size = new_size;
+    for (;;) {
+        if (!plan_evaluate(&p, trial, n)) goto out;
+        
+        next_n = 0;
+        for (i = 0; i < n && next_n <= max_chunks; i++) {
+            plan_result* r = plan_lookup(&p, trial[i].new_offset, trial[i].new_size);
+            
+            if (plan_fits(&p, r) || trial[i].new_size < 2) {
+                if (next_n < max_chunks) next[next_n] = trial[i];
+                next_n++;
+            } else {
+                if (next_n + 2 <= max_chunks) {
+                    next[next_n].new_offset = trial[i].new_offset;
+                    next[next_n].new_size = trial[i].new_size / 2;
+                    next[next_n + 1].new_offset = trial[i].new_offset + trial[i].new_size / 2;
+                    next[next_n + 1].new_size = trial[i].new_size - trial[i].new_size / 2;
+                }
+                next_n += 2;
+            }
+        }
+        if (next_n == n || next_n > max_chunks) break;
+        memcpy(trial, next, (size_t)next_n * sizeof(multipatch_chunk));
+        n = next_n;
+    }
+    cost = plan_cost(&p, trial, n);
+    if (cost >= 0) {
+        memcpy(best, trial, (size_t)n * sizeof(multipatch_chunk));
+        best_n = n;
+        best_cost = cost;
+    }
+    
+    /* Uniform layouts: double the chunk count until one fits, then narrow
+       down to the smallest count that fits */
+    lo = 0;
+    hi = 1;
+    for (;;) {
+        plan_uniform(&p, trial, hi);
+        if (!plan_evaluate(&p, trial, hi)) goto out;
+        if (plan_cost(&p, trial, hi) >= 0) break;
+        lo = hi;
+        if (hi == max_chunks) {
+            hi = max_chunks + 1;
+            break;
+        }
+        hi = (hi > max_chunks / 2) ? max_chunks : hi * 2;
+    }
+    while (hi <= max_chunks && hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        
+        plan_uniform(&p, trial, mid);
+        if (!plan_evaluate(&p, trial, mid)) goto out;
+        if (plan_cost(&p, trial, mid) >= 0) hi = mid;
+        else lo = mid;
+    }
+    if (hi <= max_chunks) {
+        plan_uniform(&p, trial, hi);
+        cost = plan_cost(&p, trial, hi);
+        if (cost >= 0 && (best_cost < 0 || cost < best_cost)) {
+            memcpy(best, trial, (size_t)hi * sizeof(multipatch_chunk));
+            best_n = hi;
+            best_cost = cost;
+        }
+    }
+    
+    if (budget->stats != NULL) {
+        budget->stats->trials = p.trials;
+        budget->stats->diffs = p.num_results;
+        budget->stats->reused = p.reused;
+    }
+    if (best_cost < 0) {
+        fprintf(stderr, "Error: No layout of at most %d chunks fits the budget\n", max_chunks);
+        goto out;
+    }
+    
+    /* Assemble the best layout from the patches already made */
+    jobs = calloc((size_t)best_n, sizeof(chunk_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error: Could not allocate memory for chunk jobs\n");
+        goto out;
+    }
+    for (i = 0; i < best_n; i++) {
+        plan_result* r = plan_lookup(&p, best[i].new_offset, best[i].new_size);
+        
+        jobs[i].old_offset = r->range.old_offset;
+        jobs[i].old_size = r->range.old_size;
+        jobs[i].new_offset = r->range.new_offset;
+        jobs[i].new_size = r->range.new_size;
+        jobs[i].patch = r->patch;
+        jobs[i].patch_size = r->patch_size;
+        jobs[i].state = CHUNK_DONE;
+        r->patch = NULL;
+    }
+    result = create_from_jobs(jobs, best_n, container, container_size, NULL, true);
+    
+out:
+    for (i = 0; i < p.num_results; i++) free(p.results[i].patch);
+    free(p.results);
+    free(jobs);
+    free(best);
+    free(trial);
+    free(next);
+    shared_index_free(p.old_index, p.old_ext);
+    multipatch_anchors_free(p.anchors);
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -- Content anchors ------------------------------------------------------ */
+
+/* Anchors are the positions where a rolling hash over the last ANCHOR_WINDOW
+   bytes has its top ANCHOR_BITS bits clear, i.e. one every 2^ANCHOR_BITS
+   bytes on average. They depend on content only, so an insertion shifts the
+   anchors after it instead of changing them. */
+#define ANCHOR_WINDOW 32
+#define ANCHOR_BITS 6
+#define ANCHOR_BASE 0x01000193u
+#define ANCHOR_MAX_HITS 8 /* ignore hashes this common (padding, fill) */
+
+typedef struct {
+    uint32_t hash;
+    off_t pos;            /* offset just past the hashed window */
+} anchor;
+
+struct multipatch_anchors {
+    anchor* anchors;
+    off_t num_anchors;
+    off_t old_size;
+};
+
+/* ANCHOR_BASE^ANCHOR_WINDOW, to drop the byte leaving the window */
+static uint32_t
+anchor_base_pow(void)
+{
+    uint32_t p = 1;
+    int i;
+    
+    for (i = 0; i < ANCHOR_WINDOW; i++) p *= ANCHOR_BASE;
+    return p;
+}
+
+#define IS_ANCHOR(h) (((h) >> (32 - ANCHOR_BITS)) == 0)
+
+static int
+anchor_cmp(const void* a, const void* b)
+{
+    const anchor* x = a;
+    const anchor* y = b;
+    
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+    return 0;
+}
+
+static int
+off_t_cmp(const void* a, const void* b)
+{
+    off_t x = *(const off_t*)a;
+    off_t y = *(const off_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+multipatch_anchors*
+multipatch_anchors_build(const u_char* old_data, off_t old_size)
+{
+    multipatch_anchors* idx;
+    uint32_t pow = anchor_base_pow();
+    uint32_t h = 0;
+    off_t cap, i;
+    
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL) return NULL;
+    idx->old_size = old_size;
+    
+    cap = (old_size >> (ANCHOR_BITS - 1)) + 16;
+    idx->anchors = malloc((size_t)cap * sizeof(anchor));
+    if (idx->anchors == NULL) {
+        free(idx);
+        return NULL;
+    }
+    
+    for (i = 0; i < old_size; i++) {
+        h = h * ANCHOR_BASE + old_data[i];
+        if (i >= ANCHOR_WINDOW) h -= pow * old_data[i - ANCHOR_WINDOW];
+        if (i + 1 < ANCHOR_WINDOW || !IS_ANCHOR(h)) continue;
+        
+        if (idx->num_anchors == cap) {
+            anchor* grown = realloc(idx->anchors, (size_t)cap * 2 * sizeof(anchor));
+            if (grown == NULL) {
+                multipatch_anchors_free(idx);
+                return NULL;
+            }
+            idx->anchors = grown;
+            cap *= 2;
+        }
+        idx->anchors[idx->num_anchors].hash = h;
+        idx->anchors[idx->num_anchors].pos = i + 1;
+        idx->num_anchors++;
+    }
+    
+    qsort(idx->anchors, (size_t)idx->num_anchors, sizeof(anchor), anchor_cmp);
+    return idx;
+}
+
+void
+multipatch_anchors_free(multipatch_anchors* idx)
+{
+    if (idx == NULL) return;
+    free(idx->anchors);
+    free(idx);
+}
+
+/* First anchor with the given hash, or num_anchors */
+static off_t
+anchor_find(const multipatch_anchors* idx, uint32_t hash)
+{
+    off_t lo = 0, hi = idx->num_anchors;
+    
+    while (lo < hi) {
+        off_t mid = lo + (hi - lo) / 2;
+        if (idx->anchors[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int
+multipatch_select_window(const multipatch_anchors* idx,
+                         const u_char* new_data, off_t new_size,
+                         off_t max_window, off_t* old_start, off_t* old_len)
+{
+    uint32_t pow = anchor_base_pow();
+    uint32_t h = 0;
+    off_t* starts;
+    off_t num_starts = 0, cap = 64;
+    off_t slack, best_lo = 0, best_count = 0, lo, hi;
+    off_t first, last, start, end, len;
+    off_t i, j, k;
+    
+    if (idx == NULL || idx->num_anchors == 0 || new_size <= 0 || max_window <= 0)
+        return 0;
+    
+    starts = malloc((size_t)cap * sizeof(off_t));
+    if (starts == NULL) return 0;
+    
+    /* Every anchor shared with the old file votes for where the chunk
+       starts in it */
+    for (i = 0; i < new_size; i++) {
+        h = h * ANCHOR_BASE + new_data[i];
+        if (i >= ANCHOR_WINDOW) h -= pow * new_data[i - ANCHOR_WINDOW];
+        if (i + 1 < ANCHOR_WINDOW || !IS_ANCHOR(h)) continue;
+        
+        j = anchor_find(idx, h);
+        for (k = j; k < idx->num_anchors && idx->anchors[k].hash == h; k++)
+            ;
+        if (k == j || k - j > ANCHOR_MAX_HITS) continue;
+        
+        for (; j < k; j++) {
+            if (num_starts == cap) {
+                off_t* grown = realloc(starts, (size_t)cap * 2 * sizeof(off_t));
+                if (grown == NULL) goto out;
+                starts = grown;
+                cap *= 2;
+            }
+            starts[num_starts++] = idx->anchors[j].pos - (i + 1);
+        }
+    }
+    
+    if (num_starts == 0) goto out;
+    
+    /* Pick the densest run of votes that still fits the window */
+    qsort(starts, (size_t)num_starts, sizeof(off_t), off_t_cmp);
+    slack = max_window > new_size ? max_window - new_size : 0;
+    for (lo = 0, hi = 0; hi < num_starts; hi++) {
+        while (starts[hi] - starts[lo] > slack) lo++;
+        if (hi - lo + 1 > best_count) {
+            best_count = hi - lo + 1;
+            best_lo = lo;
+        }
+    }
+    first = starts[best_lo];
+    last = starts[best_lo + best_count - 1];
+    
+    /* Cover the chunk at every voted start, then widen both sides evenly
+       up to the window limit */
+    start = first;
+    end = last + new_size;
+    if (end - start > max_window) end = start + max_window;
+    len = end - start;
+    start -= (max_window - len) / 2;
+    end = start + max_window;
+    if (start < 0) {
+        end -= start;
+        start = 0;
+    }
+    if (end > idx->old_size) {
+        start -= end - idx->old_size;
+        end = idx->old_size;
+        if (start < 0) start = 0;
+    }
+    
+    *old_start = start;
+    *old_len = end - start;
+    
+out:
+    free(starts);
+    return (int)(best_count > INT_MAX ? INT_MAX : best_count);
+}
+
+/* Size of one entry of the container's table, or 0 for a bad magic */
+static off_t
+container_entry_size(const u_char* container)
+{
+    if (memcmp(container, MULTIPATCH_MAGIC, 8) == 0) return (off_t)sizeof(patch_entry);
+    if (memcmp(container, MULTIPATCH_CHUNKED_MAGIC, 8) == 0) return (off_t)sizeof(chunk_entry);
+    return 0;
+}
 
-    return y;
+/* Read entry i of a valid MPATCH02 container */
+static void
+read_chunk_entry(u_char* container, off_t i, chunk_entry* e)
+{
+    u_char* p = container + sizeof(multipatch_header) + i * (off_t)sizeof(chunk_entry);
+    
+    e->patch_offset = read_off_t(p);
+    e->patch_size = read_off_t(p + 8);
+    e->old_offset = read_off_t(p + 16);
+    e->old_size = read_off_t(p + 24);
+    e->new_offset = read_off_t(p + 32);
+    e->new_size = read_off_t(p + 40);
 }
 
-/* Read a file into memory */
-static off_t
-read_file(const char* filename, u_char** data)
+int
+multipatch_chunk_info(u_char* container, off_t container_size, int i,
+                      chunk_entry* entry)
 {
-    FILE* f;
-    off_t size;
+    off_t num_patches;
     
-    /* Validate input parameters */
-    if (filename == NULL) {
-        fprintf(stderr, "Error: NULL filename\n");
+    if (container == NULL || entry == NULL ||
+        container_size < (off_t)sizeof(multipatch_header) ||
+        memcmp(container, MULTIPATCH_CHUNKED_MAGIC, 8) != 0) {
         return -1;
     }
     
-    if (data == NULL) {
-        fprintf(stderr, "Error: NULL data pointer\n");
+    num_patches = read_off_t(container + 8);
+    if (i < 0 || i >= num_patches ||
+        (off_t)sizeof(multipatch_header) + (i + 1) * (off_t)sizeof(chunk_entry) > container_size) {
         return -1;
     }
     
-    f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Error: Could not open file %s\n", filename);
+    read_chunk_entry(container, i, entry);
+    if (entry->patch_offset < 0 || entry->patch_size < 0 ||
+        entry->patch_size > container_size - entry->patch_offset ||
+        entry->old_offset < 0 || entry->old_size < 0 ||
+        entry->new_offset < 0 || entry->new_size <= 0) {
         return -1;
     }
     
-    if (fseek(f, 0, SEEK_END) != 0) {
-        fprintf(stderr, "Error: Could not seek to end of file %s\n", filename);
-        fclose(f);
+    return 0;
+}
+
+int
+multipatch_apply_chunk(u_char* container, off_t container_size, int i,
+                       u_char* old_data, off_t old_size,
+                       u_char* out, off_t out_size,
+                       bspatch_workspace* ws)
+{
+    chunk_entry e;
+    
+    if (multipatch_chunk_info(container, container_size, i, &e) != 0) {
+        return -2;
+    }
+    if (old_data == NULL || out == NULL || ws == NULL ||
+        e.old_offset > old_size || e.old_size > old_size - e.old_offset ||
+        out_size < e.new_size) {
         return -1;
     }
     
-    size = ftell(f);
-    if (size < 0) {
-        fprintf(stderr, "Error: Could not get file size for %s\n", filename);
-        fclose(f);
-        return -1;
+    return bspatch_with_workspace(old_data + e.old_offset, e.old_size,
+                                  out, e.new_size,
+                                  container + e.patch_offset, e.patch_size,
+                                  ws, NULL);
+}
+
+/* State shared by the workers applying an MPATCH02 container */
+typedef struct {
+    u_char* container;
+    off_t container_size;
+    u_char* old_data;
+    off_t old_size;
+    u_char* out;            /* the whole output */
+    off_t workspace_size;   /* multipatch_workspace_size of the container */
+    int num_chunks;
+    int next_chunk;
+    bool failed;
+#ifdef MULTIPATCH_THREADS
+    pthread_mutex_t lock;
+#endif
+} apply_pool;
+
+static void
+apply_lock(apply_pool* pool, bool threaded)
+{
+#ifdef MULTIPATCH_THREADS
+    if (threaded) pthread_mutex_lock(&pool->lock);
+#else
+    (void)pool; (void)threaded;
+#endif
+}
+
+static void
+apply_unlock(apply_pool* pool, bool threaded)
+{
+#ifdef MULTIPATCH_THREADS
+    if (threaded) pthread_mutex_unlock(&pool->lock);
+#else
+    (void)pool; (void)threaded;
+#endif
+}
+
+/* Claim chunks until none are left, patching each in place into its range
+   of the output */
+static bool
+apply_chunks(apply_pool* pool, bool threaded)
+{
+    bspatch_workspace ws;
+    chunk_entry e;
+    u_char* work;
+    bool ok = true;
+    int i, res;
+    
+    work = malloc((size_t)pool->workspace_size + 1);
+    if (work == NULL) {
+        fprintf(stderr, "Error: Could not allocate %lld bytes to apply a chunk\n",
+                (long long)pool->workspace_size);
+        apply_lock(pool, threaded);
+        pool->failed = true;
+        apply_unlock(pool, threaded);
+        return false;
+    }
+    multipatch_workspace_size(pool->container, pool->container_size, &ws);
+    bspatch_workspace_attach(&ws, work);
+    
+    for (;;) {
+        apply_lock(pool, threaded);
+        i = pool->failed ? pool->num_chunks : pool->next_chunk++;
+        apply_unlock(pool, threaded);
+        if (i >= pool->num_chunks) break;
+        
+        multipatch_chunk_info(pool->container, pool->container_size, i, &e);
+        res = multipatch_apply_chunk(pool->container, pool->container_size, i,
+                                     pool->old_data, pool->old_size,
+                                     pool->out + e.new_offset, e.new_size, &ws);
+        if (res != 0) {
+            fprintf(stderr, "Error: Failed to apply patch %d (error: %d)\n", i, res);
+            ok = false;
+            apply_lock(pool, threaded);
+            pool->failed = true;
+            apply_unlock(pool, threaded);
+            break;
+        }
     }
     
-    if (fseek(f, 0, SEEK_SET) != 0) {
-        fprintf(stderr, "Error: Could not seek to start of file %s\n", filename);
-        fclose(f);
+    free(work);
+    return ok;
+}
+
+#ifdef MULTIPATCH_THREADS
+static void*
+apply_worker(void* arg)
+{
+    apply_pool* pool = arg;
+    
+    apply_chunks(pool, true);
+    return NULL;
+}
+#endif /* MULTIPATCH_THREADS */
+
+/* Apply an MPATCH02 container with up to 'num_threads' chunks in flight */
+static int
+apply_chunked(u_char* input_data, off_t input_size, const char* output_file,
+              u_char* container, off_t container_size, int num_threads)
+{
+    bspatch_workspace ws;
+    apply_pool pool;
+    fileio_buf out;
+    chunk_entry e;
+    off_t total_newsize;
+    int i;
+#ifdef MULTIPATCH_THREADS
+    pthread_t* threads = NULL;
+    int started = 0;
+#endif
+    
+    if (!multipatch_valid(container, container_size)) {
+        fprintf(stderr, "Error: Invalid multi-patch container\n");
         return -1;
     }
     
-    /* Check for reasonable size limits */
-    if (size > (off_t)(1024 * 1024 * 1024)) { /* 1GB limit */
-        fprintf(stderr, "Error: File %s is too large (>1GB)\n", filename);
-        fclose(f);
+    memset(&pool, 0, sizeof(pool));
+    pool.container = container;
+    pool.container_size = container_size;
+    pool.old_data = input_data;
+    pool.old_size = input_size;
+    pool.num_chunks = (int)read_off_t(container + 8);
+    pool.workspace_size = multipatch_workspace_size(container, container_size, &ws);
+    if (pool.workspace_size < 0) {
         return -1;
     }
+    for (i = 0; i < pool.num_chunks; i++) {
+        multipatch_chunk_info(container, container_size, i, &e);
+        if (e.old_offset > input_size || e.old_size > input_size - e.old_offset) {
+            fprintf(stderr, "Error: Old range of patch %d exceeds input size %lld\n",
+                    i, (long long)input_size);
+            return -1;
+        }
+    }
     
-    *data = malloc((size_t)size);
-    if (*data == NULL) {
-        fprintf(stderr, "Error: Could not allocate %lld bytes for file %s\n", 
-                (long long)size, filename);
-        fclose(f);
+    /* Chunks tile the output, so workers patch straight into it */
+    total_newsize = multipatch_total_size(container, container_size);
+    if (fileio_create(output_file, total_newsize, &out) != 0) {
+        fprintf(stderr, "Error: Could not create output file %s\n", output_file);
         return -1;
     }
+    pool.out = out.data;
+    
+    if (num_threads > pool.num_chunks) num_threads = pool.num_chunks;
+#ifdef MULTIPATCH_THREADS
+    if (num_threads > 1) {
+        pthread_mutex_init(&pool.lock, NULL);
+        threads = malloc((size_t)num_threads * sizeof(pthread_t));
+        for (started = 0; threads != NULL && started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, apply_worker, &pool) != 0)
+                break;
+        }
+        for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        free(threads);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    if (started == 0)
+#endif
+    apply_chunks(&pool, false);
     
-    size_t bytes_read = fread(*data, 1, (size_t)size, f);
-    if (bytes_read != (size_t)size) {
-        fprintf(stderr, "Error: Could not read file %s (read %zu of %lld bytes)\n", 
-                filename, bytes_read, (long long)size);
-        free(*data);
-        fclose(f);
+    if (pool.failed) {
+        fileio_release(&out);
+        return -1;
+    }
+    if (fileio_commit(&out, total_newsize) != 0) {
+        fprintf(stderr, "Error: Could not write output file %s\n", output_file);
         return -1;
     }
     
-    fclose(f);
-    return size;
+    return 0;
 }
 
-/* Write data to a file */
-static int
-write_file(const char* filename, u_char* data, off_t size)
+int
+apply_multipatch_threads(const char* input_file, const char* output_file,
+                         u_char* container, off_t container_size, int threads)
 {
-    FILE* f;
+    fileio_buf in;
+    int res;
+    
+    if (container == NULL || container_size < (off_t)sizeof(multipatch_header) ||
+        memcmp(container, MULTIPATCH_CHUNKED_MAGIC, 8) != 0) {
+        return apply_multipatch(input_file, output_file, container, container_size);
+    }
     
-    f = fopen(filename, "wb");
-    if (f == NULL) {
-        fprintf(stderr, "Error: Could not open file %s for writing\n", filename);
+    if (input_file == NULL || output_file == NULL) {
+        fprintf(stderr, "Error: Invalid input parameters\n");
         return -1;
     }
     
-    if (fwrite(data, 1, (size_t)size, f) != (size_t)size) {
-        fprintf(stderr, "Error: Could not write to file %s\n", filename);
-        fclose(f);
+    if (fileio_read(input_file, FILEIO_RANDOM, &in) != 0) {
+        fprintf(stderr, "Error: Could not read input file %s\n", input_file);
         return -1;
     }
     
-    fclose(f);
-    return 0;
+    res = apply_chunked(in.data, in.size, output_file,
+                        container, container_size, threads);
+    fileio_release(&in);
+    return res;
 }
 
 off_t
-create_multipatch(const char** old_files, const char** new_files, int num_files, 
-                 u_char* container, off_t container_size)
+multipatch_scratch_size(u_char* container, off_t container_size)
 {
-    multipatch_header header;
-    patch_entry* entries;
-    u_char* old_data;
-    u_char* new_data;
-    u_char* patch_data;
-    off_t old_size, new_size, patch_size;
-    off_t current_offset;
-    int i;
+    off_t num_patches, size, max_size = 0;
+    off_t i;
     
-    /* Initialize header */
-    memcpy(header.magic, MULTIPATCH_MAGIC, 8);
-    header.num_patches = num_files;
-    header.total_newsize = 0;
+    if (!multipatch_valid(container, container_size)) {
+        return -1;
+    }
     
-    /* Calculate required container size and total output size */
-    off_t required_size = (off_t)sizeof(multipatch_header) + (off_t)num_files * (off_t)sizeof(patch_entry);
+    num_patches = read_off_t(container + 8);
+    if (memcmp(container, MULTIPATCH_MAGIC, 8) != 0 || num_patches < 2) {
+        return 0;
+    }
     
-    for (i = 0; i < num_files; i++) {
-        old_size = 0;
-        new_size = 0;
-        
-        /* Validate file pointers */
-        if (old_files[i] == NULL || new_files[i] == NULL) {
-            fprintf(stderr, "Error: NULL file pointer at index %d\n", i);
-            return -1;
-        }
-        
-        /* Read input files */
-        old_size = read_file(old_files[i], &old_data);
-        if (old_size < 0) {
-            fprintf(stderr, "Error: Could not read old file %s\n", old_files[i]);
-            return -1;
-        }
-        
-        new_size = read_file(new_files[i], &new_data);
-        if (new_size < 0) {
-            fprintf(stderr, "Error: Could not read new file %s\n", new_files[i]);
-            free(old_data);
-            return -1;
-        }
-        
-        /* Calculate patch size */
-        patch_size = bsdiff_patchsize_max(old_size, new_size);
-        required_size += patch_size;
-        
-        /* Update total output size */
-        header.total_newsize += new_size;
-        
-        /* Free memory */
-        free(old_data);
-        free(new_data);
+    for (i = 0; i < num_patches; i++) {
+        size = read_off_t(container + sizeof(multipatch_header) +
+                          i * (off_t)sizeof(patch_entry) + 24);
+        if (size > max_size) max_size = size;
     }
+    return max_size;
+}
+
+int
+apply_multipatch_memory(u_char* old_data, off_t old_size,
+                        u_char* container, off_t container_size,
+                        u_char* out, off_t out_size,
+                        u_char* scratch, bspatch_workspace* ws)
+{
+    u_char* src;
+    u_char* dst;
+    off_t num_patches, total_newsize, scratch_size, src_size;
+    off_t i;
+    int res;
     
-    /* Check if container is large enough */
-    if (required_size > container_size) {
-        fprintf(stderr, "Error: Container size too small (need %lld bytes, have %lld bytes)\n", 
-                (long long)required_size, (long long)container_size);
+    if (old_data == NULL || old_size < 0 || out == NULL || ws == NULL) {
         return -1;
     }
+    if (!multipatch_valid(container, container_size)) {
+        return -2;
+    }
     
-    /* Write header */
-    memcpy(container, header.magic, 8);
-    write_off_t(header.num_patches, container + 8);
-    write_off_t(header.total_newsize, container + 16);
-    
-    /* Allocate memory for patch entries */
-    entries = malloc(num_files * sizeof(patch_entry));
-    if (entries == NULL) {
-        fprintf(stderr, "Error: Could not allocate memory for patch entries\n");
+    num_patches = read_off_t(container + 8);
+    total_newsize = multipatch_total_size(container, container_size);
+    if (out_size < total_newsize) {
         return -1;
     }
     
-    /* Initialize current offset */
-    current_offset = (off_t)sizeof(multipatch_header) + (off_t)num_files * (off_t)sizeof(patch_entry);
-    
-    /* Create patches */
-    for (i = 0; i < num_files; i++) {
-        /* Read input files */
-        old_size = read_file(old_files[i], &old_data);
-        if (old_size < 0) {
-            fprintf(stderr, "Error: Could not read old file %s\n", old_files[i]);
-            free(entries);
-            return -1;
-        }
-        
-        new_size = read_file(new_files[i], &new_data);
-        if (new_size < 0) {
-            fprintf(stderr, "Error: Could not read new file %s\n", new_files[i]);
-            free(old_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Calculate patch size with validation */
-        patch_size = bsdiff_patchsize_max(old_size, new_size);
-        if (patch_size <= 0) {
-            fprintf(stderr, "Error: Invalid patch size calculated for files %s and %s\n", 
-                    old_files[i], new_files[i]);
-            free(old_data);
-            free(new_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Check if adding this patch would overflow the container */
-        if (current_offset + patch_size > container_size) {
-            fprintf(stderr, "Error: Container size too small for patch %d (need %lld more bytes)\n", 
-                    i, (long long)(current_offset + patch_size - container_size));
-            free(old_data);
-            free(new_data);
-            free(entries);
-            return -1;
-        }
+    /* Independent chunks go straight to their place in the output */
+    if (memcmp(container, MULTIPATCH_CHUNKED_MAGIC, 8) == 0) {
+        chunk_entry e;
         
-        /* Allocate memory for patch */
-        patch_data = malloc((size_t)patch_size);
-        if (patch_data == NULL) {
-            fprintf(stderr, "Error: Could not allocate %lld bytes for patch\n", 
-                    (long long)patch_size);
-            free(old_data);
-            free(new_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Create patch with error handling */
-        bool print_stats = false;
-        if (i == num_files - 1) print_stats = true;
-        int res = bsdiff(old_data, old_size, new_data, new_size, patch_data, patch_size, print_stats);
-        if (res <= 0) {
-            fprintf(stderr, "Error: Could not create patch for files %s and %s (error: %d)\n", 
-                    old_files[i], new_files[i], res);
-            free(old_data);
-            free(new_data);
-            free(patch_data);
-            free(entries);
-            return -1;
+        for (i = 0; i < num_patches; i++) {
+            multipatch_chunk_info(container, container_size, (int)i, &e);
+            res = multipatch_apply_chunk(container, container_size, (int)i,
+                                         old_data, old_size,
+                                         out + e.new_offset, e.new_size, ws);
+            if (res != 0) return res;
         }
+        return 0;
+    }
+    
+    /* A chain reads each output back as the next input. Outputs alternate
+       between 'out' and 'scratch', starting so that the last one lands in
+       'out'. Patches are decoded where they lie in the container. */
+    scratch_size = multipatch_scratch_size(container, container_size);
+    if (num_patches > 1 && (scratch == NULL || out_size < scratch_size)) {
+        return -1;
+    }
+    
+    src = old_data;
+    src_size = old_size;
+    for (i = 0; i < num_patches; i++) {
+        u_char* entry = container + sizeof(multipatch_header) + i * (off_t)sizeof(patch_entry);
+        off_t patch_offset = read_off_t(entry);
+        off_t patch_size = read_off_t(entry + 8);
+        off_t input_size = read_off_t(entry + 16);
+        off_t output_size = read_off_t(entry + 24);
         
-        /* Update patch size and validate */
-        patch_size = res;
-        if (patch_size <= 0 || patch_size > container_size - current_offset) {
-            fprintf(stderr, "Error: Invalid patch size %lld for files %s and %s\n", 
-                    (long long)patch_size, old_files[i], new_files[i]);
-            free(old_data);
-            free(new_data);
-            free(patch_data);
-            free(entries);
-            return -1;
+        if (input_size != src_size) {
+            return -3;
         }
         
-        /* Fill in patch entry */
-        entries[i].patch_offset = current_offset;
-        entries[i].patch_size = patch_size;
-        entries[i].input_size = old_size;
-        entries[i].output_size = new_size;
-        
-        /* Copy patch data to container */
-        memcpy(container + current_offset, patch_data, patch_size);
-        
-        /* Update current offset */
-        current_offset += patch_size;
+        dst = ((num_patches - 1 - i) % 2 == 0) ? out : scratch;
+        res = bspatch_with_workspace(src, src_size, dst, output_size,
+                                     container + patch_offset, patch_size,
+                                     ws, NULL);
+        if (res != 0) return res;
         
-        /* Free memory */
-        free(old_data);
-        free(new_data);
-        free(patch_data);
-    }
-    
-    /* Write patch entries */
-    off_t MaxOutputSize = 0;
-    off_t MaxInputSize = 0;
-    for (i = 0; i < num_files; i++) {
-        off_t offset = (off_t)sizeof(multipatch_header) + i * (off_t)sizeof(patch_entry);
-        write_off_t(entries[i].patch_offset, container + offset);
-        write_off_t(entries[i].patch_size, container + offset + 8);
-        write_off_t(entries[i].input_size, container + offset + 16);
-        write_off_t(entries[i].output_size, container + offset + 24);
-        if (entries[i].input_size > MaxInputSize) MaxInputSize = entries[i].input_size;
-        if (entries[i].output_size > MaxOutputSize) MaxOutputSize = entries[i].output_size;
+        src = dst;
+        src_size = output_size;
     }
-    printf("MaxInputSize: %lld\n", (long long)MaxInputSize);
-    printf("MaxOutputSize: %lld\n", (long long)MaxOutputSize);
     
-    /* Free memory */
-    free(entries);
-    
-    return current_offset;
+    return (src_size == total_newsize) ? 0 : -3;
 }
 
 int
 apply_multipatch(const char* input_file, const char* output_file, 
                 u_char* container, off_t container_size)
 {
-    multipatch_header header;
-    patch_entry* entries;
-    u_char* input_data;
-    u_char* output_data;
-    u_char* patch_data;
-    off_t input_size;
-    off_t output_size;
-    off_t patch_size;
-    int i;
+    bspatch_workspace ws;
+    fileio_buf in, out;
+    u_char* mem;
+    off_t total_newsize, scratch_size, out_size, ws_size;
+    int res;
     
     /* Validate input parameters */
     if (input_file == NULL || output_file == NULL || container == NULL || container_size <= 0) {
@@ -353,170 +1891,75 @@ apply_multipatch(const char* input_file, const char* output_file,
         return -1;
     }
     
-    /* Read input file */
-    input_size = read_file(input_file, &input_data);
-    if (input_size < 0) {
-        fprintf(stderr, "Error: Could not read input file %s\n", input_file);
+    if (!multipatch_valid(container, container_size)) {
+        fprintf(stderr, "Error: Invalid multi-patch container\n");
         return -1;
     }
     
-    /* Validate container size */
-    if (container_size < (off_t)sizeof(multipatch_header)) {
-        fprintf(stderr, "Error: Container size too small for header\n");
-        free(input_data);
+    total_newsize = multipatch_total_size(container, container_size);
+    scratch_size = multipatch_scratch_size(container, container_size);
+    ws_size = multipatch_workspace_size(container, container_size, &ws);
+    if (total_newsize < 0 || ws_size < 0) {
+        fprintf(stderr, "Error: Invalid multi-patch container\n");
         return -1;
     }
+    out_size = (scratch_size > total_newsize) ? scratch_size : total_newsize;
     
-    /* Read header */
-    memcpy(header.magic, container, 8);
-    if (memcmp(header.magic, MULTIPATCH_MAGIC, 8) != 0) {
-        fprintf(stderr, "Error: Invalid multipatch magic number\n");
-        free(input_data);
+    /* The chain's second buffer and the workspace share one allocation;
+       the output is written in place and cut to its final size */
+    if ((unsigned long long)scratch_size + ws_size >= (unsigned long long)SIZE_MAX) {
+        fprintf(stderr, "Error: Multi-patch output is too large\n");
         return -1;
     }
-    
-    header.num_patches = read_off_t(container + 8);
-    header.total_newsize = read_off_t(container + 16);
-    
-    /* Validate header */
-    if (header.num_patches <= 0 || header.num_patches > 1000) {
-        fprintf(stderr, "Error: Invalid number of patches in header (%lld)\n", 
-                (long long)header.num_patches);
-        free(input_data);
+    mem = malloc((size_t)(scratch_size + ws_size) + 1);
+    if (mem == NULL) {
+        fprintf(stderr, "Error: Could not allocate %lld bytes for output\n", 
+                (long long)(scratch_size + ws_size));
         return -1;
     }
+    bspatch_workspace_attach(&ws, mem + scratch_size);
     
-    if (header.total_newsize <= 0) {
-        fprintf(stderr, "Error: Invalid total new size in header (%lld)\n", 
-                (long long)header.total_newsize);
-        free(input_data);
+    if (fileio_read(input_file, FILEIO_WILLNEED, &in) != 0) {
+        fprintf(stderr, "Error: Could not read input file %s\n", input_file);
+        free(mem);
         return -1;
     }
     
-    /* Allocate memory for patch entries */
-    entries = malloc(header.num_patches * sizeof(patch_entry));
-    if (entries == NULL) {
-        fprintf(stderr, "Error: Could not allocate memory for patch entries\n");
-        free(input_data);
+    if (fileio_create(output_file, out_size, &out) != 0) {
+        fprintf(stderr, "Error: Could not create output file %s\n", output_file);
+        fileio_release(&in);
+        free(mem);
         return -1;
     }
     
-    /* Read patch entries */
-    for (i = 0; i < header.num_patches; i++) {
-        off_t offset = (off_t)sizeof(multipatch_header) + i * (off_t)sizeof(patch_entry);
-        if (offset + (off_t)sizeof(patch_entry) > container_size) {
-            fprintf(stderr, "Error: Container size too small for patch entries\n");
-            free(input_data);
-            free(entries);
-            return -1;
-        }
-        
-        entries[i].patch_offset = read_off_t(container + offset);
-        entries[i].patch_size = read_off_t(container + offset + 8);
-        entries[i].input_size = read_off_t(container + offset + 16);
-        entries[i].output_size = read_off_t(container + offset + 24);
-        
-        /* Validate patch entry */
-        if (entries[i].patch_offset < 0 || entries[i].patch_size <= 0 ||
-            entries[i].input_size <= 0 || entries[i].output_size <= 0) {
-            fprintf(stderr, "Error: Invalid patch entry %d\n", i);
-            free(input_data);
-            free(entries);
-            return -1;
-        }
-        
-        if (entries[i].patch_offset + entries[i].patch_size > container_size) {
-            fprintf(stderr, "Error: Patch %d extends beyond container size\n", i);
-            free(input_data);
-            free(entries);
-            return -1;
-        }
-    }
-    
-    /* Allocate memory for output */
-    output_data = malloc((size_t)header.total_newsize);
-    if (output_data == NULL) {
-        fprintf(stderr, "Error: Could not allocate %lld bytes for output\n", 
-                (long long)header.total_newsize);
-        free(input_data);
-        free(entries);
+    res = apply_multipatch_memory(in.data, in.size, container, container_size,
+                                  out.data, out_size, mem, &ws);
+    fileio_release(&in);
+    free(mem);
+    if (res != 0) {
+        fprintf(stderr, "Error: Failed to apply multi-patch (error: %d)\n", res);
+        fileio_release(&out);
         return -1;
     }
     
-    /* Apply patches */
-    for (i = 0; i < header.num_patches; i++) {
-        /* Validate patch data */
-        if (entries[i].input_size != input_size) {
-            fprintf(stderr, "Error: Input size mismatch for patch %d (expected %lld, got %lld)\n", 
-                    i, (long long)entries[i].input_size, (long long)input_size);
-            free(input_data);
-            free(output_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Allocate memory for patch */
-        patch_data = malloc((size_t)entries[i].patch_size);
-        if (patch_data == NULL) {
-            fprintf(stderr, "Error: Could not allocate %lld bytes for patch %d\n", 
-                    (long long)entries[i].patch_size, i);
-            free(input_data);
-            free(output_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Copy patch data */
-        memcpy(patch_data, container + entries[i].patch_offset, (size_t)entries[i].patch_size);
-        
-        /* Apply patch */
-        int res = bspatch(input_data, input_size, output_data, entries[i].output_size, 
-                         patch_data, entries[i].patch_size);
-        if (res != 0) {
-            fprintf(stderr, "Error: Failed to apply patch %d (error: %d)\n", i, res);
-            free(input_data);
-            free(output_data);
-            free(patch_data);
-            free(entries);
-            return -1;
-        }
-        
-        /* Update input data for next patch */
-        free(input_data);
-        input_data = output_data;
-        input_size = entries[i].output_size;
-        
-        /* Allocate new output buffer for next patch */
-        if (i < header.num_patches - 1) {
-            output_data = malloc((size_t)header.total_newsize);
-            if (output_data == NULL) {
-                fprintf(stderr, "Error: Could not allocate %lld bytes for output\n", 
-                        (long long)header.total_newsize);
-                free(input_data);
-                free(patch_data);
-                free(entries);
-                return -1;
-            }
-        }
-        
-        free(patch_data);
-    }
-    
     /* Write output file */
-    if (write_file(output_file, output_data, header.total_newsize) != 0) {
+    if (fileio_commit(&out, total_newsize) != 0) {
         fprintf(stderr, "Error: Could not write output file %s\n", output_file);
-        free(input_data);
-        free(entries);
         return -1;
     }
     
-    /* Cleanup */
-    free(input_data);
-    free(entries);
-    
     return 0;
 }
 
+off_t
+multipatch_num_patches(u_char* container, off_t container_size)
+{
+    if (!multipatch_valid(container, container_size)) {
+        return -1;
+    }
+    return read_off_t(container + 8);
+}
+
 off_t
 multipatch_total_size(u_char* container, off_t container_size)
 {
@@ -526,10 +1969,23 @@ multipatch_total_size(u_char* container, off_t container_size)
     }
     
     /* Validate magic number */
-    if (memcmp(container, MULTIPATCH_MAGIC, 8) != 0) {
+    if (container_entry_size(container) == 0) {
         return -1;
     }
     
+    /* A chain produces the output of its last entry; the header holds the
+       sum of all entry outputs */
+    if (memcmp(container, MULTIPATCH_MAGIC, 8) == 0) {
+        off_t num_patches = read_off_t(container + 8);
+        
+        if (num_patches <= 0 ||
+            num_patches > (container_size - (off_t)sizeof(multipatch_header)) / (off_t)sizeof(patch_entry)) {
+            return -1;
+        }
+        return read_off_t(container + sizeof(multipatch_header) +
+                          (num_patches - 1) * (off_t)sizeof(patch_entry) + 24);
+    }
+    
     /* Return total output size */
     return read_off_t(container + 16);
 }
@@ -538,6 +1994,8 @@ bool
 multipatch_valid(u_char* container, off_t container_size)
 {
     multipatch_header header;
+    off_t entry_size;
+    off_t next_new = 0;
     off_t i;
     
     /* Check container size */
@@ -551,37 +2009,91 @@ multipatch_valid(u_char* container, off_t container_size)
     header.total_newsize = read_off_t(container + 16);
     
     /* Validate magic number */
-    if (memcmp(header.magic, MULTIPATCH_MAGIC, 8) != 0) {
+    entry_size = container_entry_size(container);
+    if (entry_size == 0) {
         return false;
     }
     
     /* Check for valid number of patches */
-    if (header.num_patches <= 0) {
+    if (header.num_patches <= 0 || header.num_patches > INT_MAX || header.total_newsize < 0) {
         return false;
     }
     
     /* Check container size again */
-    if ((off_t)(sizeof(multipatch_header) + header.num_patches * sizeof(patch_entry)) > container_size) {
+    if (header.num_patches > (container_size - (off_t)sizeof(multipatch_header)) / entry_size) {
         return false;
     }
     
     /* Validate patch entries */
     for (i = 0; i < header.num_patches; i++) {
-        off_t offset = (off_t)sizeof(multipatch_header) + i * (off_t)sizeof(patch_entry);
+        off_t offset = (off_t)sizeof(multipatch_header) + i * entry_size;
         off_t patch_offset = read_off_t(container + offset);
         off_t patch_size = read_off_t(container + offset + 8);
-        off_t input_size = read_off_t(container + offset + 16);
-        off_t output_size = read_off_t(container + offset + 24);
-        
-        /* Check for valid values */
-        if (patch_offset < 0 || 
-            patch_size < 0 || 
-            input_size < 0 || 
-            output_size < 0 ||
-            patch_offset + patch_size > container_size) {
+        
+        if (patch_offset < 0 || patch_size < 0 ||
+            patch_size > container_size - patch_offset) {
             return false;
         }
+        
+        if (entry_size == (off_t)sizeof(chunk_entry)) {
+            chunk_entry e;
+            
+            /* New ranges tile the output in order */
+            read_chunk_entry(container, i, &e);
+            if (e.old_offset < 0 || e.old_size < 0 || e.new_size <= 0 ||
+                e.new_offset != next_new ||
+                e.new_size > header.total_newsize - e.new_offset) {
+                return false;
+            }
+            next_new += e.new_size;
+        } else {
+            off_t input_size = read_off_t(container + offset + 16);
+            off_t output_size = read_off_t(container + offset + 24);
+            
+            if (input_size < 0 || output_size < 0) {
+                return false;
+            }
+        }
+    }
+    
+    if (entry_size == (off_t)sizeof(chunk_entry) && next_new != header.total_newsize) {
+        return false;
     }
     
     return true;
 }
+
+off_t
+multipatch_workspace_size(u_char* container, off_t container_size,
+                          bspatch_workspace* ws)
+{
+    bspatch_workspace entry_ws;
+    off_t num_patches;
+    off_t i;
+    
+    if (!multipatch_valid(container, container_size) || ws == NULL) {
+        return -1;
+    }
+    
+    ws->ctrl = NULL;  ws->ctrlsz = 0;
+    ws->diff = NULL;  ws->diffsz = 0;
+    ws->extra = NULL; ws->extrasz = 0;
+    
+    num_patches = read_off_t(container + 8);
+    for (i = 0; i < num_patches; i++) {
+        off_t offset = (off_t)sizeof(multipatch_header) + i * container_entry_size(container);
+        off_t patch_offset = read_off_t(container + offset);
+        off_t patch_size = read_off_t(container + offset + 8);
+        
+        if (bspatch_workspace_size(container + patch_offset, patch_size, &entry_ws) < 0) {
+            fprintf(stderr, "Error: Invalid patch header in entry %lld\n", (long long)i);
+            return -1;
+        }
+        
+        if (entry_ws.ctrlsz > ws->ctrlsz) ws->ctrlsz = entry_ws.ctrlsz;
+        if (entry_ws.diffsz > ws->diffsz) ws->diffsz = entry_ws.diffsz;
+        if (entry_ws.extrasz > ws->extrasz) ws->extrasz = entry_ws.extrasz;
+    }
+    
+    return ws->ctrlsz + ws->diffsz + ws->extrasz;
+}
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include "minibsdiff-config.h"
+#include "bspatch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,26 +31,261 @@ typedef struct {
     off_t output_size;    /* Size of output for this patch */
 } patch_entry;
 
+/* Magic number for the independent-chunk container. Its entries are
+   chunk_entry instead of patch_entry. */
+#define MULTIPATCH_CHUNKED_MAGIC "MPATCH02"
+
+/* Chunk entry: the patch turns old[old_offset, old_offset+old_size) into
+   new[new_offset, new_offset+new_size) without depending on other chunks.
+   New ranges tile the output in order; old ranges may overlap, and may be
+   the whole old image. */
+typedef struct {
+    off_t patch_offset;   /* Offset to patch data in container */
+    off_t patch_size;     /* Size of this patch */
+    off_t old_offset;     /* Old range this patch reads */
+    off_t old_size;
+    off_t new_offset;     /* New range this patch writes */
+    off_t new_size;
+} chunk_entry;
+
+/* What the chunk patch cache did, added up over calls */
+typedef struct {
+    int hits;             /* chunks whose patch came from the cache */
+    int misses;           /* chunks diffed */
+    int store_errors;     /* diffed chunks that could not be stored */
+} multipatch_cache_stats;
+
+/* Tuning for multi-patch creation. A zeroed struct gives the defaults. */
+typedef struct {
+    int threads;          /* chunks diffed concurrently; 0 or 1 is serial */
+    off_t memory_limit;   /* cap on the estimated memory of the chunk diffs
+                             in flight, in bytes; 0 for no cap */
+    const char* cache_dir; /* existing directory of finished chunk patches,
+                             named by a digest of the chunk's old and new
+                             data; NULL for no cache. A cached patch is
+                             used only if it reproduces the new data. */
+    multipatch_cache_stats* cache_stats; /* updated when not NULL */
+    int filter;           /* BSDIFF_FILTER_* applied to every chunk, with
+                             the chunk offsets as bases */
+    int diff_mode;        /* BSDIFF_DIFF_* of every chunk */
+    int ops;              /* BSDIFF_OP_* chunk patches may use */
+    int extra_dict;       /* prime the extra blocks with old data */
+    int sparse_diff;      /* skip the zeros of the diff blocks */
+    int max_compression;  /* also try a planned parse, keep the smaller */
+    int engine;           /* BSDIFF_ENGINE_* match finder */
+    int stride;           /* index every stride-th old suffix; 0 for all */
+    const char* index_dir; /* existing directory to sort the shared index
+                             of the whole old image in, in runs of at most
+                             memory_limit bytes, for old images larger than
+                             memory; NULL sorts it in memory */
+} multipatch_params;
+
 /*
- * Create a multi-patch container from multiple input/output file pairs
+ * Create a multi-patch container from multiple input/output file pairs,
+ * diffing one pair at a time
  * Returns the size of the container or -1 on error
  */
 off_t create_multipatch(const char** old_files, const char** new_files, int num_files, 
                        u_char* container, off_t container_size);
 
+/* One old/new pair of a multi-patch, given as caller-owned buffers */
+typedef struct {
+    u_char* old_data;
+    off_t old_size;
+    u_char* new_data;
+    off_t new_size;
+} multipatch_input;
+
+/*
+ * Like create_multipatch, but diffs up to params->threads chunks at once.
+ * Patches are placed in the container in index order whatever order they
+ * finish in. A chunk diff only starts if the estimated memory of all diffs
+ * in flight stays under params->memory_limit (one always runs.) 'params'
+ * may be NULL. Built with MINIBSDIFF_NO_THREADS, chunks are diffed serially.
+ *
+ * Each file is read once. The container only has to hold the header, the
+ * entry table and the finished patches; creation fails with -1 as soon as
+ * a patch does not fit.
+ */
+off_t create_multipatch_files(const char** old_files, const char** new_files, int num_files, 
+                              u_char* container, off_t container_size,
+                              const multipatch_params* params);
+
+/*
+ * Like create_multipatch_files, but diffs in-memory buffers. The buffers
+ * are only read, and must stay valid until the call returns.
+ */
+off_t create_multipatch_buffers(const multipatch_input* inputs, int num_inputs,
+                                u_char* container, off_t container_size,
+                                const multipatch_params* params);
+
+/* Old and new ranges of one chunk given to create_multipatch_chunks */
+typedef struct {
+    off_t old_offset;
+    off_t old_size;
+    off_t new_offset;
+    off_t new_size;
+} multipatch_chunk;
+
+/*
+ * Create an independent-chunk (MPATCH02) container from one old and one new
+ * image. Chunk i diffs its new range against its old range; the new ranges
+ * must tile the new image in order. Chunks whose old range is the whole old
+ * image share one suffix index of it, built once, so each may seek anywhere
+ * in the old image while only producing its own slice of the output.
+ * 'params' is used as in create_multipatch_files.
+ * Returns the size of the container or -1 on error
+ */
+off_t create_multipatch_chunks(u_char* old_data, off_t old_size,
+                               u_char* new_data, off_t new_size,
+                               const multipatch_chunk* chunks, int num_chunks,
+                               u_char* container, off_t container_size,
+                               const multipatch_params* params);
+
+/* What the layout search of create_multipatch_budget did */
+typedef struct {
+    int trials;           /* layouts evaluated */
+    int diffs;            /* chunk ranges diffed */
+    int reused;           /* chunk diffs reused from an earlier trial */
+} multipatch_budget_stats;
+
+/* Device RAM budget for create_multipatch_budget. A zeroed struct gives
+   the defaults. */
+typedef struct {
+    off_t ctrl_size;      /* largest decompressed ctrl block; 0 for no limit */
+    off_t diff_size;      /* largest decompressed diff block; 0 for no limit */
+    off_t extra_size;     /* largest decompressed extra block; 0 for no limit */
+    off_t window;         /* 0: chunks see the whole old image; otherwise
+                             the anchor-aligned old window size */
+    int max_chunks;       /* most chunks to try; 0 for 4096 */
+    multipatch_budget_stats* stats; /* filled in when not NULL */
+} multipatch_budget;
+
+/*
+ * Create an MPATCH02 container whose chunks all fit a device budget, looking
+ * for the smallest total size. Chunks that exceed the budget are bisected
+ * until every one fits, giving a non-uniform layout, and uniform layouts
+ * are searched for the fewest chunks that fit; the smaller container wins.
+ * The old image is indexed once, and a range diffed by one trial is reused
+ * by every later trial and by the final container.
+ * Returns the size of the container or -1 on error
+ */
+off_t create_multipatch_budget(u_char* old_data, off_t old_size,
+                               u_char* new_data, off_t new_size,
+                               const multipatch_budget* budget,
+                               u_char* container, off_t container_size,
+                               const multipatch_params* params);
+
 /*
- * Apply a multi-patch container to a sequence of files
+ * Index of content anchors (rolling-hash fingerprints) of an old image,
+ * used to pick the old window a chunk is diffed against. The old image
+ * is only read while building.
+ * Returns NULL when out of memory
+ */
+typedef struct multipatch_anchors multipatch_anchors;
+
+multipatch_anchors* multipatch_anchors_build(const u_char* old_data, off_t old_size);
+void multipatch_anchors_free(multipatch_anchors* idx);
+
+/*
+ * Find the old window of at most 'max_window' bytes that best matches a
+ * new chunk: the anchors of the chunk are looked up in 'idx', and the
+ * window is placed over the densest group of matches and widened around
+ * it up to the limit. On a match the window is stored in 'old_start' and
+ * 'old_len'; otherwise they are left alone.
+ * Returns the number of anchors supporting the window, 0 if none
+ */
+int multipatch_select_window(const multipatch_anchors* idx,
+                             const u_char* new_data, off_t new_size,
+                             off_t max_window, off_t* old_start, off_t* old_len);
+
+/*
+ * Apply a multi-patch container to a file. MPATCH01 entries are applied as
+ * a chain; each MPATCH02 chunk is applied from its own old range. The input
+ * file is mapped when the platform allows it, and the output, scratch and
+ * workspace memory come from a single allocation
  * Returns 0 on success, -1 on error
  */
 int apply_multipatch(const char* input_file, const char* output_file, 
                     u_char* container, off_t container_size);
 
 /*
- * Get the total output size from a multi-patch container
+ * Size of the second buffer a chained (MPATCH01) container of several
+ * entries needs, i.e. its largest entry output; 0 for other containers
+ * Returns the size or -1 on error
+ */
+off_t multipatch_scratch_size(u_char* container, off_t container_size);
+
+/*
+ * Apply a multi-patch container from memory without allocating. Patches are
+ * decoded where they lie in the container. 'out' receives the new image and
+ * holds 'out_size' bytes, at least multipatch_total_size. A chain of
+ * several MPATCH01 entries alternates between 'out' and 'scratch', which
+ * must then both hold multipatch_scratch_size bytes; otherwise 'scratch'
+ * may be NULL. 'ws' must be attached to multipatch_workspace_size bytes.
+ * Returns 0 on success, -1 for bad arguments, -2 for an invalid container
+ * or -3 for a corrupt patch
+ */
+int apply_multipatch_memory(u_char* old_data, off_t old_size,
+                            u_char* container, off_t container_size,
+                            u_char* out, off_t out_size,
+                            u_char* scratch, bspatch_workspace* ws);
+
+/*
+ * Like apply_multipatch, but applies up to 'threads' MPATCH02 chunks at
+ * once. Each worker patches into a buffer of one chunk and writes it at
+ * its offset in the output file, so memory stays at 'threads' times the
+ * largest chunk plus its workspace. MPATCH01 containers are applied as a
+ * chain by apply_multipatch.
+ * Returns 0 on success, -1 on error
+ */
+int apply_multipatch_threads(const char* input_file, const char* output_file,
+                             u_char* container, off_t container_size, int threads);
+
+/*
+ * Read entry i of an MPATCH02 container, checking that its patch lies in
+ * the container. A device streams a multi-patch by looping over the
+ * chunks with multipatch_chunk_info and multipatch_apply_chunk.
+ * Returns 0 on success, -1 on error
+ */
+int multipatch_chunk_info(u_char* container, off_t container_size, int i,
+                          chunk_entry* entry);
+
+/*
+ * Apply chunk i of an MPATCH02 container to the whole old image, writing
+ * its new_size bytes to 'out', which holds 'out_size' bytes; the caller
+ * stores them at new_offset. 'ws' must be attached to at least
+ * multipatch_workspace_size bytes; nothing is allocated, so the RAM needed
+ * is one chunk plus the workspace.
+ * Returns 0 on success, or a negative bspatch_with_workspace error
+ */
+int multipatch_apply_chunk(u_char* container, off_t container_size, int i,
+                           u_char* old_data, off_t old_size,
+                           u_char* out, off_t out_size,
+                           bspatch_workspace* ws);
+
+/*
+ * Get the number of entries of a multi-patch container
+ * Returns the number or -1 on error
+ */
+off_t multipatch_num_patches(u_char* container, off_t container_size);
+
+/*
+ * Get the total output size from a multi-patch container. For a chained
+ * (MPATCH01) container this is the output of its last entry
  * Returns the size or -1 on error
  */
 off_t multipatch_total_size(u_char* container, off_t container_size);
 
+/*
+ * Determine the scratch memory needed to apply any single patch in a
+ * multi-patch container. The largest ctrl, diff and extra sizes over all
+ * entries are stored in 'ws' (see bspatch_workspace_size)
+ * Returns the total workspace size or -1 on error
+ */
+off_t multipatch_workspace_size(u_char* container, off_t container_size,
+                                bspatch_workspace* ws);
+
 /*
  * Validate a multi-patch container
  * Returns true if valid, false otherwise